@@ -69,5 +69,11 @@ fuzz/fuzz_format_parsers corpus/format_parsers \
 	-reload=30 -print_pcs=1 -print_funcs=30 -timeout=10 -runs=1
 fuzz/fuzz_auth corpus/auth \
 	-reload=30 -print_pcs=1 -print_funcs=30 -timeout=10 -runs=1
+fuzz/fuzz_format_parsers_replay -n 1 -o /dev/null corpus/format_parsers
+fuzz/fuzz_auth_replay -n 1 -o /dev/null corpus/auth
+fuzz/fuzz_auth_bench -w 2 -d 1
+mkdir -p corpus/ssh_key
+fuzz/fuzz_ssh_key corpus/ssh_key \
+	-reload=30 -print_pcs=1 -print_funcs=30 -timeout=10 -runs=1
 
 popd &>/dev/null # fakeroot
@@ -16,19 +16,38 @@
 #include "debug.h"
 
 static void cfg_load_arg_debug(cfg_t *cfg, const char *arg) {
+  int lvl;
+
   if (strcmp(arg, "debug") == 0)
-    cfg->debug = 1;
-  else if (strncmp(arg, "debug_file=", strlen("debug_file=")) == 0) {
+    cfg->debug = DEBUG_LVL_TRACE;
+  else if (strncmp(arg, "debug_level=", strlen("debug_level=")) == 0) {
+    if ((lvl = debug_level(arg + strlen("debug_level="))) != -1)
+      cfg->debug = lvl;
+  } else if (strncmp(arg, "debug_file=", strlen("debug_file=")) == 0) {
     debug_close(cfg->debug_file);
     cfg->debug_file = debug_open(arg + strlen("debug_file="));
   }
 }
 
+/* PAM code named by the nodevice option, -1 if unknown. */
+static int cfg_nodevice(const char *name) {
+  if (strcmp(name, "ignore") == 0)
+    return PAM_IGNORE;
+  if (strcmp(name, "authinfo_unavail") == 0)
+    return PAM_AUTHINFO_UNAVAIL;
+  if (strcmp(name, "auth_err") == 0)
+    return PAM_AUTH_ERR;
+  return -1;
+}
+
 static void cfg_load_arg(cfg_t *cfg, const char *arg) {
   if (strncmp(arg, "max_devices=", strlen("max_devices=")) == 0) {
     sscanf(arg, "max_devices=%u", &cfg->max_devs);
   } else if (strcmp(arg, "manual") == 0) {
     cfg->manual = 1;
+  } else if (strcmp(arg, "manual_select") == 0) {
+    cfg->manual = 1;
+    cfg->manual_select = 1;
   } else if (strcmp(arg, "nouserok") == 0) {
     cfg->nouserok = 1;
   } else if (strcmp(arg, "openasuser") == 0) {
@@ -41,6 +60,8 @@ static void cfg_load_arg(cfg_t *cfg, const char *arg) {
     cfg->cue = 1;
   } else if (strcmp(arg, "nodetect") == 0) {
     cfg->nodetect = 1;
+  } else if (strncmp(arg, "nodevice=", strlen("nodevice=")) == 0) {
+    cfg->nodevice = cfg_nodevice(arg + strlen("nodevice="));
   } else if (strcmp(arg, "expand") == 0) {
     cfg->expand = 1;
   } else if (strncmp(arg, "userpresence=", strlen("userpresence=")) == 0) {
@@ -58,6 +79,25 @@ static void cfg_load_arg(cfg_t *cfg, const char *arg) {
   } else if (strncmp(arg, "authpending_file=", strlen("authpending_file=")) ==
              0) {
     cfg->authpending_file = arg + strlen("authpending_file=");
+  } else if (strncmp(arg, "migrate_sidecar=", strlen("migrate_sidecar=")) ==
+             0) {
+    cfg->migrate_sidecar = arg + strlen("migrate_sidecar=");
+  } else if (strncmp(arg, "event_socket=", strlen("event_socket=")) == 0) {
+    cfg->event_socket = arg + strlen("event_socket=");
+  } else if (strncmp(arg, "sigcount_file=", strlen("sigcount_file=")) == 0) {
+    cfg->sigcount_file = arg + strlen("sigcount_file=");
+  } else if (strncmp(arg, "rk_cache=", strlen("rk_cache=")) == 0) {
+    cfg->rk_cache = arg + strlen("rk_cache=");
+  } else if (strncmp(arg, "usage_file=", strlen("usage_file=")) == 0) {
+    cfg->usage_file = arg + strlen("usage_file=");
+  } else if (strncmp(arg, "keyring_cache=", strlen("keyring_cache=")) == 0) {
+    sscanf(arg, "keyring_cache=%d", &cfg->keyring_cache);
+  } else if (strncmp(arg, "device_lock=", strlen("device_lock=")) == 0) {
+    sscanf(arg, "device_lock=%d", &cfg->device_lock);
+#ifdef WITH_CTAP_TRACE
+  } else if (strncmp(arg, "ctap_record=", strlen("ctap_record=")) == 0) {
+    cfg->ctap_record = arg + strlen("ctap_record=");
+#endif
   } else if (strncmp(arg, "origin=", strlen("origin=")) == 0) {
     cfg->origin = arg + strlen("origin=");
   } else if (strncmp(arg, "appid=", strlen("appid=")) == 0) {
@@ -243,6 +283,7 @@ static void cfg_reset(cfg_t *cfg) {
   cfg->userpresence = -1;
   cfg->userverification = -1;
   cfg->pinverification = -1;
+  cfg->event_fd = -1;
 }
 
 int cfg_init(cfg_t *cfg, int flags, int argc, const char **argv) {
@@ -267,6 +308,30 @@ int cfg_init(cfg_t *cfg, int flags, int argc, const char **argv) {
   for (i = 0; i < argc; i++)
     cfg_load_arg(cfg, argv[i]);
 
+  if (cfg->nodevice < 0) {
+    debug_warn(cfg, "Unknown nodevice code, authenticator check disabled");
+    cfg->nodevice = 0;
+  }
+
+  if (cfg->expand && cfg->auth_file &&
+      expand_compile(&cfg->auth_file_tmpl, cfg->auth_file) != 0) {
+    debug_err(cfg, "Invalid variable expansion in authfile");
+    r = PAM_SERVICE_ERR;
+  }
+
+#ifdef NO_MANUAL
+  if (cfg->manual) {
+    debug_warn(cfg, "Manual mode is not supported by this build");
+    r = PAM_SERVICE_ERR;
+  }
+#endif
+#ifdef NO_SSHFORMAT
+  if (cfg->sshformat) {
+    debug_warn(cfg, "SSH format is not supported by this build");
+    r = PAM_SERVICE_ERR;
+  }
+#endif
+
 exit:
   if (cfg->debug) {
     debug_dbg(cfg, "called.");
@@ -275,22 +340,39 @@ exit:
       debug_dbg(cfg, "argv[%d]=%s", i, argv[i]);
     }
     debug_dbg(cfg, "max_devices=%d", cfg->max_devs);
-    debug_dbg(cfg, "debug=%d", cfg->debug);
+    debug_dbg(cfg, "debug_level=%d", cfg->debug);
     debug_dbg(cfg, "interactive=%d", cfg->interactive);
     debug_dbg(cfg, "cue=%d", cfg->cue);
     debug_dbg(cfg, "nodetect=%d", cfg->nodetect);
+    debug_dbg(cfg, "nodevice=%d", cfg->nodevice);
     debug_dbg(cfg, "userpresence=%d", cfg->userpresence);
     debug_dbg(cfg, "userverification=%d", cfg->userverification);
     debug_dbg(cfg, "pinverification=%d", cfg->pinverification);
     debug_dbg(cfg, "manual=%d", cfg->manual);
+    debug_dbg(cfg, "manual_select=%d", cfg->manual_select);
     debug_dbg(cfg, "nouserok=%d", cfg->nouserok);
     debug_dbg(cfg, "openasuser=%d", cfg->openasuser);
     debug_dbg(cfg, "alwaysok=%d", cfg->alwaysok);
     debug_dbg(cfg, "sshformat=%d", cfg->sshformat);
     debug_dbg(cfg, "expand=%d", cfg->expand);
+    debug_dbg(cfg, "keyring_cache=%d", cfg->keyring_cache);
+    debug_dbg(cfg, "device_lock=%d", cfg->device_lock);
     debug_dbg(cfg, "authfile=%s", cfg->auth_file ? cfg->auth_file : "(null)");
     debug_dbg(cfg, "authpending_file=%s",
               cfg->authpending_file ? cfg->authpending_file : "(null)");
+    debug_dbg(cfg, "migrate_sidecar=%s",
+              cfg->migrate_sidecar ? cfg->migrate_sidecar : "(null)");
+    debug_dbg(cfg, "event_socket=%s",
+              cfg->event_socket ? cfg->event_socket : "(null)");
+    debug_dbg(cfg, "sigcount_file=%s",
+              cfg->sigcount_file ? cfg->sigcount_file : "(null)");
+    debug_dbg(cfg, "rk_cache=%s", cfg->rk_cache ? cfg->rk_cache : "(null)");
+    debug_dbg(cfg, "usage_file=%s",
+              cfg->usage_file ? cfg->usage_file : "(null)");
+#ifdef WITH_CTAP_TRACE
+    debug_dbg(cfg, "ctap_record=%s",
+              cfg->ctap_record ? cfg->ctap_record : "(null)");
+#endif
     debug_dbg(cfg, "origin=%s", cfg->origin ? cfg->origin : "(null)");
     debug_dbg(cfg, "appid=%s", cfg->appid ? cfg->appid : "(null)");
     debug_dbg(cfg, "prompt=%s", cfg->prompt ? cfg->prompt : "(null)");
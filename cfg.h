@@ -7,12 +7,15 @@
 
 #include <stdio.h>
 
+#include "expand.h"
+
 #define CFG_DEFAULT_PATH (SCONFDIR "/pam_u2f.conf")
 #define CFG_MAX_FILE_SIZE 4096
 
 typedef struct {
   unsigned max_devs;
   int manual;
+  int manual_select;
   int debug;
   int nouserok;
   int openasuser;
@@ -20,17 +23,32 @@ typedef struct {
   int interactive;
   int cue;
   int nodetect;
+  int nodevice;
   int userpresence;
   int userverification;
   int pinverification;
   int sshformat;
   int expand;
+  int keyring_cache;
+  int device_lock;
   const char *auth_file;
   const char *authpending_file;
+  const char *migrate_sidecar;
+  const char *event_socket;
+  const char *sigcount_file;
+  const char *rk_cache;
+  const char *usage_file;
+#ifdef WITH_CTAP_TRACE
+  const char *ctap_record;
+  const char *ctap_replay;
+  int ctap_replay_delay;
+#endif
   const char *origin;
   const char *appid;
   const char *prompt;
   const char *cue_prompt;
+  expand_tmpl_t auth_file_tmpl;
+  int event_fd;
   FILE *debug_file;
   char *defaults_buffer;
 } cfg_t;
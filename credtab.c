@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "credtab.h"
+#include "debug.h"
+
+/*
+ * Per-credential data is kept in files of fixed-size slots, mapped shared
+ * into memory. Slots are found by open addressing on the credential ID, a
+ * hash of its key handle, so a lookup touches one or a few slots and a
+ * login never rewrites the file. Two tables use this layout: signature
+ * counters (sigcount_file) and usage records (usage_file).
+ *
+ * Slots are updated atomically under a shared lock; the exclusive lock is
+ * taken to initialize the file, and held for the whole of a slot claim.
+ */
+
+struct credtab_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nslots;
+};
+
+struct credtab_kind {
+  const char *magic;
+  uint32_t version;
+  size_t slot_size;
+};
+
+struct sigcount_slot {
+  unsigned char key[CREDTAB_KEY_LEN];
+  _Atomic uint32_t sigcount;
+  uint32_t reserved;
+};
+
+struct usage_slot {
+  unsigned char key[CREDTAB_KEY_LEN];
+  _Atomic uint64_t last;
+  _Atomic uint32_t count;
+  uint32_t reserved;
+};
+
+static const struct credtab_kind sigcount_kind = {
+  CREDTAB_MAGIC, CREDTAB_VERSION, sizeof(struct sigcount_slot)};
+
+static const struct credtab_kind usage_kind = {USAGE_MAGIC, USAGE_VERSION,
+                                               sizeof(struct usage_slot)};
+
+struct credtab {
+  const char *path;
+  const struct credtab_kind *kind;
+  int fd;
+  void *map;
+  size_t size;
+  unsigned char *slots;
+  uint32_t nslots;
+};
+
+/* Size of a table with the given number of slots, 0 if it overflows. */
+static size_t credtab_size(const struct credtab_kind *kind, uint32_t nslots) {
+  if (nslots > (SIZE_MAX - sizeof(struct credtab_header)) / kind->slot_size)
+    return 0;
+
+  return sizeof(struct credtab_header) + (size_t) nslots * kind->slot_size;
+}
+
+static int credtab_init(const cfg_t *cfg, const struct credtab *tab) {
+  struct credtab_header hdr;
+  size_t size;
+  ssize_t w;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, tab->kind->magic, sizeof(hdr.magic));
+  hdr.version = tab->kind->version;
+  hdr.nslots = CREDTAB_SLOTS;
+
+  if ((size = credtab_size(tab->kind, hdr.nslots)) == 0) {
+    debug_warn(cfg, "Unable to initialize %s: too many slots", tab->path);
+    return 0;
+  }
+
+  if (ftruncate(tab->fd, (off_t) size) != 0 ||
+      (w = pwrite(tab->fd, &hdr, sizeof(hdr), 0)) < 0 ||
+      (size_t) w != sizeof(hdr)) {
+    debug_warn(cfg, "Unable to initialize %s: %s", tab->path, strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Open a table, creating it if missing unless it is opened read-only. The
+ * table is returned under a shared lock, so that it is never seen while
+ * another process initializes it.
+ */
+static int credtab_open(const cfg_t *cfg, const char *path,
+                        const struct credtab_kind *kind, int writable,
+                        struct credtab *tab) {
+  const struct credtab_header *hdr;
+  struct stat st;
+
+  memset(tab, 0, sizeof(*tab));
+  tab->path = path;
+  tab->kind = kind;
+  tab->fd = -1;
+  tab->map = MAP_FAILED;
+
+  if (*path != '/') {
+    debug_warn(cfg, "%s is not an absolute path", path);
+    return 0;
+  }
+
+  if (writable)
+    tab->fd =
+      open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY, 0600);
+  else
+    tab->fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY);
+  if (tab->fd == -1) {
+    debug_warn(cfg, "Unable to open %s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  if (fstat(tab->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    debug_warn(cfg, "%s is not a regular file", path);
+    return 0;
+  }
+
+  if (flock(tab->fd, LOCK_SH) != 0 || fstat(tab->fd, &st) != 0) {
+    debug_warn(cfg, "Unable to lock %s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  if (st.st_size == 0 && writable) {
+    /* the lock is dropped while converted, so check the size again */
+    if (flock(tab->fd, LOCK_EX) != 0 || fstat(tab->fd, &st) != 0 ||
+        (st.st_size == 0 && !credtab_init(cfg, tab)) ||
+        fstat(tab->fd, &st) != 0 || flock(tab->fd, LOCK_SH) != 0) {
+      debug_warn(cfg, "Unable to create %s", path);
+      return 0;
+    }
+  }
+
+  if (st.st_size == 0)
+    return 1; /* nothing recorded yet, nslots is 0 */
+
+  if (st.st_size < (off_t) sizeof(*hdr)) {
+    debug_warn(cfg, "%s is truncated", path);
+    return 0;
+  }
+
+  if ((uintmax_t) st.st_size > SIZE_MAX) {
+    debug_warn(cfg, "%s is too large", path);
+    return 0;
+  }
+
+  tab->size = (size_t) st.st_size;
+  tab->map = mmap(NULL, tab->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                  MAP_SHARED, tab->fd, 0);
+  if (tab->map == MAP_FAILED) {
+    debug_warn(cfg, "Unable to map %s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  hdr = tab->map;
+  if (memcmp(hdr->magic, kind->magic, sizeof(hdr->magic)) != 0 ||
+      hdr->version != kind->version || hdr->nslots == 0 ||
+      credtab_size(kind, hdr->nslots) != tab->size) {
+    debug_warn(cfg, "%s has an unexpected format", path);
+    return 0;
+  }
+
+  tab->nslots = hdr->nslots;
+  tab->slots = (unsigned char *) tab->map + sizeof(struct credtab_header);
+
+  return 1;
+}
+
+static void credtab_close(struct credtab *tab) {
+  if (tab->map != MAP_FAILED)
+    munmap(tab->map, tab->size);
+  if (tab->fd != -1)
+    close(tab->fd);
+}
+
+static int is_empty(const unsigned char *slot) {
+  static const unsigned char empty[CREDTAB_KEY_LEN];
+
+  return memcmp(slot, empty, sizeof(empty)) == 0;
+}
+
+/*
+ * Find the slot of the given key. If the key is not present, return the
+ * empty slot where it would be inserted. NULL if the table is full.
+ */
+static unsigned char *credtab_probe(const struct credtab *tab,
+                                    const unsigned char *key) {
+  unsigned char *slot;
+  uint32_t i, start;
+
+  start = ((uint32_t) key[0] << 24 | (uint32_t) key[1] << 16 |
+           (uint32_t) key[2] << 8 | (uint32_t) key[3]) %
+          tab->nslots;
+
+  for (i = 0; i < tab->nslots; i++) {
+    slot = tab->slots + (size_t) ((start + i) % tab->nslots) *
+                          tab->kind->slot_size;
+    if (is_empty(slot) || memcmp(slot, key, CREDTAB_KEY_LEN) == 0)
+      return slot;
+  }
+
+  return NULL;
+}
+
+/*
+ * Find or claim the slot of the given key, with a shared lock held on the
+ * table. A known key is returned under that lock. Otherwise the table is
+ * probed again and the slot claimed under an exclusive lock, which stays
+ * held until the table is closed. NULL with errno set to ENOSPC if the table
+ * is full, NULL on other errors.
+ */
+static unsigned char *credtab_claim(const struct credtab *tab,
+                                    const unsigned char *key) {
+  unsigned char *slot;
+
+  if ((slot = credtab_probe(tab, key)) != NULL && !is_empty(slot))
+    return slot;
+
+  if (slot != NULL &&
+      (flock(tab->fd, LOCK_UN) != 0 || flock(tab->fd, LOCK_EX) != 0))
+    return NULL;
+
+  /* The slot may have been taken while the table was unlocked. */
+  if ((slot = credtab_probe(tab, key)) == NULL) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  if (is_empty(slot)) {
+    memset(slot + CREDTAB_KEY_LEN, 0, tab->kind->slot_size - CREDTAB_KEY_LEN);
+    memcpy(slot, key, CREDTAB_KEY_LEN);
+  }
+
+  return slot;
+}
+
+/*
+ * Record a verified signature counter. Returns 1 if the counter is larger
+ * than the stored one, if the authenticator does not implement counters
+ * (both are zero), or if the table has no room left for a new credential,
+ * which is then not tracked. Returns 0 otherwise, including on errors.
+ */
+int credtab_update(const cfg_t *cfg, const device_t *device,
+                   uint32_t sigcount) {
+  unsigned char id[CRED_ID_LEN];
+  struct credtab tab;
+  struct sigcount_slot *slot;
+  uint32_t prev;
+  int ok = 0;
+
+  if (!credential_id(device, id)) {
+    debug_dbg(cfg, "Unable to compute credential ID");
+    return 0;
+  }
+
+  if (!credtab_open(cfg, cfg->sigcount_file, &sigcount_kind, 1, &tab))
+    goto out;
+
+  if ((slot = (struct sigcount_slot *) credtab_claim(&tab, id)) == NULL) {
+    if (errno != ENOSPC) {
+      debug_warn(cfg, "Unable to update %s", cfg->sigcount_file);
+      goto out;
+    }
+    debug_warn(cfg, "No room left in %s, signature counter not tracked",
+               cfg->sigcount_file);
+    ok = 1;
+    goto out;
+  }
+
+  prev = atomic_load(&slot->sigcount);
+  do {
+    if (sigcount == 0 && prev == 0) {
+      debug_dbg(cfg, "Authenticator does not implement a signature counter");
+      ok = 1;
+      goto out;
+    }
+    if (sigcount <= prev) {
+      debug_warn(cfg, "Signature counter did not increase (%u <= %u)",
+                 sigcount, prev);
+      goto out;
+    }
+  } while (!atomic_compare_exchange_weak(&slot->sigcount, &prev, sigcount));
+
+  debug_dbg(cfg, "Signature counter advanced to %u", sigcount);
+  ok = 1;
+
+out:
+  credtab_close(&tab);
+
+  return ok;
+}
+
+/* Record a successful authentication with a credential at time now. */
+int credtab_record_use(const cfg_t *cfg, const device_t *device,
+                       uint64_t now) {
+  unsigned char id[CRED_ID_LEN];
+  struct credtab tab;
+  struct usage_slot *slot;
+  uint64_t prev;
+  int ok = 0;
+
+  if (!credential_id(device, id)) {
+    debug_dbg(cfg, "Unable to compute credential ID");
+    return 0;
+  }
+
+  if (!credtab_open(cfg, cfg->usage_file, &usage_kind, 1, &tab))
+    goto out;
+
+  if ((slot = (struct usage_slot *) credtab_claim(&tab, id)) == NULL) {
+    debug_warn(cfg, "No room left in %s", cfg->usage_file);
+    goto out;
+  }
+
+  prev = atomic_load(&slot->last);
+  while (prev < now && !atomic_compare_exchange_weak(&slot->last, &prev, now))
+    ;
+  atomic_fetch_add(&slot->count, 1);
+
+  ok = 1;
+
+out:
+  credtab_close(&tab);
+
+  return ok;
+}
+
+/*
+ * Look up the usage of a credential. Returns 1 if it was used, 0 if it was
+ * never used, and -1 on errors.
+ */
+int credtab_lookup_use(const cfg_t *cfg, const device_t *device,
+                       struct credtab_use *use) {
+  unsigned char id[CRED_ID_LEN];
+  struct credtab tab;
+  const struct usage_slot *slot;
+  int r = -1;
+
+  memset(use, 0, sizeof(*use));
+
+  if (!credential_id(device, id)) {
+    debug_dbg(cfg, "Unable to compute credential ID");
+    return -1;
+  }
+
+  if (!credtab_open(cfg, cfg->usage_file, &usage_kind, 0, &tab))
+    goto out;
+
+  r = 0;
+  if (tab.nslots == 0)
+    goto out;
+
+  slot = (const struct usage_slot *) credtab_probe(&tab, id);
+  if (slot != NULL && !is_empty(slot->key)) {
+    use->last = atomic_load(&slot->last);
+    use->count = atomic_load(&slot->count);
+    r = 1;
+  }
+
+out:
+  credtab_close(&tab);
+
+  return r;
+}
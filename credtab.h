@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef CREDTAB_H
+#define CREDTAB_H
+
+#include <stdint.h>
+
+#include "cfg.h"
+#include "util.h"
+
+#define CREDTAB_MAGIC "PU2FCTAB"
+#define CREDTAB_VERSION 2
+#define CREDTAB_SLOTS 4096
+#define CREDTAB_KEY_LEN 16
+
+#define USAGE_MAGIC "PU2FUSAG"
+#define USAGE_VERSION 2
+
+struct credtab_use {
+  uint64_t last; /* seconds since the epoch */
+  uint32_t count;
+};
+
+int credtab_update(const cfg_t *cfg, const device_t *device,
+                   uint32_t sigcount);
+int credtab_record_use(const cfg_t *cfg, const device_t *device,
+                       uint64_t now);
+int credtab_lookup_use(const cfg_t *cfg, const device_t *device,
+                       struct credtab_use *use);
+
+#endif /* CREDTAB_H */
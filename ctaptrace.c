@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctaptrace.h"
+#include "debug.h"
+
+/*
+ * A trace holds the CTAP HID traffic of one authentication, one event per
+ * line:
+ *
+ *   open <path>
+ *   w <usec> <hex>    report written to the authenticator
+ *   r <usec> <hex>    report read from the authenticator, "-" if none
+ *   close
+ *   cdh <hex>         client data hash of the next assertion
+ *
+ * where <usec> is the time elapsed since the previous event. Recording wraps
+ * the hidraw device through fido_dev_set_io_functions(). Replaying consumes
+ * the events in order: writes are discarded, reads return the recorded
+ * report, optionally after the recorded delay, and the recorded client data
+ * hashes are reused so that the recorded assertions still verify.
+ */
+
+#define TRACE_MAX_PATHS 64
+
+/* CTAPHID_INIT; the response echoes the random nonce of the request */
+#define TRACE_CMD_INIT 0x86
+#define TRACE_NONCE_LEN 8
+#define TRACE_TX_NONCE 8 /* report ID, CID, command, length */
+#define TRACE_RX_NONCE 7 /* CID, command, length */
+
+static struct {
+  const cfg_t *cfg;
+  FILE *fp;
+  int replay;
+  int delay;
+  struct timespec last;
+  char *line;
+  size_t line_size;
+  char *paths[TRACE_MAX_PATHS];
+  size_t n_paths;
+  unsigned char nonce[TRACE_NONCE_LEN];
+  int have_nonce;
+} trace;
+
+static int trace_handle; /* replayed devices have no state of their own */
+
+static uint64_t elapsed_usec(void) {
+  struct timespec now;
+  int64_t usec;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    return 0;
+
+  usec = (int64_t) (now.tv_sec - trace.last.tv_sec) * 1000000 +
+         (now.tv_nsec - trace.last.tv_nsec) / 1000;
+  trace.last = now;
+
+  return usec > 0 ? (uint64_t) usec : 0;
+}
+
+static void put_hex(const unsigned char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    fprintf(trace.fp, "%02x", buf[i]);
+}
+
+static void put_report(char kind, const unsigned char *buf, int len) {
+  fprintf(trace.fp, "%c %" PRIu64 " ", kind, elapsed_usec());
+  if (len < 0)
+    fputc('-', trace.fp);
+  else
+    put_hex(buf, (size_t) len);
+  fputc('\n', trace.fp);
+}
+
+static int get_hex(const char *s, unsigned char *buf, size_t size,
+                   size_t *len) {
+  size_t n = strlen(s);
+  unsigned int byte;
+
+  if (n % 2 != 0 || n / 2 > size)
+    return 0;
+
+  for (size_t i = 0; i < n / 2; i++) {
+    if (sscanf(s + 2 * i, "%2x", &byte) != 1)
+      return 0;
+    buf[i] = (unsigned char) byte;
+  }
+  *len = n / 2;
+
+  return 1;
+}
+
+/* Return the argument of the next event, which must be of the given kind. */
+static const char *next_event(const char *kind) {
+  size_t klen = strlen(kind);
+  ssize_t n;
+
+  while ((n = getline(&trace.line, &trace.line_size, trace.fp)) != -1) {
+    if (n > 0 && trace.line[n - 1] == '\n')
+      trace.line[--n] = '\0';
+    if (n == 0 || trace.line[0] == '#')
+      continue;
+    if (strncmp(trace.line, kind, klen) != 0 ||
+        (trace.line[klen] != ' ' && trace.line[klen] != '\0')) {
+      debug_warn(trace.cfg, "Trace out of sync: expected %s, found \"%s\"",
+                 kind, trace.line);
+      return NULL;
+    }
+    return trace.line[klen] == ' ' ? trace.line + klen + 1 : "";
+  }
+
+  debug_warn(trace.cfg, "Trace exhausted, expected %s", kind);
+
+  return NULL;
+}
+
+static void *rec_open(const char *path) {
+  int *fd;
+
+  if ((fd = malloc(sizeof(*fd))) == NULL)
+    return NULL;
+
+  if ((*fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+    debug_dbg(trace.cfg, "Cannot open %s: %s", path, strerror(errno));
+    free(fd);
+    return NULL;
+  }
+
+  elapsed_usec();
+  fprintf(trace.fp, "open %s\n", path);
+
+  return fd;
+}
+
+static void rec_close(void *handle) {
+  int *fd = handle;
+
+  close(*fd);
+  free(fd);
+  elapsed_usec();
+  fprintf(trace.fp, "close\n");
+}
+
+static int rec_read(void *handle, unsigned char *buf, size_t len, int ms) {
+  struct pollfd pfd;
+  ssize_t n = -1;
+
+  memset(&pfd, 0, sizeof(pfd));
+  pfd.fd = *(int *) handle;
+  pfd.events = POLLIN;
+
+  if (len <= INT_MAX && poll(&pfd, 1, ms) == 1 &&
+      (n = read(pfd.fd, buf, len)) != (ssize_t) len)
+    n = -1;
+
+  put_report('r', buf, (int) n);
+
+  return (int) n;
+}
+
+static int rec_write(void *handle, const unsigned char *buf, size_t len) {
+  ssize_t n;
+
+  if (len > INT_MAX || (n = write(*(int *) handle, buf, len)) != (ssize_t) len)
+    n = -1;
+
+  put_report('w', buf, (int) n);
+
+  return (int) n;
+}
+
+static void *play_open(const char *path) {
+  const char *arg;
+
+  if ((arg = next_event("open")) == NULL)
+    return NULL;
+
+  if (strcmp(arg, path) != 0) {
+    debug_dbg(trace.cfg, "Trace opened %s, not %s", arg, path);
+    return NULL;
+  }
+
+  return &trace_handle;
+}
+
+static void play_close(void *handle) {
+  (void) handle;
+  (void) next_event("close");
+}
+
+static int play_read(void *handle, unsigned char *buf, size_t len, int ms) {
+  const char *arg;
+  char *ep;
+  unsigned long long usec;
+  struct timespec ts;
+  size_t n;
+
+  (void) handle;
+  (void) ms;
+
+  if ((arg = next_event("r")) == NULL)
+    return -1;
+
+  errno = 0;
+  usec = strtoull(arg, &ep, 10);
+  if (errno != 0 || ep == arg || *ep != ' ' || len > INT_MAX) {
+    debug_dbg(trace.cfg, "Malformed read event");
+    return -1;
+  }
+
+  if (trace.delay && usec > 0) {
+    ts.tv_sec = (time_t) (usec / 1000000);
+    ts.tv_nsec = (long) (usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+      ;
+  }
+
+  if (strcmp(ep + 1, "-") == 0)
+    return -1;
+
+  if (!get_hex(ep + 1, buf, len, &n) || n != len) {
+    debug_dbg(trace.cfg, "Malformed read event");
+    return -1;
+  }
+
+  if (trace.have_nonce && n >= TRACE_RX_NONCE + TRACE_NONCE_LEN &&
+      buf[4] == TRACE_CMD_INIT)
+    memcpy(buf + TRACE_RX_NONCE, trace.nonce, TRACE_NONCE_LEN);
+
+  return (int) n;
+}
+
+static int play_write(void *handle, const unsigned char *buf, size_t len) {
+  (void) handle;
+
+  if (next_event("w") == NULL || len > INT_MAX)
+    return -1;
+
+  if (len >= TRACE_TX_NONCE + TRACE_NONCE_LEN && buf[5] == TRACE_CMD_INIT) {
+    memcpy(trace.nonce, buf + TRACE_TX_NONCE, TRACE_NONCE_LEN);
+    trace.have_nonce = 1;
+  }
+
+  return (int) len;
+}
+
+static const fido_dev_io_t rec_io = {
+  .open = rec_open,
+  .close = rec_close,
+  .read = rec_read,
+  .write = rec_write,
+};
+
+static const fido_dev_io_t play_io = {
+  .open = play_open,
+  .close = play_close,
+  .read = play_read,
+  .write = play_write,
+};
+
+/* The replayed devices are the ones opened during the recording. */
+static int load_paths(void) {
+  ssize_t n;
+  size_t i;
+
+  while ((n = getline(&trace.line, &trace.line_size, trace.fp)) != -1) {
+    if (n > 0 && trace.line[n - 1] == '\n')
+      trace.line[n - 1] = '\0';
+    if (strncmp(trace.line, "open ", 5) != 0)
+      continue;
+    for (i = 0; i < trace.n_paths; i++)
+      if (strcmp(trace.paths[i], trace.line + 5) == 0)
+        break;
+    if (i < trace.n_paths || trace.n_paths == TRACE_MAX_PATHS)
+      continue;
+    if ((trace.paths[trace.n_paths] = strdup(trace.line + 5)) == NULL)
+      return 0;
+    trace.n_paths++;
+  }
+
+  rewind(trace.fp);
+
+  return 1;
+}
+
+int ctaptrace_begin(const cfg_t *cfg) {
+  int fd;
+
+  memset(&trace, 0, sizeof(trace));
+  trace.cfg = cfg;
+
+  if (cfg->ctap_replay) {
+    if ((trace.fp = fopen(cfg->ctap_replay, "re")) == NULL) {
+      debug_err(cfg, "Cannot open trace %s: %s", cfg->ctap_replay,
+                strerror(errno));
+      return 0;
+    }
+    trace.replay = 1;
+    trace.delay = cfg->ctap_replay_delay;
+    if (!load_paths()) {
+      debug_err(cfg, "Unable to load trace %s", cfg->ctap_replay);
+      ctaptrace_end();
+      return 0;
+    }
+  } else if (cfg->ctap_record) {
+#ifndef __linux__
+    debug_dbg(cfg, "Recording CTAP traces is only supported on Linux");
+    return 0;
+#endif
+    fd = open(cfg->ctap_record, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                                  O_CLOEXEC | O_NOCTTY,
+              0600);
+    if (fd == -1 || (trace.fp = fdopen(fd, "w")) == NULL) {
+      debug_err(cfg, "Cannot open trace %s: %s", cfg->ctap_record,
+                strerror(errno));
+      if (fd != -1)
+        close(fd);
+      return 0;
+    }
+    fprintf(trace.fp, "# ctap trace v%d\n", CTAPTRACE_VERSION);
+  }
+
+  if (trace.fp != NULL)
+    (void) clock_gettime(CLOCK_MONOTONIC, &trace.last);
+
+  return 1;
+}
+
+void ctaptrace_end(void) {
+  if (trace.fp != NULL)
+    fclose(trace.fp);
+  for (size_t i = 0; i < trace.n_paths; i++)
+    free(trace.paths[i]);
+  free(trace.line);
+  memset(&trace, 0, sizeof(trace));
+}
+
+int ctaptrace_replaying(void) { return trace.fp != NULL && trace.replay; }
+
+int ctaptrace_manifest(fido_dev_info_t *devlist, size_t ilen, size_t *olen) {
+  size_t i;
+  int r;
+
+  for (i = 0; i < trace.n_paths && i < ilen; i++) {
+    r = fido_dev_info_set(devlist, i, trace.paths[i], "ctaptrace", "replay",
+                          &play_io, NULL);
+    if (r != FIDO_OK)
+      return r;
+  }
+  *olen = i;
+
+  return FIDO_OK;
+}
+
+int ctaptrace_attach(fido_dev_t *dev) {
+  if (trace.fp == NULL)
+    return 1;
+
+  return fido_dev_set_io_functions(dev, trace.replay ? &play_io : &rec_io) ==
+         FIDO_OK;
+}
+
+int ctaptrace_cdh(unsigned char *cdh, size_t len) {
+  const char *arg;
+  size_t n;
+
+  if (trace.fp == NULL)
+    return 1;
+
+  if (!trace.replay) {
+    elapsed_usec();
+    fputs("cdh ", trace.fp);
+    put_hex(cdh, len);
+    fputc('\n', trace.fp);
+    return 1;
+  }
+
+  if ((arg = next_event("cdh")) == NULL || !get_hex(arg, cdh, len, &n) ||
+      n != len) {
+    debug_dbg(trace.cfg, "Malformed client data hash event");
+    return 0;
+  }
+
+  return 1;
+}
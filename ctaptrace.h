@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef CTAPTRACE_H
+#define CTAPTRACE_H
+
+#include <fido.h>
+
+#include "cfg.h"
+
+#define CTAPTRACE_VERSION 1
+
+int ctaptrace_begin(const cfg_t *cfg);
+void ctaptrace_end(void);
+int ctaptrace_replaying(void);
+int ctaptrace_manifest(fido_dev_info_t *devlist, size_t ilen, size_t *olen);
+int ctaptrace_attach(fido_dev_t *dev);
+int ctaptrace_cdh(unsigned char *cdh, size_t len);
+
+#endif /* CTAPTRACE_H */
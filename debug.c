@@ -15,6 +15,29 @@
 #define DEBUG_FMT "debug(pam_u2f): %s:%d (%s): %s%s"
 #define MSGLEN 2048
 
+static const struct {
+  const char *name;
+  int priority;
+} levels[] = {
+  [DEBUG_LVL_ERROR] = {"error", LOG_ERR},
+  [DEBUG_LVL_WARN] = {"warning", LOG_WARNING},
+  [DEBUG_LVL_INFO] = {"info", LOG_INFO},
+  [DEBUG_LVL_DEBUG] = {"debug", LOG_DEBUG},
+  [DEBUG_LVL_TRACE] = {"trace", LOG_DEBUG},
+};
+
+int debug_level(const char *name) {
+  for (int lvl = DEBUG_LVL_ERROR; lvl <= DEBUG_LVL_TRACE; lvl++)
+    if (strcmp(name, levels[lvl].name) == 0)
+      return lvl;
+
+  /* "warn" as in debug_warn() */
+  if (strcmp(name, "warn") == 0)
+    return DEBUG_LVL_WARN;
+
+  return -1;
+}
+
 FILE *debug_open(const char *filename) {
   struct stat st;
   FILE *file;
@@ -51,11 +74,15 @@ void debug_close(FILE *f) {
     fclose(f);
 }
 
-static void do_log(FILE *debug_file, const char *file, int line,
+static void do_log(FILE *debug_file, int lvl, const char *file, int line,
                    const char *func, const char *msg, const char *suffix) {
+  if (lvl < DEBUG_LVL_ERROR || lvl > DEBUG_LVL_TRACE)
+    lvl = DEBUG_LVL_DEBUG;
+
 #ifndef WITH_FUZZING
   if (debug_file == NULL) {
-    syslog(LOG_AUTHPRIV | LOG_DEBUG, DEBUG_FMT, file, line, func, msg, suffix);
+    syslog(LOG_AUTHPRIV | levels[lvl].priority, DEBUG_FMT, file, line, func,
+           msg, suffix);
   } else {
     fprintf(debug_file, DEBUG_FMT "\n", file, line, func, msg, suffix);
   }
@@ -65,9 +92,10 @@ static void do_log(FILE *debug_file, const char *file, int line,
 #endif
 }
 
-ATTRIBUTE_FORMAT(printf, 5, 0)
-static void debug_vfprintf(FILE *debug_file, const char *file, int line,
-                           const char *func, const char *fmt, va_list args) {
+ATTRIBUTE_FORMAT(printf, 6, 0)
+static void debug_vfprintf(FILE *debug_file, int lvl, const char *file,
+                           int line, const char *func, const char *fmt,
+                           va_list args) {
   const char *bn;
   char msg[MSGLEN];
   int r;
@@ -76,17 +104,17 @@ static void debug_vfprintf(FILE *debug_file, const char *file, int line,
     file = bn + 1;
 
   if ((r = vsnprintf(msg, sizeof(msg), fmt, args)) < 0)
-    do_log(debug_file, file, line, func, __func__, "");
+    do_log(debug_file, lvl, file, line, func, __func__, "");
   else
-    do_log(debug_file, file, line, func, msg,
+    do_log(debug_file, lvl, file, line, func, msg,
            (size_t) r < sizeof(msg) ? "" : "[truncated]");
 }
 
-void debug_fprintf(FILE *debug_file, const char *file, int line,
+void debug_fprintf(FILE *debug_file, int lvl, const char *file, int line,
                    const char *func, const char *fmt, ...) {
   va_list ap;
 
   va_start(ap, fmt);
-  debug_vfprintf(debug_file, file, line, func, fmt, ap);
+  debug_vfprintf(debug_file, lvl, file, line, func, fmt, ap);
   va_end(ap);
 }
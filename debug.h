@@ -9,20 +9,50 @@
 
 #define DEFAULT_DEBUG_FILE stderr
 
+/*
+ * Log levels, in increasing verbosity. cfg->debug holds the runtime
+ * threshold, 0 disabling logging altogether.
+ */
+#define DEBUG_LVL_ERROR 1
+#define DEBUG_LVL_WARN 2
+#define DEBUG_LVL_INFO 3
+#define DEBUG_LVL_DEBUG 4
+#define DEBUG_LVL_TRACE 5
+
+/*
+ * Most verbose level built in. Sites above it are discarded at compile time,
+ * format strings included. The build sets it below DEBUG_LVL_TRACE unless
+ * trace messages are enabled; builds without debug messages keep none.
+ */
+#ifndef DEBUG_LVL_MAX
+#ifdef DEBUG_PAM
+#define DEBUG_LVL_MAX DEBUG_LVL_TRACE
+#else
+#define DEBUG_LVL_MAX 0
+#endif
+#endif
+
 #if defined(DEBUG_PAM)
-#define D(file, ...)                                                           \
-  debug_fprintf(file, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define D(file, lvl, ...)                                                      \
+  debug_fprintf(file, lvl, __FILE__, __LINE__, __func__, __VA_ARGS__)
 #else
-#define D(file, ...) ((void) 0)
+#define D(file, lvl, ...) ((void) 0)
 #endif /* DEBUG_PAM */
 
-#define debug_dbg(cfg, ...)                                                    \
+/* The threshold is checked before any argument is evaluated. */
+#define debug_log(cfg, lvl, ...)                                               \
   do {                                                                         \
-    if (cfg->debug) {                                                          \
-      D(cfg->debug_file, __VA_ARGS__);                                         \
+    if ((lvl) <= DEBUG_LVL_MAX && cfg->debug >= (lvl)) {                       \
+      D(cfg->debug_file, lvl, __VA_ARGS__);                                    \
     }                                                                          \
   } while (0)
 
+#define debug_err(cfg, ...) debug_log(cfg, DEBUG_LVL_ERROR, __VA_ARGS__)
+#define debug_warn(cfg, ...) debug_log(cfg, DEBUG_LVL_WARN, __VA_ARGS__)
+#define debug_info(cfg, ...) debug_log(cfg, DEBUG_LVL_INFO, __VA_ARGS__)
+#define debug_dbg(cfg, ...) debug_log(cfg, DEBUG_LVL_DEBUG, __VA_ARGS__)
+#define debug_trace(cfg, ...) debug_log(cfg, DEBUG_LVL_TRACE, __VA_ARGS__)
+
 #ifdef __GNUC__
 #define ATTRIBUTE_FORMAT(f, s, a) __attribute__((format(f, s, a)))
 #else
@@ -31,7 +61,8 @@
 
 FILE *debug_open(const char *);
 void debug_close(FILE *f);
-void debug_fprintf(FILE *, const char *, int, const char *, const char *, ...)
-  ATTRIBUTE_FORMAT(printf, 5, 6);
+int debug_level(const char *);
+void debug_fprintf(FILE *, int, const char *, int, const char *, const char *,
+                   ...) ATTRIBUTE_FORMAT(printf, 6, 7);
 
 #endif /* DEBUG_H */
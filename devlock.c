@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "debug.h"
+#include "devlock.h"
+
+/*
+ * Authenticators are locked across processes, so that concurrent logins of
+ * the same user take turns instead of interleaving their CTAPHID traffic.
+ * Each authenticator has two files in the lock directory, named after the
+ * hex SHA-256 digest of its path:
+ *
+ *   <name>.lock   held with flock(2) while the authenticator is open
+ *   <name>.queue  u64 next ticket, u64 ticket being served
+ *
+ * A process takes a ticket and only competes for the lock once its turn has
+ * come, as flock(2) wakes all waiters at once, in no particular order. Mutual
+ * exclusion relies on the lock alone, which the kernel releases when its
+ * holder dies; the queue orders waiters on a best effort basis. A turn left
+ * unclaimed, by a waiter that gave up or died, is skipped once the
+ * authenticator has been idle for DEVLOCK_STALL_MS.
+ */
+
+#define DEVLOCK_POLL_MS 20
+#define DEVLOCK_STALL_MS 1000
+
+struct queue {
+  uint64_t next;
+  uint64_t serving;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+static int open_lock(const char *dir, const char *path, const char *suffix) {
+  unsigned char md[SHA256_DIGEST_LENGTH];
+  char name[2 * SHA256_DIGEST_LENGTH + 1];
+  char file[PATH_MAX];
+  size_t i;
+  int n;
+
+  if (SHA256((const unsigned char *) path, strlen(path), md) == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < sizeof(md); i++)
+    snprintf(name + 2 * i, 3, "%02x", md[i]);
+
+  n = snprintf(file, sizeof(file), "%s/%s%s", dir, name, suffix);
+  if (n < 0 || (size_t) n >= sizeof(file)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return open(file, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY,
+              S_IRUSR | S_IWUSR);
+}
+
+/* Lock the queue and read it. A new queue reads as zeroes. */
+static int queue_begin(int fd, struct queue *q) {
+  ssize_t n;
+
+  if (flock(fd, LOCK_EX) == -1)
+    return 0;
+
+  memset(q, 0, sizeof(*q));
+  if ((n = pread(fd, q, sizeof(*q), 0)) != 0 && n != (ssize_t) sizeof(*q)) {
+    flock(fd, LOCK_UN);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Write the queue back, unless q is NULL, and unlock it. */
+static int queue_end(int fd, const struct queue *q) {
+  int ok = 1;
+
+  if (q != NULL && pwrite(fd, q, sizeof(*q), 0) != (ssize_t) sizeof(*q))
+    ok = 0;
+  if (flock(fd, LOCK_UN) == -1)
+    ok = 0;
+
+  return ok;
+}
+
+static void close_lock(struct devlock *lock) {
+  if (lock->fd != -1)
+    close(lock->fd);
+  if (lock->queue != -1)
+    close(lock->queue);
+  lock->fd = lock->queue = -1;
+}
+
+/*
+ * Wait for our turn on an authenticator, for at most cfg->device_lock
+ * seconds. Returns 1 when the authenticator may be used, holding the lock
+ * unless locking is disabled or not possible, and 0 on timeout.
+ */
+int devlock_acquire(const cfg_t *cfg, const char *dir, const char *path,
+                    struct devlock *lock) {
+  struct queue q;
+  uint64_t start, now, deadline, idle_since, seen;
+
+  lock->fd = lock->queue = -1;
+  lock->ticket = 0;
+
+#ifdef WITH_FUZZING
+  (void) cfg;
+  (void) dir;
+  (void) path;
+  return 1;
+#else
+  if (cfg->device_lock <= 0 || path == NULL)
+    return 1;
+
+  if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) {
+    debug_warn(cfg, "Unable to create %s: %s", dir, strerror(errno));
+    goto unlocked;
+  }
+
+  if ((lock->fd = open_lock(dir, path, ".lock")) == -1 ||
+      (lock->queue = open_lock(dir, path, ".queue")) == -1) {
+    debug_warn(cfg, "Unable to open lock for %s: %s", path, strerror(errno));
+    goto unlocked;
+  }
+
+  if (!queue_begin(lock->queue, &q))
+    goto unlocked;
+  lock->ticket = q.next++;
+  if (!queue_end(lock->queue, &q))
+    goto unlocked;
+
+  start = idle_since = now_ms();
+  deadline = start + (uint64_t) cfg->device_lock * 1000;
+  seen = q.serving;
+
+  for (;;) {
+    if (!queue_begin(lock->queue, &q))
+      goto unlocked;
+
+    now = now_ms();
+    if (q.serving >= lock->ticket) {
+      if (flock(lock->fd, LOCK_EX | LOCK_NB) == 0) {
+        queue_end(lock->queue, NULL);
+        if (now - start >= DEVLOCK_POLL_MS)
+          debug_dbg(cfg, "Waited %" PRIu64 " ms for authenticator %s",
+                    now - start, path);
+        return 1;
+      }
+    } else if (q.serving != seen) {
+      seen = q.serving;
+      idle_since = now;
+    } else if (now - idle_since >= DEVLOCK_STALL_MS &&
+               flock(lock->fd, LOCK_EX | LOCK_NB) == 0) {
+      /* nobody holds the authenticator, the turn was abandoned */
+      flock(lock->fd, LOCK_UN);
+      seen = ++q.serving;
+      idle_since = now;
+      if (!queue_end(lock->queue, &q))
+        goto unlocked;
+      continue;
+    }
+
+    if (now >= deadline) {
+      if (q.serving == lock->ticket)
+        q.serving++; /* pass our turn on */
+      queue_end(lock->queue, &q);
+      debug_warn(cfg, "Timed out waiting for authenticator %s", path);
+      close_lock(lock);
+      return 0;
+    }
+
+    if (!queue_end(lock->queue, NULL))
+      goto unlocked;
+
+    sleep_ms(DEVLOCK_POLL_MS);
+  }
+
+unlocked:
+  debug_warn(cfg, "Using authenticator %s without locking", path);
+  close_lock(lock);
+  return 1;
+#endif
+}
+
+/* Hand the authenticator over to the next waiter. */
+void devlock_release(struct devlock *lock) {
+  struct queue q;
+
+  if (lock->fd == -1)
+    return;
+
+  if (queue_begin(lock->queue, &q)) {
+    if (q.serving <= lock->ticket)
+      q.serving = lock->ticket + 1;
+    queue_end(lock->queue, &q);
+  }
+
+  close_lock(lock); /* drops the lock */
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef DEVLOCK_H
+#define DEVLOCK_H
+
+#include <stdint.h>
+
+#include "cfg.h"
+
+#define DEVLOCK_DIR "/run/pam_u2f"
+
+struct devlock {
+  int fd;    /* held while the authenticator is open, -1 if unlocked */
+  int queue; /* wait queue */
+  uint64_t ticket;
+};
+
+int devlock_acquire(const cfg_t *cfg, const char *dir, const char *path,
+                    struct devlock *lock);
+void devlock_release(struct devlock *lock);
+
+#endif /* DEVLOCK_H */
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "event.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Events are sent as single datagrams over a connected Unix socket, one
+ * record per datagram:
+ *
+ *   v=1 ev=touch ts=<monotonic ns> pid=<pid>[ cred=<n>][ dev=<path>]
+ *
+ * Sending never blocks; if nobody is listening the event is dropped.
+ */
+
+static const char *event_name(int type) {
+  switch (type) {
+    case EVENT_AUTH_START:
+      return "start";
+    case EVENT_DEVICE_PROBED:
+      return "probe";
+    case EVENT_TOUCH_REQUESTED:
+      return "touch";
+    case EVENT_PIN_REQUESTED:
+      return "pin";
+    case EVENT_AUTH_SUCCESS:
+      return "success";
+    case EVENT_AUTH_FAILURE:
+      return "failure";
+    default:
+      return NULL;
+  }
+}
+
+void event_open(cfg_t *cfg) {
+  struct sockaddr_un sa;
+  int fd;
+
+  if (cfg->event_socket == NULL || *cfg->event_socket == '\0')
+    return;
+
+  if (*cfg->event_socket != '/' ||
+      strlen(cfg->event_socket) >= sizeof(sa.sun_path)) {
+    debug_warn(cfg, "Invalid event socket path %s", cfg->event_socket);
+    return;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, cfg->event_socket, strlen(cfg->event_socket));
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    debug_err(cfg, "Unable to create event socket: %s", strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+
+  if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0) {
+    debug_warn(cfg, "Unable to connect to event socket %s: %s",
+               cfg->event_socket, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  cfg->event_fd = fd;
+}
+
+void event_close(cfg_t *cfg) {
+  if (cfg->event_fd != -1) {
+    close(cfg->event_fd);
+    cfg->event_fd = -1;
+  }
+}
+
+static int write_escaped(char *buf, size_t size, const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  size_t n = 0;
+
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c > ' ' && c < 0x7f && c != '%') {
+      if (n + 1 >= size)
+        return -1;
+      buf[n++] = (char) c;
+    } else {
+      if (n + 3 >= size)
+        return -1;
+      buf[n++] = '%';
+      buf[n++] = hex[c >> 4];
+      buf[n++] = hex[c & 0xf];
+    }
+  }
+  buf[n] = '\0';
+
+  return (int) n;
+}
+
+int event_format(char *buf, size_t size, int type, unsigned cred,
+                 const char *dev) {
+  const char *name;
+  struct timespec ts;
+  uint64_t ns = 0;
+  size_t len;
+  int n;
+
+  if ((name = event_name(type)) == NULL)
+    return -1;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+
+  n = snprintf(buf, size, "v=%d ev=%s ts=%llu pid=%ld", EVENT_VERSION, name,
+               (unsigned long long) ns, (long) getpid());
+  if (n < 0 || (size_t) n >= size)
+    return -1;
+  len = (size_t) n;
+
+  if (cred != 0) {
+    n = snprintf(buf + len, size - len, " cred=%u", cred);
+    if (n < 0 || (size_t) n >= size - len)
+      return -1;
+    len += (size_t) n;
+  }
+
+  if (dev != NULL) {
+    n = snprintf(buf + len, size - len, " dev=");
+    if (n < 0 || (size_t) n >= size - len)
+      return -1;
+    len += (size_t) n;
+    if ((n = write_escaped(buf + len, size - len, dev)) < 0)
+      return -1;
+    len += (size_t) n;
+  }
+
+  return (int) len;
+}
+
+void event_emit(const cfg_t *cfg, int type, unsigned cred, const char *dev) {
+  char buf[EVENT_MAX_LEN];
+  int n;
+
+  if (cfg->event_fd == -1)
+    return;
+
+  if ((n = event_format(buf, sizeof(buf), type, cred, dev)) < 0) {
+    debug_dbg(cfg, "Unable to format event %d", type);
+    return;
+  }
+
+  if (send(cfg->event_fd, buf, (size_t) n, MSG_DONTWAIT | MSG_NOSIGNAL) != n)
+    debug_warn(cfg, "Unable to send event %d: %s", type, strerror(errno));
+}
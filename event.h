@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "cfg.h"
+
+#define EVENT_VERSION 1
+#define EVENT_MAX_LEN 512
+
+enum {
+  EVENT_AUTH_START,
+  EVENT_DEVICE_PROBED,
+  EVENT_TOUCH_REQUESTED,
+  EVENT_PIN_REQUESTED,
+  EVENT_AUTH_SUCCESS,
+  EVENT_AUTH_FAILURE,
+};
+
+void event_open(cfg_t *cfg);
+void event_close(cfg_t *cfg);
+void event_emit(const cfg_t *cfg, int type, unsigned cred, const char *dev);
+int event_format(char *buf, size_t size, int type, unsigned cred,
+                 const char *dev);
+
+#endif /* EVENT_H */
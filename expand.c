@@ -3,13 +3,34 @@
  */
 
 #include <stdint.h>
-#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <limits.h>
 
-#include "util.h"
+#include "expand.h"
 
-static int buf_write(uint8_t **dst, size_t *size, const void *src, size_t n) {
+/*
+ * Templates are compiled once into a list of operations referencing the
+ * original string, so rendering only copies bytes into the caller's buffer.
+ *
+ *   %u    username
+ *   %Nu   first N (1-9) bytes of the username, which must not be "." or ".."
+ *         nor contain '/'
+ *   %hN   N (1-8) hex digits of a hash of the username
+ *   %U    numeric uid
+ *   %H    home directory
+ *   %%    literal '%'
+ */
+enum {
+  OP_LITERAL,
+  OP_USER,
+  OP_USER_PREFIX,
+  OP_HASH,
+  OP_UID,
+  OP_HOME,
+};
+
+static int buf_write(char **dst, size_t *size, const void *src, size_t n) {
   if (*size < n) {
     return -1;
   }
@@ -21,50 +42,158 @@ static int buf_write(uint8_t **dst, size_t *size, const void *src, size_t n) {
   return 0;
 }
 
-static int buf_write_byte(uint8_t **dst, size_t *size, uint8_t c) {
-  return buf_write(dst, size, &c, sizeof(c));
-}
+static int add_op(expand_tmpl_t *tmpl, uint8_t type, uint8_t arg,
+                  const char *lit, size_t len) {
+  struct expand_op *op;
 
-static const char *lookup(char var, const char *user) {
-  switch (var) {
-    case 'u':
-      return user;
-    case '%':
-      return "%";
-    default:
-      // Capture all unknown variables (incl. null byte).
-      return NULL;
+  if (tmpl->n_ops == EXPAND_MAX_OPS || len > UINT16_MAX) {
+    return -1;
   }
+
+  op = &tmpl->ops[tmpl->n_ops++];
+  op->type = type;
+  op->arg = arg;
+  op->lit = lit;
+  op->len = (uint16_t) len;
+
+  return 0;
 }
 
-char *expand_variables(const char *str, const char *user) {
-  uint8_t *tail, *head;
-  size_t size = PATH_MAX;
-  int ok = -1;
+int expand_compile(expand_tmpl_t *tmpl, const char *str) {
+  const char *lit;
+  int r;
+
+  memset(tmpl, 0, sizeof(*tmpl));
 
-  if (str == NULL || (tail = head = malloc(size)) == NULL) {
-    return NULL;
+  if (str == NULL) {
+    return -1;
   }
 
-  for (; *str != '\0'; str++) {
-    if (*str == '%') {
+  while (*str != '\0') {
+    if (*str != '%') {
+      lit = str;
+      str += strcspn(str, "%");
+      if (add_op(tmpl, OP_LITERAL, 0, lit, (size_t) (str - lit)) != 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    str++;
+    if (*str >= '1' && *str <= '0' + EXPAND_MAX_PREFIX && str[1] == 'u') {
+      r = add_op(tmpl, OP_USER_PREFIX, (uint8_t) (*str - '0'), NULL, 0);
+      str++;
+    } else if (*str == 'h' && str[1] >= '1' &&
+               str[1] <= '0' + EXPAND_MAX_HASH) {
       str++;
-      const char *value = lookup(*str, user);
-      if (value == NULL || *value == '\0' ||
-          buf_write(&head, &size, value, strlen(value)) != 0) {
-        goto fail;
+      r = add_op(tmpl, OP_HASH, (uint8_t) (*str - '0'), NULL, 0);
+    } else {
+      switch (*str) {
+        case 'u':
+          r = add_op(tmpl, OP_USER, 0, NULL, 0);
+          break;
+        case 'U':
+          r = add_op(tmpl, OP_UID, 0, NULL, 0);
+          break;
+        case 'H':
+          r = add_op(tmpl, OP_HOME, 0, NULL, 0);
+          break;
+        case '%':
+          r = add_op(tmpl, OP_LITERAL, 0, str, 1);
+          break;
+        default:
+          // Capture all unknown variables (incl. null byte).
+          r = -1;
       }
-    } else if (buf_write_byte(&head, &size, (uint8_t) *str) != 0) {
-      goto fail;
     }
+
+    if (r != 0) {
+      memset(tmpl, 0, sizeof(*tmpl));
+      return -1;
+    }
+    str++;
   }
 
-  ok = buf_write_byte(&head, &size, '\0');
+  return 0;
+}
+
+/* 32-bit FNV-1a, stable across platforms so that shard layouts are portable. */
+uint32_t expand_hash(const char *str) {
+  uint32_t h = 0x811c9dc5;
 
-fail:
-  if (ok != 0) {
-    free(tail);
-    return NULL;
+  for (; *str != '\0'; str++) {
+    h ^= (uint8_t) *str;
+    h *= 0x01000193;
   }
-  return (char *) tail;
+
+  return h;
+}
+
+int expand_render(const expand_tmpl_t *tmpl, const struct expand_user *user,
+                  char *buf, size_t size) {
+  char num[sizeof("4294967295")];
+  const struct expand_op *op;
+  const char *value;
+  size_t i, n;
+  int len;
+
+  for (i = 0; i < tmpl->n_ops; i++) {
+    op = &tmpl->ops[i];
+    switch (op->type) {
+      case OP_LITERAL:
+        value = op->lit;
+        n = op->len;
+        break;
+      case OP_USER:
+      case OP_USER_PREFIX:
+        value = user->name;
+        n = strlen(value);
+        if (op->type != OP_USER_PREFIX)
+          break;
+        if (n > op->arg)
+          n = op->arg;
+        /* A prefix is meant to be a directory of its own. */
+        if (memchr(value, '/', n) != NULL || (n == 1 && value[0] == '.') ||
+            (n == 2 && value[0] == '.' && value[1] == '.'))
+          return -1;
+        break;
+      case OP_HASH:
+        if (*user->name == '\0')
+          return -1;
+        len = snprintf(num, sizeof(num), "%08x",
+                       (unsigned) expand_hash(user->name));
+        if (len != 8)
+          return -1;
+        value = num + 8 - op->arg;
+        n = op->arg;
+        break;
+      case OP_UID:
+        if (!user->has_uid)
+          return -1;
+        len = snprintf(num, sizeof(num), "%lu", (unsigned long) user->uid);
+        if (len < 0 || (size_t) len >= sizeof(num))
+          return -1;
+        value = num;
+        n = (size_t) len;
+        break;
+      case OP_HOME:
+        if ((value = user->home) == NULL)
+          return -1;
+        n = strlen(value);
+        break;
+      default:
+        return -1;
+    }
+
+    if (n == 0 || buf_write(&buf, &size, value, n) != 0) {
+      return -1;
+    }
+  }
+
+  if (size == 0) {
+    return -1;
+  }
+  *buf = '\0';
+
+  return 0;
 }
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define EXPAND_MAX_OPS 32
+#define EXPAND_MAX_PREFIX 9 /* %1u .. %9u */
+#define EXPAND_MAX_HASH 8   /* %h1 .. %h8 */
+
+struct expand_op {
+  uint8_t type;
+  uint8_t arg;
+  uint16_t len;
+  const char *lit;
+};
+
+typedef struct {
+  size_t n_ops;
+  struct expand_op ops[EXPAND_MAX_OPS];
+} expand_tmpl_t;
+
+struct expand_user {
+  const char *name;
+  const char *home; /* may be NULL if %H is not used */
+  uid_t uid;
+  int has_uid; /* set if uid is valid */
+};
+
+int expand_compile(expand_tmpl_t *, const char *);
+int expand_render(const expand_tmpl_t *, const struct expand_user *, char *,
+                  size_t);
+uint32_t expand_hash(const char *);
+
+#endif /* EXPAND_H */
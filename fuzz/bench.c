@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+/*
+ * Measure the login throughput of pam_sm_authenticate() for capacity
+ * planning, using the same wrappers as fuzz_auth: the user, the
+ * conversation, the authfile and the authenticator are all fake, and failure
+ * injection is turned off. Each scenario runs on -w worker processes for -d
+ * seconds after one warm-up login per worker. Processes are used rather than
+ * threads since the wrappers keep their state in globals.
+ *
+ * For every scenario, the aggregate logins per second, the p50 and p99
+ * latency, the CPU time per login and the PAM result of the warm-up login
+ * are printed. Logins whose result differs from the warm-up are counted as
+ * mismatches, and the exit status is 1 if there are any.
+ *
+ * The numbers include the cost of the fuzzing instrumentation and of any
+ * sanitizer of the build. They compare scenarios and builds with each other,
+ * and are best taken from a build without sanitizers.
+ *
+ *   fuzz_auth_bench -w 8 -d 10
+ *   fuzz_auth_bench nouserok manual
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cfg.h"
+#include "fuzz/fuzz.h"
+#include "fuzz/wiredata.h"
+#include "fuzz/authfile.h"
+
+#define DEFAULT_WORKERS 1
+#define DEFAULT_SECONDS 5
+#define MAX_WORKERS 1024
+
+struct scenario {
+  const char *name;
+  const char *user;
+  const char *conf; /* module arguments, split on semicolon */
+  const char *authfile;
+  const char *conv; /* responses, split on newline */
+  int devices;
+  int wiredata;
+};
+
+struct totals {
+  uint64_t logins;
+  uint64_t mismatches;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+  int retval;
+};
+
+struct worker {
+  pid_t pid;
+  int fd;
+};
+
+struct conv_appdata {
+  char *str;
+  char *save;
+};
+
+/* response to the manual challenge for AUTHFILE_SSH, as in fuzz_auth */
+static const char manual_conv[] =
+  "94/ZgCC5htEl9SRmTRfUffKCzU/2ScRJYNFSlC5U+ik=\n"
+  "ssh:\n"
+  "WCXjBhDooWIRWWD+HsIj5lKcn0tugCANy15cMhyK8eKxvwEAAAAP\n"
+  "MEQCIDBrIO3J/B9Y7LJca3A7t0m76WcxoATJe0NG/"
+  "ZsjOMq2AiAdBGrjMalfVtzEe0rjWfnRrGhMFyRyaRuPfCHVYdIWdg==\n";
+
+/* wiredata collected from an authenticator during authentication */
+static unsigned char wiredata[] = {
+  WIREDATA_CTAP_INIT,
+  WIREDATA_CTAP_CBOR_INFO,
+  WIREDATA_CTAP_CBOR_ASSERT_DISCOVER,
+  WIREDATA_CTAP_CBOR_ASSERT_AUTHENTICATE,
+};
+
+/* clang-format off */
+static const struct scenario scenarios[] = {
+  /* a user without credentials, let through */
+  { "nouserok",  "nobody", "nouserok",                   AUTHFILE_NEW, "",
+    0, 0 },
+  /* a user with credentials but no authenticator plugged in */
+  { "nodevice",  "user",   "",                           AUTHFILE_NEW, "",
+    0, 0 },
+  /* a response computed beforehand for the manual challenge */
+  { "manual",    "user",   "sshformat;pinverification=0;manual",
+    AUTHFILE_SSH, manual_conv, 0, 0 },
+  /* an authenticator answering an assertion for an SSH credential */
+  { "sshformat", "user",   "sshformat;pinverification=0", AUTHFILE_SSH, "",
+    1, 1 },
+};
+/* clang-format on */
+
+#define N_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static const char *progname;
+
+static void usage(void) {
+  size_t i;
+
+  fprintf(stderr, "usage: %s [-w workers] [-d seconds] [scenario...]\n",
+          progname);
+  fprintf(stderr, "scenarios:");
+  for (i = 0; i < N_SCENARIOS; i++)
+    fprintf(stderr, " %s", scenarios[i].name);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+static uint64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+
+  if (clock_gettime(id, &ts) != 0)
+    err(1, "clock_gettime");
+
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static int conv_cb(int num_msg, const struct pam_message **msg,
+                   struct pam_response **resp_p, void *appdata_ptr) {
+  struct conv_appdata *conv = appdata_ptr;
+  struct pam_response *resp;
+  const char *str;
+
+  if (num_msg != 1 || (*resp_p = resp = calloc(1, sizeof(*resp))) == NULL)
+    return PAM_CONV_ERR;
+
+  if (msg[0]->msg_style == PAM_PROMPT_ECHO_OFF ||
+      msg[0]->msg_style == PAM_PROMPT_ECHO_ON) {
+    str = strtok_r(conv->save ? NULL : conv->str, "\n", &conv->save);
+    if (str != NULL && (resp->resp = strdup(str)) == NULL) {
+      free(resp);
+      *resp_p = NULL;
+      return PAM_CONV_ERR;
+    }
+  }
+
+  return PAM_SUCCESS;
+}
+
+static int memfd(const char *name, const void *data, size_t len) {
+  ssize_t w;
+  int fd;
+
+  if ((fd = memfd_create(name, MFD_CLOEXEC)) == -1)
+    err(1, "memfd_create");
+  if ((w = write(fd, data, len)) == -1 || (size_t) w != len)
+    err(1, "write");
+
+  return fd;
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) == -1)
+      err(1, "write");
+    p += n;
+    len -= (size_t) n;
+  }
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = read(fd, p, len)) == -1)
+      err(1, "read");
+    if (n == 0)
+      return 0;
+    p += n;
+    len -= (size_t) n;
+  }
+
+  return 1;
+}
+
+/*
+ * Run one login. The authfile and configuration descriptors are dup()ed by
+ * the open() wrapper, sharing their offset, so they are rewound first.
+ */
+static int login(const struct scenario *s, int argc, const char **argv,
+                 int authfile_fd, int conf_fd, char *conv_buf,
+                 size_t conv_len) {
+  struct conv_appdata conv_data;
+  struct pam_conv conv;
+  int r;
+
+  if (lseek(authfile_fd, 0, SEEK_SET) == -1 ||
+      lseek(conf_fd, 0, SEEK_SET) == -1)
+    err(1, "lseek");
+
+  memcpy(conv_buf, s->conv, conv_len);
+  memset(&conv_data, 0, sizeof(conv_data));
+  conv_data.str = conv_buf;
+  conv.conv = conv_cb;
+  conv.appdata_ptr = &conv_data;
+  set_conv(&conv);
+
+  if (s->wiredata)
+    set_wiredata(wiredata, sizeof(wiredata));
+  else
+    set_wiredata(NULL, 0);
+
+  r = pam_sm_authenticate((void *) FUZZ_PAM_HANDLE, 0, argc, argv);
+  end_pam_data();
+
+  return r;
+}
+
+/* Log in repeatedly for the given time, then send the results to fd. */
+static void work(const struct scenario *s, unsigned id, unsigned seconds,
+                 int fd) {
+  const char *argv[32];
+  char conf[256], *token, *save = NULL, *conv_buf;
+  struct totals t;
+  uint64_t *lat = NULL, *p, start, cpu, deadline, t0;
+  size_t cap = 0, conv_len;
+  int argc = 0, authfile_fd, conf_fd, r;
+
+  if ((size_t) snprintf(conf, sizeof(conf), "%s", s->conf) >= sizeof(conf))
+    errx(1, "%s: module arguments too long", s->name);
+  for (token = strtok_r(conf, ";", &save); token != NULL && argc < 32;
+       token = strtok_r(NULL, ";", &save))
+    argv[argc++] = token;
+
+  conv_len = strlen(s->conv) + 1;
+  if ((conv_buf = malloc(conv_len)) == NULL)
+    err(1, "malloc");
+
+  /* an empty configuration file, the module arguments apply */
+  authfile_fd = memfd("u2f_keys", s->authfile, strlen(s->authfile));
+  conf_fd = memfd("pam_u2f.conf", "", 0);
+
+  prng_init(id + 1);
+  set_failure_injection(0);
+  set_devices(s->devices);
+  set_user(s->user);
+  set_authfile(authfile_fd);
+  set_conf_file_path(CFG_DEFAULT_PATH);
+  set_conf_file_fd(conf_fd);
+
+  memset(&t, 0, sizeof(t));
+  t.retval = login(s, argc, argv, authfile_fd, conf_fd, conv_buf, conv_len);
+
+  start = clock_ns(CLOCK_MONOTONIC);
+  cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  deadline = start + (uint64_t) seconds * 1000000000;
+
+  do {
+    if (t.logins == cap) {
+      cap = cap ? 2 * cap : 4096;
+      if ((p = realloc(lat, cap * sizeof(*lat))) == NULL)
+        err(1, "realloc");
+      lat = p;
+    }
+    t0 = clock_ns(CLOCK_MONOTONIC);
+    r = login(s, argc, argv, authfile_fd, conf_fd, conv_buf, conv_len);
+    lat[t.logins++] = clock_ns(CLOCK_MONOTONIC) - t0;
+    if (r != t.retval)
+      t.mismatches++;
+  } while (t0 + lat[t.logins - 1] < deadline);
+
+  t.wall_ns = clock_ns(CLOCK_MONOTONIC) - start;
+  t.cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+  write_all(fd, &t, sizeof(t));
+  write_all(fd, lat, t.logins * sizeof(*lat));
+
+  free(lat);
+  free(conv_buf);
+  close(authfile_fd);
+  close(conf_fd);
+}
+
+static int run(const struct scenario *s, unsigned workers, unsigned seconds) {
+  struct worker w[MAX_WORKERS];
+  struct totals all, t;
+  uint64_t *lat = NULL, *p;
+  double rate = 0;
+  int pfd[2], status, ok = 1;
+  unsigned i;
+
+  memset(&all, 0, sizeof(all));
+  fflush(stdout);
+
+  for (i = 0; i < workers; i++) {
+    if (pipe(pfd) == -1)
+      err(1, "pipe");
+    if ((w[i].pid = fork()) == -1)
+      err(1, "fork");
+    if (w[i].pid == 0) {
+      close(pfd[0]);
+      work(s, i, seconds, pfd[1]);
+      _exit(0);
+    }
+    close(pfd[1]);
+    w[i].fd = pfd[0];
+  }
+
+  for (i = 0; i < workers; i++) {
+    if (!read_all(w[i].fd, &t, sizeof(t)))
+      errx(1, "%s: worker %u exited early", s->name, i);
+    if ((p = realloc(lat, (all.logins + t.logins) * sizeof(*lat))) == NULL)
+      err(1, "realloc");
+    lat = p;
+    if (!read_all(w[i].fd, lat + all.logins, t.logins * sizeof(*lat)))
+      errx(1, "%s: worker %u exited early", s->name, i);
+    close(w[i].fd);
+
+    if (i == 0)
+      all.retval = t.retval;
+    else if (t.retval != all.retval)
+      all.mismatches += t.logins;
+    all.logins += t.logins;
+    all.mismatches += t.mismatches;
+    all.cpu_ns += t.cpu_ns;
+    rate += (double) t.logins / ((double) t.wall_ns / 1e9); /* per worker */
+  }
+
+  for (i = 0; i < workers; i++) {
+    if (waitpid(w[i].pid, &status, 0) == -1)
+      err(1, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ok = 0;
+  }
+  if (!ok)
+    errx(1, "%s: worker failed", s->name);
+
+  qsort(lat, all.logins, sizeof(*lat), cmp_u64);
+
+  printf("%-10s %7u %9" PRIu64 " %10.0f %9.1f %9.1f %12.1f %6d %10" PRIu64
+         "\n",
+         s->name, workers, all.logins, rate,
+         (double) lat[all.logins / 2] / 1e3,
+         (double) lat[all.logins - 1 - all.logins / 100] / 1e3,
+         (double) all.cpu_ns / (double) all.logins / 1e3, all.retval,
+         all.mismatches);
+
+  free(lat);
+
+  return all.mismatches == 0;
+}
+
+static int selected(const struct scenario *s, int argc, char **argv) {
+  if (argc == 0)
+    return 1;
+  for (int i = 0; i < argc; i++)
+    if (strcmp(argv[i], s->name) == 0)
+      return 1;
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned workers = DEFAULT_WORKERS, seconds = DEFAULT_SECONDS;
+  const struct scenario *s;
+  char *ep;
+  size_t j;
+  int ch, ok = 1;
+
+  progname = argv[0];
+
+  while ((ch = getopt(argc, argv, "w:d:")) != -1) {
+    switch (ch) {
+      case 'w':
+        workers = (unsigned) strtoul(optarg, &ep, 10);
+        if (*ep != '\0' || workers == 0 || workers > MAX_WORKERS)
+          usage();
+        break;
+      case 'd':
+        seconds = (unsigned) strtoul(optarg, &ep, 10);
+        if (*ep != '\0' || seconds == 0)
+          usage();
+        break;
+      default:
+        usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  for (int i = 0; i < argc; i++) {
+    for (j = 0; j < N_SCENARIOS; j++)
+      if (strcmp(argv[i], scenarios[j].name) == 0)
+        break;
+    if (j == N_SCENARIOS)
+      usage();
+  }
+
+  printf("%-10s %7s %9s %10s %9s %9s %12s %6s %10s\n", "scenario", "workers",
+         "logins", "logins/s", "p50 us", "p99 us", "cpu us/login", "result",
+         "mismatches");
+
+  for (j = 0; j < N_SCENARIOS; j++) {
+    s = &scenarios[j];
+    if (selected(s, argc, argv) && !run(s, workers, seconds))
+      ok = 0;
+  }
+
+  return ok ? 0 : 1;
+}
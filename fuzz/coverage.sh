@@ -9,7 +9,33 @@ fi
 llvm-profdata merge -sparse *.profraw -o default.profdata
 llvm-cov report -show-functions -instr-profile=default.profdata fuzz_format_parsers ../*.c
 
+# the byte-level and the structure-aware ssh parser fuzzers side by side, on
+# the same run budget, kept apart from the downloaded corpus; the former
+# starts from the ssh test credential (see make_seed.py), the latter from the
+# key its mutator builds
+rm -rf compare
+mkdir -p compare/format_parsers compare/ssh_key
+{ printf '\011\001\001\001\001\000'
+  cat ../tests/credentials/ssh_credential.cred.in; } > compare/format_parsers/seed
+for target in format_parsers ssh_key; do
+    LLVM_PROFILE_FILE=compare/${target}.profraw \
+        ./fuzz_${target} -runs=65536 -print_final_stats=1 compare/${target} \
+        2> compare/${target}.log
+    llvm-profdata merge -sparse compare/${target}.profraw \
+        -o compare/${target}.profdata
+    llvm-cov report -show-functions -instr-profile=compare/${target}.profdata \
+        fuzz_${target} ../util.c > compare/${target}.report
+done
+set +x
+for target in format_parsers ssh_key; do
+    echo "fuzz_${target}:" \
+        "$(sed -n 's/^stat::average_exec_per_sec: *//p' compare/${target}.log)" \
+        "exec/s"
+    grep -E '^(Name|TOTAL|parse_ssh_format|ssh_)' compare/${target}.report
+done
+
 # other report alternatives for convenience:
 #llvm-cov report -use-color=false -instr-profile=default.profdata fuzz_format_parsers
 #llvm-cov show -format=html -tab-size=8 -instr-profile=default.profdata -output-dir=report fuzz_format_parsers
 #llvm-cov show fuzz_format_parsers -instr-profile=default.profdata -name=format -format=html > report.html
+#llvm-cov show fuzz_ssh_key -instr-profile=compare/ssh_key.profdata -name=ssh -format=html > report.html
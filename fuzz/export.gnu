@@ -9,6 +9,9 @@
     set_wiredata;
     set_conf_file_fd;
     set_conf_file_path;
+    set_failure_injection;
+    set_devices;
+    end_pam_data;
   local:
     *;
 };
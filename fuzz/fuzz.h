@@ -23,6 +23,9 @@ void set_conv(struct pam_conv *);
 void set_authfile(int);
 void set_conf_file_path(const char *);
 void set_conf_file_fd(int);
+void set_failure_injection(int);
+void set_devices(int);
+void end_pam_data(void);
 
 int pack_u32(uint8_t **, size_t *, uint32_t);
 int unpack_u32(const uint8_t **, size_t *, uint32_t *);
@@ -60,6 +60,7 @@ static const char dummy_conf_file[] = "max_devices=10\n"
                                       "interactive\n"
                                       "cue\n"
                                       "nodetect\n"
+                                      "nodevice=ignore\n"
                                       "expand\n"
                                       "userpresence=0\n"
                                       "userverification=0\n"
@@ -67,10 +68,18 @@ static const char dummy_conf_file[] = "max_devices=10\n"
                                       "authfile=/foo/bar\n"
                                       "sshformat\n"
                                       "authpending_file=/baz/quux\n"
+                                      "migrate_sidecar=/baz/corge\n"
+                                      "event_socket=/baz/grault\n"
+                                      "sigcount_file=/baz/garply\n"
+                                      "rk_cache=/baz/waldo\n"
+                                      "usage_file=/baz/fred\n"
+                                      "keyring_cache=60\n"
+                                      "device_lock=30\n"
                                       "origin=pam://lolcalhost\n"
                                       "appid=pam://lolcalhost\n"
                                       "prompt=hello\n"
                                       "cue_prompt=howdy\n"
+                                      "debug_level=trace\n"
                                       "debug_file=stdout\n";
 
 /* conversation dummy for manual authentication */
@@ -332,6 +341,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
   set_conf_file_fd(conf_file_fd);
 
   pam_sm_authenticate((void *) FUZZ_PAM_HANDLE, 0, argc, argv);
+  end_pam_data();
 
 err:
   if (authfile_fd != -1)
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "debug.h"
 #include "fuzz/fuzz.h"
 #include "util.h"
 
@@ -19,10 +20,12 @@ static void cleanup(device_t *devs, unsigned int n_devs) {
     free(devs[i].publicKey);
     free(devs[i].coseType);
     free(devs[i].attributes);
+    free(devs[i].rpId);
     devs[i].keyHandle = NULL;
     devs[i].publicKey = NULL;
     devs[i].coseType = NULL;
     devs[i].attributes = NULL;
+    devs[i].rpId = NULL;
   }
 }
 
@@ -50,7 +53,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
   }
   /* do not always run with debug, only 8/255 times */
   if (data[offset++] < 9) {
-    cfg.debug = 1;
+    cfg.debug = DEBUG_LVL_TRACE;
   }
 
   /* predictable random for this seed */
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+/*
+ * Replay a fuzzing corpus through a fuzz target for timing, with the failure
+ * injection of wrap.c turned off so that every input takes its full path.
+ * Each input runs once to warm up, then -n times; its median time is written
+ * as "<ns>\t<size>\t<name>" to stdout or the -o file, and the slowest inputs
+ * are reported on stderr along with their time per byte, which stands out on
+ * inputs triggering quadratic behaviour.
+ *
+ * Two builds are compared by saving the results of the first and passing
+ * them with -b to the second. Inputs slower by more than the -t factor are
+ * reported, and the exit status is 1 if there are any. Targets may log to
+ * stdout, so results are best written with -o.
+ *
+ *   fuzz_format_parsers_replay -o before.tsv corpus/format_parsers
+ *   fuzz_format_parsers_replay -b before.tsv corpus/format_parsers
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fuzz/fuzz.h"
+
+#define DEFAULT_RUNS 5
+#define DEFAULT_WORST 10
+#define DEFAULT_FACTOR 1.5
+#define MIN_COMPARE_NS 10000 /* shorter runs are too noisy to compare */
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+struct result {
+  char *name;
+  size_t size;
+  uint64_t ns;
+};
+
+struct results {
+  struct result *r;
+  size_t n;
+  size_t cap;
+};
+
+static const char *progname;
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: %s [-n runs] [-w worst] [-o results] "
+          "[-b baseline [-t factor]] corpus...\n",
+          progname);
+  exit(2);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    err(1, "clock_gettime");
+
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static int cmp_name(const void *a, const void *b) {
+  return strcmp(((const struct result *) a)->name,
+                ((const struct result *) b)->name);
+}
+
+static int cmp_slowest(const void *a, const void *b) {
+  uint64_t x = ((const struct result *) a)->ns;
+  uint64_t y = ((const struct result *) b)->ns;
+
+  return (x < y) - (x > y);
+}
+
+static struct result *add_result(struct results *rs) {
+  struct result *r;
+
+  if (rs->n == rs->cap) {
+    rs->cap = rs->cap ? 2 * rs->cap : 256;
+    if ((r = realloc(rs->r, rs->cap * sizeof(*r))) == NULL)
+      err(1, "realloc");
+    rs->r = r;
+  }
+
+  r = &rs->r[rs->n++];
+  memset(r, 0, sizeof(*r));
+
+  return r;
+}
+
+static void free_results(struct results *rs) {
+  for (size_t i = 0; i < rs->n; i++)
+    free(rs->r[i].name);
+  free(rs->r);
+  memset(rs, 0, sizeof(*rs));
+}
+
+static uint8_t *slurp(const char *path, size_t *len) {
+  struct stat st;
+  uint8_t *buf;
+  FILE *fp;
+
+  if ((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &st) != 0)
+    err(1, "%s", path);
+  if (!S_ISREG(st.st_mode) || st.st_size < 0)
+    errx(1, "%s: not a regular file", path);
+
+  *len = (size_t) st.st_size;
+  if ((buf = malloc(*len ? *len : 1)) == NULL)
+    err(1, "malloc");
+  if (fread(buf, 1, *len, fp) != *len)
+    errx(1, "%s: short read", path);
+  fclose(fp);
+
+  return buf;
+}
+
+static void replay(struct results *rs, const char *path, const char *name,
+                   unsigned runs) {
+  struct result *r;
+  uint64_t *t, start;
+  uint8_t *data;
+  size_t len;
+
+  data = slurp(path, &len);
+  if ((t = calloc(runs, sizeof(*t))) == NULL)
+    err(1, "calloc");
+
+  LLVMFuzzerTestOneInput(data, len); /* warm up */
+  for (unsigned i = 0; i < runs; i++) {
+    start = now_ns();
+    LLVMFuzzerTestOneInput(data, len);
+    t[i] = now_ns() - start;
+  }
+  qsort(t, runs, sizeof(*t), cmp_u64);
+
+  r = add_result(rs);
+  if ((r->name = strdup(name)) == NULL)
+    err(1, "strdup");
+  r->size = len;
+  r->ns = t[runs / 2];
+
+  free(t);
+  free(data);
+}
+
+static int visible(const struct dirent *de) { return de->d_name[0] != '.'; }
+
+static void replay_path(struct results *rs, const char *path, unsigned runs) {
+  struct dirent **de;
+  struct stat st;
+  char *file;
+  const char *base;
+  int n;
+
+  if (stat(path, &st) != 0)
+    err(1, "%s", path);
+
+  if (!S_ISDIR(st.st_mode)) {
+    base = strrchr(path, '/');
+    replay(rs, path, base ? base + 1 : path, runs);
+    return;
+  }
+
+  /* sorted, so that runs of different builds replay in the same order */
+  if ((n = scandir(path, &de, visible, alphasort)) < 0)
+    err(1, "%s", path);
+
+  for (int i = 0; i < n; i++) {
+    if (asprintf(&file, "%s/%s", path, de[i]->d_name) == -1)
+      err(1, "asprintf");
+    if (stat(file, &st) == 0 && S_ISREG(st.st_mode))
+      replay(rs, file, de[i]->d_name, runs);
+    free(file);
+    free(de[i]);
+  }
+  free(de);
+}
+
+static void load_baseline(struct results *rs, const char *path) {
+  char *line = NULL, *name;
+  struct result *r;
+  size_t size = 0;
+  uint64_t ns;
+  size_t len;
+  FILE *fp;
+  int pos;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    err(1, "%s", path);
+
+  while (getline(&line, &size, fp) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%" SCNu64 "\t%zu\t%n", &ns, &len, &pos) != 2)
+      errx(1, "%s: malformed line '%s'", path, line);
+    if ((name = strdup(line + pos)) == NULL)
+      err(1, "strdup");
+    r = add_result(rs);
+    r->name = name;
+    r->size = len;
+    r->ns = ns;
+  }
+
+  free(line);
+  fclose(fp);
+  qsort(rs->r, rs->n, sizeof(*rs->r), cmp_name);
+}
+
+static void report_worst(struct results *rs, unsigned worst) {
+  struct result *r;
+
+  qsort(rs->r, rs->n, sizeof(*rs->r), cmp_slowest);
+
+  fprintf(stderr, "slowest of %zu input(s):\n", rs->n);
+  for (size_t i = 0; i < rs->n && i < worst; i++) {
+    r = &rs->r[i];
+    fprintf(stderr, "%12" PRIu64 " ns %8zu bytes %10.1f ns/byte  %s\n", r->ns,
+            r->size, (double) r->ns / (double) (r->size ? r->size : 1),
+            r->name);
+  }
+}
+
+static int compare(const struct results *rs, const struct results *base,
+                   double factor) {
+  const struct result *b;
+  uint64_t before = 0, after = 0;
+  size_t n = 0, slower = 0;
+  double ratio;
+
+  for (size_t i = 0; i < rs->n; i++) {
+    b = bsearch(&rs->r[i], base->r, base->n, sizeof(*base->r), cmp_name);
+    if (b == NULL || b->ns == 0 || rs->r[i].ns == 0)
+      continue;
+
+    ratio = (double) rs->r[i].ns / (double) b->ns;
+    before += b->ns;
+    after += rs->r[i].ns;
+    n++;
+
+    if (ratio > factor && rs->r[i].ns >= MIN_COMPARE_NS) {
+      fprintf(stderr,
+              "slower: %12" PRIu64 " ns -> %12" PRIu64 " ns (x%.2f)  %s\n",
+              b->ns, rs->r[i].ns, ratio, rs->r[i].name);
+      slower++;
+    }
+  }
+
+  if (n == 0) {
+    fprintf(stderr, "no input in common with the baseline\n");
+    return 0;
+  }
+
+  fprintf(stderr, "%zu input(s) compared, total x%.3f, %zu slower than x%.2f\n",
+          n, (double) after / (double) before, slower, factor);
+
+  return slower == 0;
+}
+
+int main(int argc, char **argv) {
+  struct results rs = {0}, base = {0};
+  const char *out = NULL, *baseline = NULL;
+  unsigned runs = DEFAULT_RUNS, worst = DEFAULT_WORST;
+  double factor = DEFAULT_FACTOR;
+  char *ep;
+  FILE *fp = stdout;
+  int ch, ok = 1;
+
+  progname = argv[0];
+
+  while ((ch = getopt(argc, argv, "n:w:o:b:t:")) != -1) {
+    switch (ch) {
+      case 'n':
+        runs = (unsigned) strtoul(optarg, &ep, 10);
+        if (*ep != '\0' || runs == 0)
+          usage();
+        break;
+      case 'w':
+        worst = (unsigned) strtoul(optarg, &ep, 10);
+        if (*ep != '\0')
+          usage();
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'b':
+        baseline = optarg;
+        break;
+      case 't':
+        factor = strtod(optarg, &ep);
+        if (*ep != '\0' || factor <= 0)
+          usage();
+        break;
+      default:
+        usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc == 0)
+    usage();
+
+  if (baseline != NULL)
+    load_baseline(&base, baseline);
+
+  set_failure_injection(0);
+  for (int i = 0; i < argc; i++)
+    replay_path(&rs, argv[i], runs);
+
+  if (out != NULL && (fp = fopen(out, "w")) == NULL)
+    err(1, "%s", out);
+  for (size_t i = 0; i < rs.n; i++)
+    fprintf(fp, "%" PRIu64 "\t%zu\t%s\n", rs.r[i].ns, rs.r[i].size,
+            rs.r[i].name);
+  if (fp != stdout && fclose(fp) != 0)
+    err(1, "%s", out);
+
+  if (baseline != NULL)
+    ok = compare(&rs, &base, factor);
+  report_worst(&rs, worst);
+
+  free_results(&rs);
+  free_results(&base);
+
+  return ok ? 0 : 1;
+}
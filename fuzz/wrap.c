@@ -40,13 +40,20 @@ static int conf_file_fd = -1;
 static int conf_file_fd_lastdup = -1;
 static int authfile_fd = -1;
 static char env[] = "value";
+static int inject_failures = 1;
+static int n_devices = -1; /* random */
+
+/* injected failure with probability 1/n, unless turned off */
+static int inject_failure(uint32_t n) {
+  return inject_failures && uniform_random(n) < 1;
+}
 
 /* wrap a function, make it fail 0.25% of the time */
 #define WRAP(type, name, args, retval, param)                                  \
   extern type __wrap_##name args;                                              \
   extern type __real_##name args;                                              \
   type __wrap_##name args {                                                    \
-    if (prng_up && uniform_random(400) < 1) {                                  \
+    if (prng_up && inject_failure(400)) {                                      \
       return (retval);                                                         \
     }                                                                          \
                                                                                \
@@ -62,6 +69,8 @@ void set_conv(struct pam_conv *conv) { conv_ptr = conv; }
 void set_conf_file_path(const char *path) { conf_file_path = path; }
 void set_conf_file_fd(int fd) { conf_file_fd = fd; }
 void set_authfile(int fd) { authfile_fd = fd; }
+void set_failure_injection(int on) { inject_failures = on; }
+void set_devices(int n) { n_devices = n; }
 
 WRAP(int, close, (int fd), -1, (fd))
 WRAP(void *, strdup, (const char *s), NULL, (s))
@@ -110,7 +119,7 @@ extern int __wrap_asprintf(char **strp, const char *fmt, ...) {
   va_list ap;
   int r;
 
-  if (uniform_random(400) < 1) {
+  if (inject_failure(400)) {
     *strp = (void *) 0xdeadbeef;
     return -1;
   }
@@ -131,13 +140,19 @@ extern int __real_open(const char *pathname, int flags);
 extern int __wrap_open(const char *pathname, int flags);
 extern int __wrap_open(const char *pathname, int flags) {
 
-  if (prng_up && uniform_random(400) < 1)
+  if (prng_up && inject_failure(400))
     return -1;
 
   /* open write-only files as /dev/null */
   if ((flags & O_ACCMODE) == O_WRONLY)
     return __real_open("/dev/null", flags);
 
+  /* read-write state files are not available */
+  if ((flags & O_ACCMODE) == O_RDWR) {
+    errno = EACCES;
+    return -1;
+  }
+
   assert((flags & O_ACCMODE) == O_RDONLY);
 
   /* FIXME: special handling for /dev/random */
@@ -161,9 +176,9 @@ extern int __wrap_getpwuid_r(uid_t uid, struct passwd *pwd, char *buf,
   int offset;
 
   *result = NULL;
-  if (user == NULL || uniform_random(400) < 1)
+  if (user == NULL || inject_failure(400))
     return EIO;
-  if (uniform_random(400) < 1)
+  if (inject_failure(400))
     return 0; /* No matching record */
   if (uniform_random(400) < 1)
     user = "root";
@@ -183,7 +198,7 @@ extern int __wrap_getpwuid_r(uid_t uid, struct passwd *pwd, char *buf,
       (size_t) offset >= buflen)
     return ENOMEM;
 
-  if (offset > 1 && uniform_random(400) < 1)
+  if (offset > 1 && inject_failure(400))
     buf[offset - 1] = '\0'; /* unexpected username */
 
   pwd->pw_name = buf;
@@ -207,7 +222,7 @@ extern int __wrap_pam_get_item(const pam_handle_t *pamh, int item_type,
   assert(item != NULL);
   *item = conv_ptr;
 
-  return uniform_random(400) < 1 ? PAM_CONV_ERR : PAM_SUCCESS;
+  return inject_failure(400) ? PAM_CONV_ERR : PAM_SUCCESS;
 }
 
 extern int __wrap_pam_get_user(pam_handle_t *, const char **, const char *);
@@ -218,7 +233,52 @@ extern int __wrap_pam_get_user(pam_handle_t *pamh, const char **user_p,
   assert(prompt == NULL);
   *user_p = user_ptr;
 
-  return uniform_random(400) < 1 ? PAM_CONV_ERR : PAM_SUCCESS;
+  return inject_failure(400) ? PAM_CONV_ERR : PAM_SUCCESS;
+}
+
+/* A single module data slot, released by end_pam_data() like pam_end(). */
+static struct {
+  void *data;
+  void (*cleanup)(pam_handle_t *, void *, int);
+} pam_data;
+
+void end_pam_data(void) {
+  if (pam_data.cleanup != NULL)
+    pam_data.cleanup((void *) FUZZ_PAM_HANDLE, pam_data.data, PAM_SUCCESS);
+  memset(&pam_data, 0, sizeof(pam_data));
+}
+
+extern int __wrap_pam_get_data(const pam_handle_t *, const char *,
+                               const void **);
+extern int __wrap_pam_get_data(const pam_handle_t *pamh, const char *name,
+                               const void **data) {
+  assert(pamh == (void *) FUZZ_PAM_HANDLE);
+  assert(name != NULL);
+  assert(data != NULL);
+
+  if (pam_data.data == NULL)
+    return PAM_NO_MODULE_DATA;
+  *data = pam_data.data;
+
+  return PAM_SUCCESS;
+}
+
+extern int __wrap_pam_set_data(pam_handle_t *, const char *, void *,
+                               void (*)(pam_handle_t *, void *, int));
+extern int __wrap_pam_set_data(pam_handle_t *pamh, const char *name,
+                               void *data,
+                               void (*cleanup)(pam_handle_t *, void *, int)) {
+  assert(pamh == (void *) FUZZ_PAM_HANDLE);
+  assert(name != NULL);
+
+  if (inject_failure(400))
+    return PAM_BUF_ERR;
+
+  end_pam_data();
+  pam_data.data = data;
+  pam_data.cleanup = cleanup;
+
+  return PAM_SUCCESS;
 }
 
 extern int __wrap_pam_modutil_drop_priv(pam_handle_t *, fuzz_privs_t *,
@@ -229,7 +289,7 @@ extern int __wrap_pam_modutil_drop_priv(pam_handle_t *pamh, fuzz_privs_t *privs,
   assert(privs != NULL);
   assert(pwd != NULL);
 
-  return uniform_random(400) < 1 ? -1 : 0;
+  return inject_failure(400) ? -1 : 0;
 }
 
 extern int __wrap_pam_modutil_regain_priv(pam_handle_t *, fuzz_privs_t *,
@@ -241,7 +301,7 @@ extern int __wrap_pam_modutil_regain_priv(pam_handle_t *pamh,
   assert(privs != NULL);
   assert(pwd != NULL);
 
-  return uniform_random(400) < 1 ? -1 : 0;
+  return inject_failure(400) ? -1 : 0;
 }
 
 extern char *__wrap_secure_getenv(const char *);
@@ -325,7 +385,10 @@ extern int __wrap_fido_dev_info_manifest(fido_dev_info_t *devlist, size_t ilen,
   (void) devlist;
   (void) ilen;
 
-  *olen = (size_t) uniform_random((uint32_t) ilen);
+  if (n_devices < 0)
+    *olen = (size_t) uniform_random((uint32_t) ilen);
+  else
+    *olen = (size_t) n_devices < ilen ? (size_t) n_devices : ilen;
 
-  return uniform_random(400) < 1 ? FIDO_ERR_INTERNAL : FIDO_OK;
+  return inject_failure(400) ? FIDO_ERR_INTERNAL : FIDO_OK;
 }
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_KEYCTL_H
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "debug.h"
+#include "keyring.h"
+
+/*
+ * The keyring cache keeps the credentials read from an authfile in the
+ * kernel, so that the processes forked for every login, by sshd for
+ * instance, need not read and parse the authfile again. Each user has one
+ * "user" key in the user keyring of root, described as
+ *
+ *   pam_u2f:<sshformat>:<user>:<authfile>
+ *
+ * and expiring after cfg->keyring_cache seconds. The payload is a version,
+ * the identity of the authfile when it was read, and the credentials:
+ *
+ *   u32 version, u64 dev, u64 ino, i64 size, i64 mtime, i64 mtime_ns,
+ *   i64 ctime, i64 ctime_ns, u32 n
+ *   n * (u32 old_format, 5 * (u32 len, len bytes))
+ *
+ * in host byte order. String lengths count the terminating NUL, 0 standing
+ * for a missing string. Callers compare the identity with the authfile
+ * before trusting the credentials.
+ */
+
+#define KEYRING_VERSION 2
+#define KEYRING_DESC_LEN 4096 /* kernel limit, NUL included */
+#define KEYRING_PERM 0x3f030000 /* possessor: all, owner: view and read */
+
+#ifdef HAVE_LINUX_KEYCTL_H
+struct buf {
+  unsigned char *ptr;
+  size_t len;
+  size_t off;
+};
+
+static int put(struct buf *b, const void *p, size_t len) {
+  if (len > b->len - b->off)
+    return 0;
+  memcpy(b->ptr + b->off, p, len);
+  b->off += len;
+  return 1;
+}
+
+static int get(struct buf *b, void *p, size_t len) {
+  if (len > b->len - b->off)
+    return 0;
+  memcpy(p, b->ptr + b->off, len);
+  b->off += len;
+  return 1;
+}
+
+static int put_u32(struct buf *b, uint32_t v) { return put(b, &v, sizeof(v)); }
+
+static int put_u64(struct buf *b, uint64_t v) { return put(b, &v, sizeof(v)); }
+
+static int put_str(struct buf *b, const char *s) {
+  size_t len = s ? strlen(s) + 1 : 0;
+
+  return len <= UINT32_MAX && put_u32(b, (uint32_t) len) && put(b, s, len);
+}
+
+static int get_u32(struct buf *b, uint32_t *v) { return get(b, v, sizeof(*v)); }
+
+static int get_u64(struct buf *b, uint64_t *v) { return get(b, v, sizeof(*v)); }
+
+static int get_str(struct buf *b, char **s) {
+  uint32_t len;
+
+  *s = NULL;
+  if (!get_u32(b, &len))
+    return 0;
+  if (len == 0)
+    return 1;
+  if (len > b->len - b->off || b->ptr[b->off + len - 1] != '\0' ||
+      memchr(b->ptr + b->off, '\0', len - 1) != NULL)
+    return 0;
+  if ((*s = strdup((const char *) b->ptr + b->off)) == NULL)
+    return 0;
+  b->off += len;
+  return 1;
+}
+
+static int serialize(struct buf *b, const struct stat *st,
+                     const device_t *devices, unsigned n_devs) {
+  unsigned i;
+
+  if (!put_u32(b, KEYRING_VERSION) || !put_u64(b, (uint64_t) st->st_dev) ||
+      !put_u64(b, (uint64_t) st->st_ino) ||
+      !put_u64(b, (uint64_t) st->st_size) ||
+      !put_u64(b, (uint64_t) st->st_mtim.tv_sec) ||
+      !put_u64(b, (uint64_t) st->st_mtim.tv_nsec) ||
+      !put_u64(b, (uint64_t) st->st_ctim.tv_sec) ||
+      !put_u64(b, (uint64_t) st->st_ctim.tv_nsec) || !put_u32(b, n_devs))
+    return 0;
+
+  for (i = 0; i < n_devs; i++) {
+    if (!put_u32(b, (uint32_t) devices[i].old_format) ||
+        !put_str(b, devices[i].publicKey) ||
+        !put_str(b, devices[i].keyHandle) ||
+        !put_str(b, devices[i].coseType) ||
+        !put_str(b, devices[i].attributes) || !put_str(b, devices[i].rpId))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int deserialize(struct buf *b, unsigned max_devs, struct stat *st,
+                       device_t *devices, unsigned *n_devs) {
+  uint64_t dev, ino, size, mtime, mtime_ns, ctime, ctime_ns;
+  uint32_t version, n, old_format;
+  unsigned i;
+
+  if (!get_u32(b, &version) || version != KEYRING_VERSION ||
+      !get_u64(b, &dev) || !get_u64(b, &ino) || !get_u64(b, &size) ||
+      !get_u64(b, &mtime) || !get_u64(b, &mtime_ns) || !get_u64(b, &ctime) ||
+      !get_u64(b, &ctime_ns) || !get_u32(b, &n) || n == 0 || n > max_devs)
+    return 0;
+
+  memset(st, 0, sizeof(*st));
+  st->st_dev = (dev_t) dev;
+  st->st_ino = (ino_t) ino;
+  st->st_size = (off_t) size;
+  st->st_mtim.tv_sec = (time_t) mtime;
+  st->st_mtim.tv_nsec = (long) mtime_ns;
+  st->st_ctim.tv_sec = (time_t) ctime;
+  st->st_ctim.tv_nsec = (long) ctime_ns;
+
+  for (i = 0; i < n; i++) {
+    *n_devs = i + 1; /* reset by the caller on failure */
+    if (!get_u32(b, &old_format) || !get_str(b, &devices[i].publicKey) ||
+        !get_str(b, &devices[i].keyHandle) ||
+        !get_str(b, &devices[i].coseType) ||
+        !get_str(b, &devices[i].attributes) || !get_str(b, &devices[i].rpId) ||
+        devices[i].publicKey == NULL || devices[i].keyHandle == NULL)
+      return 0;
+    devices[i].old_format = old_format != 0;
+  }
+
+  return b->off == b->len;
+}
+
+static int describe(const cfg_t *cfg, const char *user, char *desc,
+                    size_t size) {
+  int n;
+
+  n = snprintf(desc, size, "pam_u2f:%d:%s:%s", cfg->sshformat, user,
+               cfg->auth_file);
+
+  return n > 0 && (size_t) n < size;
+}
+#endif
+
+/*
+ * The cache is only used by processes fully running as root, whose user
+ * keyring is that of root. Anyone else could plant credentials in their own.
+ */
+int keyring_available(const cfg_t *cfg) {
+  if (cfg->keyring_cache <= 0)
+    return 0;
+#if !defined(HAVE_LINUX_KEYCTL_H) || defined(WITH_FUZZING)
+  debug_warn(cfg, "The keyring cache is not supported by this build");
+  return 0;
+#else
+  if (getuid() != 0 || geteuid() != 0) {
+    debug_dbg(cfg, "Not running as root, skipping the keyring cache");
+    return 0;
+  }
+  return 1;
+#endif
+}
+
+#ifdef HAVE_LINUX_KEYCTL_H
+/* Whether a key is owned by root, as returned by KEYCTL_DESCRIBE. */
+static int owned_by_root(long key) {
+  char desc[KEYRING_DESC_LEN + 64];
+  const char *uid;
+  long n;
+
+  n = syscall(SYS_keyctl, KEYCTL_DESCRIBE, key, desc, sizeof(desc));
+  if (n <= 0 || (size_t) n > sizeof(desc))
+    return 0;
+  desc[sizeof(desc) - 1] = '\0';
+
+  /* type;uid;gid;perm;description */
+  return (uid = strchr(desc, ';')) != NULL && strncmp(uid, ";0;", 3) == 0;
+}
+#endif
+
+/*
+ * Load the credentials cached for a user, along with the identity of the
+ * authfile they were read from. Returns 1 on a hit.
+ */
+int keyring_lookup(const cfg_t *cfg, const char *user, struct stat *st,
+                   device_t *devices, unsigned *n_devs) {
+#ifndef HAVE_LINUX_KEYCTL_H
+  (void) cfg;
+  (void) user;
+  (void) st;
+  (void) devices;
+  *n_devs = 0;
+  return 0;
+#else
+  char desc[KEYRING_DESC_LEN];
+  struct buf b;
+  long key, n;
+  unsigned i;
+  int ok = 0;
+
+  *n_devs = 0;
+  memset(&b, 0, sizeof(b));
+
+  if (!describe(cfg, user, desc, sizeof(desc)))
+    return 0;
+
+  key = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, "user", desc,
+                0);
+  if (key == -1) {
+    if (errno != ENOKEY && errno != EKEYEXPIRED)
+      debug_dbg(cfg, "Keyring search failed: %s", strerror(errno));
+    return 0;
+  }
+
+  if (!owned_by_root(key)) {
+    debug_warn(cfg, "Ignoring keyring entry not owned by root");
+    return 0;
+  }
+
+  if ((b.ptr = malloc(KEYRING_MAX_PAYLOAD)) == NULL) {
+    debug_err(cfg, "Unable to allocate memory");
+    return 0;
+  }
+
+  n = syscall(SYS_keyctl, KEYCTL_READ, key, b.ptr, KEYRING_MAX_PAYLOAD);
+  if (n < 0 || n > KEYRING_MAX_PAYLOAD) {
+    debug_dbg(cfg, "Unable to read keyring entry");
+    goto out;
+  }
+  b.len = (size_t) n;
+
+  if (!deserialize(&b, cfg->max_devs, st, devices, n_devs)) {
+    debug_warn(cfg, "Malformed keyring entry for user %s", user);
+    goto out;
+  }
+
+  /* cached credentials were valid when stored, decode them for use */
+  if (validate_devices(cfg, devices, *n_devs) != *n_devs) {
+    debug_warn(cfg, "Invalid credentials in keyring entry for user %s", user);
+    goto out;
+  }
+
+  debug_dbg(cfg, "Found %u device(s) for user %s in the keyring", *n_devs,
+            user);
+  ok = 1;
+
+out:
+  if (!ok) {
+    for (i = 0; i < *n_devs; i++)
+      reset_device(&devices[i]);
+    *n_devs = 0;
+  }
+  if (b.ptr != NULL) {
+    explicit_bzero(b.ptr, b.len);
+    free(b.ptr);
+  }
+
+  return ok;
+#endif
+}
+
+/* Cache the credentials of a user, read from an authfile with identity st. */
+int keyring_store(const cfg_t *cfg, const char *user, const struct stat *st,
+                  const device_t *devices, unsigned n_devs) {
+#ifndef HAVE_LINUX_KEYCTL_H
+  (void) cfg;
+  (void) user;
+  (void) st;
+  (void) devices;
+  (void) n_devs;
+  return 0;
+#else
+  char desc[KEYRING_DESC_LEN];
+  struct buf b;
+  long key;
+  int ok = 0;
+
+  memset(&b, 0, sizeof(b));
+
+  if (!describe(cfg, user, desc, sizeof(desc)))
+    return 0;
+
+  if ((b.ptr = malloc(KEYRING_MAX_PAYLOAD)) == NULL) {
+    debug_err(cfg, "Unable to allocate memory");
+    return 0;
+  }
+  b.len = KEYRING_MAX_PAYLOAD;
+
+  if (!serialize(&b, st, devices, n_devs)) {
+    debug_dbg(cfg, "Credentials of user %s too large for the keyring", user);
+    goto out;
+  }
+
+  key = syscall(SYS_add_key, "user", desc, b.ptr, b.off, KEY_SPEC_USER_KEYRING);
+  if (key == -1) {
+    debug_dbg(cfg, "Unable to add keyring entry: %s", strerror(errno));
+    goto out;
+  }
+
+  if (syscall(SYS_keyctl, KEYCTL_SETPERM, key,
+              KEYRING_PERM) == -1 ||
+      syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, key,
+              (unsigned) cfg->keyring_cache) == -1) {
+    debug_dbg(cfg, "Unable to set up keyring entry: %s", strerror(errno));
+    (void) syscall(SYS_keyctl, KEYCTL_UNLINK, key, KEY_SPEC_USER_KEYRING);
+    goto out;
+  }
+
+  debug_dbg(cfg, "Cached %u device(s) for user %s in the keyring", n_devs,
+            user);
+  ok = 1;
+
+out:
+  explicit_bzero(b.ptr, b.len);
+  free(b.ptr);
+
+  return ok;
+#endif
+}
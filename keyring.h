@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef KEYRING_H
+#define KEYRING_H
+
+#include <sys/stat.h>
+
+#include "cfg.h"
+#include "util.h"
+
+#define KEYRING_MAX_PAYLOAD 32767 /* largest "user" key */
+
+int keyring_available(const cfg_t *cfg);
+int keyring_lookup(const cfg_t *cfg, const char *user, struct stat *st,
+                   device_t *devices, unsigned *n_devs);
+int keyring_store(const cfg_t *cfg, const char *user, const struct stat *st,
+                  const device_t *devices, unsigned n_devs);
+
+#endif /* KEYRING_H */
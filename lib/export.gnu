@@ -0,0 +1,12 @@
+{
+  global:
+    pamu2f_credential;
+    pamu2f_free;
+    pamu2f_load;
+    pamu2f_new;
+    pamu2f_set_workers;
+    pamu2f_strerror;
+    pamu2f_verify_batch;
+  local:
+    *;
+};
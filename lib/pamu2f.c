@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fido.h>
+
+#include "expand.h"
+#include "pamu2f.h"
+#include "util.h"
+
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_MAX_ENTRIES 4096
+#define CACHE_NOUSER_TTL 5 /* seconds */
+#define MAX_WORKERS 64
+
+/*
+ * The credentials of a user, with their public keys already parsed. Lookups
+ * that failed for want of credentials are cached for CACHE_NOUSER_TTL
+ * seconds, so that a burst of assertions for an unknown user does not parse
+ * the authfile for each. At most CACHE_MAX_ENTRIES users are kept, the least
+ * recently used being evicted first, unless pinned by the batch being
+ * resolved.
+ */
+struct entry {
+  struct entry *next;
+  struct entry *lru_prev; /* more recently used */
+  struct entry *lru_next; /* less recently used */
+  char *username;
+  uint32_t hash;
+  int status;
+  time_t expires; /* negative entries only */
+  unsigned pins;
+  device_t *devices; /* decoded on load */
+  unsigned n_devs;
+};
+
+struct pamu2f_ctx {
+  cfg_t cfg;
+  char *auth_file;
+  char *origin;
+  char *appid;
+  struct stat st;
+  int have_st;
+  struct entry **buckets;
+  size_t n_buckets;
+  size_t n_entries;
+  struct entry *lru_head;
+  struct entry *lru_tail;
+  /* worker pool, guarded by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_t *workers;
+  unsigned n_workers;
+  int stop;
+  pamu2f_assertion_t *batch;
+  struct entry **batch_entries;
+  size_t batch_len;
+  size_t next;
+  size_t pending;
+};
+
+static void free_entry(struct entry *e) {
+  if (e == NULL)
+    return;
+
+  free_devices(e->devices, e->n_devs);
+  free(e->username);
+  free(e);
+}
+
+static void flush_cache(pamu2f_ctx_t *ctx) {
+  struct entry *e, *next;
+
+  for (size_t i = 0; i < ctx->n_buckets; i++) {
+    for (e = ctx->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free_entry(e);
+    }
+    ctx->buckets[i] = NULL;
+  }
+  ctx->n_entries = 0;
+  ctx->lru_head = ctx->lru_tail = NULL;
+  ctx->have_st = 0;
+}
+
+static time_t now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+
+  return ts.tv_sec;
+}
+
+static void lru_unlink(pamu2f_ctx_t *ctx, struct entry *e) {
+  if (e->lru_prev != NULL)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    ctx->lru_head = e->lru_next;
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    ctx->lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(pamu2f_ctx_t *ctx, struct entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = ctx->lru_head;
+  if (ctx->lru_head != NULL)
+    ctx->lru_head->lru_prev = e;
+  else
+    ctx->lru_tail = e;
+  ctx->lru_head = e;
+}
+
+static void remove_entry(pamu2f_ctx_t *ctx, struct entry *e) {
+  struct entry **p = &ctx->buckets[e->hash & (ctx->n_buckets - 1)];
+
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+
+  lru_unlink(ctx, e);
+  free_entry(e);
+  ctx->n_entries--;
+}
+
+/* Make room for an entry, evicting the least recently used unpinned ones. */
+static void evict(pamu2f_ctx_t *ctx) {
+  struct entry *e = ctx->lru_tail, *prev;
+
+  while (ctx->n_entries >= CACHE_MAX_ENTRIES && e != NULL) {
+    prev = e->lru_prev;
+    if (e->pins == 0)
+      remove_entry(ctx, e);
+    e = prev;
+  }
+}
+
+/* Drop the cached credentials if the authfile was modified or replaced. */
+static void refresh_cache(pamu2f_ctx_t *ctx) {
+  struct stat st;
+
+  if (!ctx->have_st)
+    return;
+
+  if (stat(ctx->auth_file, &st) != 0 || !file_unchanged(&ctx->st, &st))
+    flush_cache(ctx);
+}
+
+static int grow_cache(pamu2f_ctx_t *ctx) {
+  struct entry **buckets, *e, *next;
+  size_t n = ctx->n_buckets * 2;
+
+  if ((buckets = calloc(n, sizeof(*buckets))) == NULL)
+    return 0;
+
+  for (size_t i = 0; i < ctx->n_buckets; i++) {
+    for (e = ctx->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+
+  free(ctx->buckets);
+  ctx->buckets = buckets;
+  ctx->n_buckets = n;
+
+  return 1;
+}
+
+static int load_entry(pamu2f_ctx_t *ctx, struct entry *e) {
+  struct stat st;
+  int r;
+
+  if ((e->devices = calloc(ctx->cfg.max_devs, sizeof(*e->devices))) == NULL)
+    return PAMU2F_ERR_INTERNAL;
+
+  r = get_devices_from_authfile_st(&ctx->cfg, e->username, e->devices,
+                                   &e->n_devs, &st, NULL);
+  switch (r) {
+    case PAM_SUCCESS:
+      break;
+    case PAM_USER_UNKNOWN:
+    case PAM_AUTH_ERR:
+      return PAMU2F_ERR_NOUSER;
+    default:
+      return PAMU2F_ERR_AUTHFILE;
+  }
+
+  /*
+   * A later version of the authfile than the cached one is flushed by the
+   * next refresh_cache(), since it compares against the older status.
+   */
+  if (!ctx->have_st) {
+    ctx->st = st;
+    ctx->have_st = 1;
+  }
+
+  return PAMU2F_OK;
+}
+
+static struct entry *lookup(pamu2f_ctx_t *ctx, const char *username,
+                            int *status) {
+  struct entry *e;
+  uint32_t hash = expand_hash(username);
+  size_t b = hash & (ctx->n_buckets - 1);
+
+  for (e = ctx->buckets[b]; e != NULL; e = e->next) {
+    if (e->hash == hash && strcmp(e->username, username) == 0)
+      break;
+  }
+
+  if (e != NULL && e->expires != 0 && e->pins == 0 && now() >= e->expires) {
+    remove_entry(ctx, e);
+    e = NULL;
+  }
+
+  if (e != NULL) {
+    lru_unlink(ctx, e);
+    lru_push(ctx, e);
+    *status = e->status;
+    return e;
+  }
+
+  if ((e = calloc(1, sizeof(*e))) == NULL ||
+      (e->username = strdup(username)) == NULL) {
+    free(e);
+    *status = PAMU2F_ERR_INTERNAL;
+    return NULL;
+  }
+  e->hash = hash;
+  e->status = load_entry(ctx, e);
+
+  /* Transient failures are retried on the next lookup. */
+  if (e->status != PAMU2F_OK && e->status != PAMU2F_ERR_NOUSER) {
+    *status = e->status;
+    free_entry(e);
+    return NULL;
+  }
+
+  if (e->status == PAMU2F_ERR_NOUSER)
+    e->expires = now() + CACHE_NOUSER_TTL;
+
+  evict(ctx);
+  if (ctx->n_entries >= ctx->n_buckets && grow_cache(ctx))
+    b = hash & (ctx->n_buckets - 1);
+  e->next = ctx->buckets[b];
+  ctx->buckets[b] = e;
+  lru_push(ctx, e);
+  ctx->n_entries++;
+
+  *status = e->status;
+
+  return e;
+}
+
+static void verify_one(const pamu2f_ctx_t *ctx, pamu2f_assertion_t *a,
+                       const struct entry *e) {
+  for (unsigned i = 0; i < e->n_devs; i++) {
+    if (verify_assertion(&ctx->cfg, &e->devices[i], a->cdh, a->cdh_len,
+                         a->authdata, a->authdata_len, a->sig, a->sig_len)) {
+      a->result = PAMU2F_OK;
+      a->credential = i;
+      return;
+    }
+  }
+
+  a->result = PAMU2F_ERR_VERIFY;
+}
+
+/* Take assertions off the current batch until none is left; lock held. */
+static void drain(pamu2f_ctx_t *ctx) {
+  size_t i;
+
+  while (ctx->next < ctx->batch_len) {
+    i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (ctx->batch_entries[i] != NULL)
+      verify_one(ctx, &ctx->batch[i], ctx->batch_entries[i]);
+    pthread_mutex_lock(&ctx->lock);
+    if (--ctx->pending == 0)
+      pthread_cond_signal(&ctx->done);
+  }
+}
+
+static void *worker(void *arg) {
+  pamu2f_ctx_t *ctx = arg;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (;;) {
+    while (!ctx->stop && ctx->next >= ctx->batch_len)
+      pthread_cond_wait(&ctx->work, &ctx->lock);
+    if (ctx->stop)
+      break;
+    drain(ctx);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return NULL;
+}
+
+static void stop_workers(pamu2f_ctx_t *ctx) {
+  pthread_mutex_lock(&ctx->lock);
+  ctx->stop = 1;
+  pthread_cond_broadcast(&ctx->work);
+  pthread_mutex_unlock(&ctx->lock);
+
+  for (unsigned i = 0; i < ctx->n_workers; i++)
+    pthread_join(ctx->workers[i], NULL);
+
+  free(ctx->workers);
+  ctx->workers = NULL;
+  ctx->n_workers = 0;
+  ctx->stop = 0;
+}
+
+pamu2f_ctx_t *pamu2f_new(const char *authfile, const char *origin,
+                         const char *appid) {
+  pamu2f_ctx_t *ctx;
+
+  if (authfile == NULL || origin == NULL)
+    return NULL;
+
+  if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+    return NULL;
+
+  if ((ctx->auth_file = strdup(authfile)) == NULL ||
+      (ctx->origin = strdup(origin)) == NULL ||
+      (ctx->appid = strdup(appid ? appid : origin)) == NULL ||
+      (ctx->buckets = calloc(CACHE_MIN_BUCKETS, sizeof(*ctx->buckets))) ==
+        NULL) {
+    free(ctx->auth_file);
+    free(ctx->origin);
+    free(ctx->appid);
+    free(ctx);
+    return NULL;
+  }
+  ctx->n_buckets = CACHE_MIN_BUCKETS;
+
+  ctx->cfg.max_devs = MAX_DEVS;
+  ctx->cfg.userpresence = -1;
+  ctx->cfg.userverification = -1;
+  ctx->cfg.pinverification = -1;
+  ctx->cfg.event_fd = -1;
+  ctx->cfg.auth_file = ctx->auth_file;
+  ctx->cfg.origin = ctx->origin;
+  ctx->cfg.appid = ctx->appid;
+
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->work, NULL);
+  pthread_cond_init(&ctx->done, NULL);
+
+  fido_init(0);
+
+  return ctx;
+}
+
+void pamu2f_free(pamu2f_ctx_t **ctx_p) {
+  pamu2f_ctx_t *ctx;
+
+  if (ctx_p == NULL || (ctx = *ctx_p) == NULL)
+    return;
+
+  stop_workers(ctx);
+  flush_cache(ctx);
+  pthread_cond_destroy(&ctx->done);
+  pthread_cond_destroy(&ctx->work);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->buckets);
+  free(ctx->auth_file);
+  free(ctx->origin);
+  free(ctx->appid);
+  free(ctx);
+  *ctx_p = NULL;
+}
+
+int pamu2f_set_workers(pamu2f_ctx_t *ctx, unsigned n) {
+  if (ctx == NULL || n > MAX_WORKERS)
+    return PAMU2F_ERR_INVALID;
+
+  stop_workers(ctx);
+  if (n == 0)
+    return PAMU2F_OK;
+
+  if ((ctx->workers = calloc(n, sizeof(*ctx->workers))) == NULL)
+    return PAMU2F_ERR_INTERNAL;
+
+  for (; ctx->n_workers < n; ctx->n_workers++) {
+    if (pthread_create(&ctx->workers[ctx->n_workers], NULL, worker, ctx) !=
+        0) {
+      stop_workers(ctx);
+      return PAMU2F_ERR_INTERNAL;
+    }
+  }
+
+  return PAMU2F_OK;
+}
+
+int pamu2f_load(pamu2f_ctx_t *ctx, const char *username, size_t *n) {
+  struct entry *e;
+  int status;
+
+  if (ctx == NULL || username == NULL || n == NULL)
+    return PAMU2F_ERR_INVALID;
+
+  *n = 0;
+  refresh_cache(ctx);
+  if ((e = lookup(ctx, username, &status)) != NULL)
+    *n = e->n_devs;
+
+  return status;
+}
+
+int pamu2f_credential(pamu2f_ctx_t *ctx, const char *username, size_t idx,
+                      const char **key_handle, const char **rp_id) {
+  struct entry *e;
+  int status;
+
+  if (ctx == NULL || username == NULL)
+    return PAMU2F_ERR_INVALID;
+
+  if ((e = lookup(ctx, username, &status)) == NULL || status != PAMU2F_OK)
+    return status;
+
+  if (idx >= e->n_devs)
+    return PAMU2F_ERR_INVALID;
+
+  if (key_handle != NULL)
+    *key_handle = e->devices[idx].keyHandle;
+  if (rp_id != NULL)
+    *rp_id = credential_rp(&ctx->cfg, &e->devices[idx]);
+
+  return PAMU2F_OK;
+}
+
+int pamu2f_verify_batch(pamu2f_ctx_t *ctx, pamu2f_assertion_t *batch,
+                        size_t n) {
+  pamu2f_assertion_t *a;
+  struct entry **entries;
+
+  if (ctx == NULL || (batch == NULL && n > 0))
+    return PAMU2F_ERR_INVALID;
+
+  if (n == 0)
+    return PAMU2F_OK;
+
+  if ((entries = calloc(n, sizeof(*entries))) == NULL)
+    return PAMU2F_ERR_INTERNAL;
+
+  /* Resolve every user first, so that workers only read the cache. */
+  refresh_cache(ctx);
+  for (size_t i = 0; i < n; i++) {
+    a = &batch[i];
+    a->credential = 0;
+    if (a->username == NULL || a->cdh == NULL || a->authdata == NULL ||
+        a->sig == NULL) {
+      a->result = PAMU2F_ERR_INVALID;
+      continue;
+    }
+    entries[i] = lookup(ctx, a->username, &a->result);
+    if (a->result != PAMU2F_OK)
+      entries[i] = NULL;
+    else
+      entries[i]->pins++; /* not evicted by the next lookups */
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->batch = batch;
+  ctx->batch_entries = entries;
+  ctx->batch_len = n;
+  ctx->next = 0;
+  ctx->pending = n;
+  pthread_cond_broadcast(&ctx->work);
+  drain(ctx);
+  while (ctx->pending > 0)
+    pthread_cond_wait(&ctx->done, &ctx->lock);
+  ctx->batch = NULL;
+  ctx->batch_entries = NULL;
+  ctx->batch_len = 0;
+  ctx->next = 0;
+  pthread_mutex_unlock(&ctx->lock);
+
+  for (size_t i = 0; i < n; i++)
+    if (entries[i] != NULL)
+      entries[i]->pins--;
+  free(entries);
+
+  return PAMU2F_OK;
+}
+
+const char *pamu2f_strerror(int err) {
+  switch (err) {
+    case PAMU2F_OK:
+      return "success";
+    case PAMU2F_ERR_INVALID:
+      return "invalid argument";
+    case PAMU2F_ERR_INTERNAL:
+      return "internal error";
+    case PAMU2F_ERR_AUTHFILE:
+      return "authfile unavailable";
+    case PAMU2F_ERR_NOUSER:
+      return "no credentials for user";
+    case PAMU2F_ERR_VERIFY:
+      return "assertion does not verify";
+    default:
+      return "unknown error";
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef PAMU2F_H
+#define PAMU2F_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libpamu2f verifies assertions against the credentials of a native pam_u2f
+ * authfile, outside of PAM. Assertions are the ones printed by fido2-assert
+ * in manual mode: a client data hash, CBOR-encoded authenticator data and a
+ * signature. A context is meant to be used from a single thread; it runs its
+ * own workers during pamu2f_verify_batch().
+ */
+
+#define PAMU2F_OK 0
+#define PAMU2F_ERR_INVALID -1  /* invalid argument */
+#define PAMU2F_ERR_INTERNAL -2 /* memory allocation or system error */
+#define PAMU2F_ERR_AUTHFILE -3 /* authfile unreadable or malformed */
+#define PAMU2F_ERR_NOUSER -4   /* no credentials for the user */
+#define PAMU2F_ERR_VERIFY -5   /* no credential verifies the assertion */
+
+typedef struct pamu2f_ctx pamu2f_ctx_t;
+
+typedef struct {
+  /* input */
+  const char *username;
+  const unsigned char *cdh;
+  size_t cdh_len;
+  const unsigned char *authdata;
+  size_t authdata_len;
+  const unsigned char *sig;
+  size_t sig_len;
+  /* output */
+  int result;        /* PAMU2F_OK or a PAMU2F_ERR_* code */
+  size_t credential; /* index of the verifying credential */
+} pamu2f_assertion_t;
+
+/*
+ * Create a context for an authfile. The origin and appid have the meaning of
+ * the module options of the same name; a NULL appid defaults to the origin.
+ */
+pamu2f_ctx_t *pamu2f_new(const char *authfile, const char *origin,
+                         const char *appid);
+void pamu2f_free(pamu2f_ctx_t **ctx);
+
+/* Number of worker threads verifying batches, 0 verifying inline. */
+int pamu2f_set_workers(pamu2f_ctx_t *ctx, unsigned n);
+
+/*
+ * Load the credentials of a user, if not already cached, and return their
+ * number. Parsed credentials are kept until the authfile changes, or until
+ * the user is evicted by lookups of many others.
+ */
+int pamu2f_load(pamu2f_ctx_t *ctx, const char *username, size_t *n);
+
+/*
+ * Key handle and relying party ID of a loaded credential, valid until the
+ * next call on the context.
+ */
+int pamu2f_credential(pamu2f_ctx_t *ctx, const char *username, size_t idx,
+                      const char **key_handle, const char **rp_id);
+
+/*
+ * Verify a batch of assertions, setting the result of each. Returns
+ * PAMU2F_OK if the batch was processed, whatever the individual results.
+ */
+int pamu2f_verify_batch(pamu2f_ctx_t *ctx, pamu2f_assertion_t *batch,
+                        size_t n);
+
+const char *pamu2f_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PAMU2F_H */
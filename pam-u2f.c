@@ -10,8 +10,10 @@
 #include <security/pam_modules.h>
 
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -22,6 +24,8 @@
 
 #include "debug.h"
 #include "drop_privs.h"
+#include "event.h"
+#include "keyring.h"
 #include "util.h"
 
 #define free_const(a) free((void *) (uintptr_t) (a))
@@ -35,15 +39,6 @@ char *secure_getenv(const char *name) {
 }
 #endif
 
-static void interactive_prompt(pam_handle_t *pamh, const cfg_t *cfg) {
-  char *tmp = NULL;
-
-  tmp = converse(pamh, PAM_PROMPT_ECHO_ON,
-                 cfg->prompt != NULL ? cfg->prompt : DEFAULT_PROMPT);
-
-  free(tmp);
-}
-
 static char *resolve_authfile_path(const cfg_t *cfg, const struct passwd *user,
                                    int *openasuser) {
   char *authfile = NULL;
@@ -64,9 +59,9 @@ static char *resolve_authfile_path(const cfg_t *cfg, const struct passwd *user,
       *openasuser = 0; /* documented exception, require explicit openasuser */
       path = cfg->sshformat ? DEFAULT_AUTHFILE_SSH : DEFAULT_AUTHFILE;
       if (!cfg->openasuser) {
-        debug_dbg(cfg, "WARNING: not dropping privileges when reading the "
-                       "authentication file, please consider setting "
-                       "openasuser=1 in the module configuration");
+        debug_warn(cfg, "WARNING: not dropping privileges when reading the "
+                        "authentication file, please consider setting "
+                        "openasuser=1 in the module configuration");
       }
     }
   } else {
@@ -81,6 +76,223 @@ static char *resolve_authfile_path(const cfg_t *cfg, const struct passwd *user,
   return authfile;
 }
 
+/*
+ * Record the user's authfile line, converted to the current format, in the
+ * migration sidecar. The line is only appended when it differs from the last
+ * one recorded for the user, so the sidecar does not grow with every login.
+ */
+static void write_migration_sidecar(const cfg_t *cfg, const char *user,
+                                    const char *line) {
+  FILE *fp = NULL;
+  char *buf = NULL;
+  size_t bufsiz = 0;
+  size_t user_len = strlen(user);
+  ssize_t len;
+  int current = 0;
+  int fd;
+
+  if (*cfg->migrate_sidecar != '/') {
+    debug_warn(cfg, "Migration sidecar path must be absolute");
+    return;
+  }
+
+  fd = open(cfg->migrate_sidecar,
+            O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY,
+            0600);
+  if (fd < 0) {
+    debug_warn(cfg, "Unable to open migration sidecar: %s", strerror(errno));
+    return;
+  }
+
+  if ((fp = fdopen(fd, "a+")) == NULL) {
+    debug_err(cfg, "fdopen: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+
+  /* concurrent logins check and append in turn */
+  if (flock(fd, LOCK_EX) != 0) {
+    debug_warn(cfg, "Unable to lock migration sidecar: %s", strerror(errno));
+    goto out;
+  }
+
+  while ((len = getline(&buf, &bufsiz, fp)) != -1) {
+    if (len > 0 && buf[len - 1] == '\n')
+      buf[len - 1] = '\0';
+    if (strncmp(buf, user, user_len) == 0 && buf[user_len] == ':')
+      current = strcmp(buf, line) == 0;
+  }
+
+  if (ferror(fp)) {
+    debug_warn(cfg, "Unable to read migration sidecar");
+    goto out;
+  }
+
+  if (current) {
+    debug_dbg(cfg, "Converted credentials already in %s",
+              cfg->migrate_sidecar);
+    goto out;
+  }
+
+  if (fprintf(fp, "%s\n", line) < 0 || fflush(fp) != 0) {
+    debug_warn(cfg, "Unable to write migration sidecar");
+    goto out;
+  }
+
+  debug_dbg(cfg, "Converted credentials written to %s", cfg->migrate_sidecar);
+
+out:
+  fclose(fp);
+  free(buf);
+}
+
+/*
+ * Applications such as sshd, sudo and login retry pam_authenticate() on the
+ * same handle. The user's passwd entry and the credentials read from the
+ * authfile are kept on the handle, so that retries skip the lookups and the
+ * authfile parsing. The credentials are reused for as long as the authfile
+ * keeps its identity, as recorded when they were read.
+ */
+#define STATE_KEY "pam_u2f_state"
+
+struct state {
+  char *user;
+  char *home;
+  uid_t uid;
+  gid_t gid;
+  char *auth_file;
+  int sshformat;
+  unsigned max_devs;
+  struct stat st;
+  device_t *devices;
+  unsigned n_devices;
+  char *migrated; /* for the migration sidecar */
+};
+
+static void wipe_string(char *s) {
+  if (s != NULL)
+    explicit_bzero(s, strlen(s));
+}
+
+static void state_cleanup(pam_handle_t *pamh, void *data, int error_status) {
+  struct state *state = data;
+
+  (void) pamh;
+  (void) error_status;
+
+  if (state == NULL)
+    return;
+
+  for (unsigned i = 0; i < state->n_devices; i++) {
+    wipe_string(state->devices[i].keyHandle);
+    wipe_string(state->devices[i].publicKey);
+  }
+  free_devices(state->devices, state->n_devices);
+  free(state->migrated);
+  wipe_string(state->auth_file);
+  free(state->auth_file);
+  free(state->home);
+  free(state->user);
+  explicit_bzero(state, sizeof(*state));
+  free(state);
+}
+
+static struct state *state_get(pam_handle_t *pamh, const char *user) {
+  const void *data = NULL;
+  const struct state *state;
+
+  if (pam_get_data(pamh, STATE_KEY, &data) != PAM_SUCCESS || data == NULL)
+    return NULL;
+
+  state = data;
+  if (strcmp(state->user, user) != 0)
+    return NULL;
+
+  return (struct state *) (uintptr_t) state;
+}
+
+/* Whether the authfile still has the identity it had when it was read. */
+static int authfile_unchanged(const cfg_t *cfg, const struct stat *prev) {
+  struct stat st;
+
+  if (stat(cfg->auth_file, &st) != 0) {
+    debug_err(cfg, "Cannot stat authentication file: %s", strerror(errno));
+    return 0;
+  }
+
+  /* ctime changes with the owner and mode, which were checked on load */
+  return file_unchanged(prev, &st);
+}
+
+static int state_matches(const cfg_t *cfg, const struct state *state) {
+  if (state == NULL || state->devices == NULL ||
+      strcmp(state->auth_file, cfg->auth_file) != 0 ||
+      state->sshformat != cfg->sshformat || state->max_devs != cfg->max_devs)
+    return 0;
+
+  return authfile_unchanged(cfg, &state->st);
+}
+
+/* On success the state owns devices. */
+static int state_store(pam_handle_t *pamh, const cfg_t *cfg,
+                       const struct passwd *pw, const struct stat *st,
+                       device_t *devices, unsigned n_devices,
+                       const char *migrated) {
+  struct state *state;
+
+  if ((state = calloc(1, sizeof(*state))) == NULL ||
+      (state->user = strdup(pw->pw_name)) == NULL ||
+      (state->home = strdup(pw->pw_dir)) == NULL ||
+      (state->auth_file = strdup(cfg->auth_file)) == NULL ||
+      (migrated != NULL && (state->migrated = strdup(migrated)) == NULL)) {
+    debug_err(cfg, "Unable to allocate memory");
+    state_cleanup(pamh, state, 0);
+    return 0;
+  }
+
+  state->uid = pw->pw_uid;
+  state->gid = pw->pw_gid;
+  state->sshformat = cfg->sshformat;
+  state->max_devs = cfg->max_devs;
+  state->st = *st;
+  state->devices = devices;
+  state->n_devices = n_devices;
+
+  if (pam_set_data(pamh, STATE_KEY, state, state_cleanup) != PAM_SUCCESS) {
+    debug_warn(cfg, "Unable to store state");
+    state->devices = NULL;
+    state->n_devices = 0;
+    state_cleanup(pamh, state, 0);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * With nodevice set, give up before the user and their credentials are looked
+ * up if no authenticator is attached. Interactive mode is exempt, the prompt
+ * asking for one to be inserted. Returns 1 and sets retval to bail out.
+ */
+static int nodevice_bailout(const cfg_t *cfg, int *retval) {
+  size_t n;
+
+  if (!cfg->nodevice || cfg->manual || cfg->interactive)
+    return 0;
+#ifdef WITH_CTAP_TRACE
+  if (cfg->ctap_record || cfg->ctap_replay)
+    return 0;
+#endif
+
+  if (!count_authenticators(cfg, &n) || n > 0)
+    return 0;
+
+  debug_info(cfg, "No authenticator attached, returning %d", cfg->nodevice);
+  *retval = cfg->nodevice;
+
+  return 1;
+}
+
 /* PAM entry point for authentication verification */
 int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
                         const char **argv) {
@@ -91,6 +303,7 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
   cfg_t cfg_st;
   cfg_t *cfg = &cfg_st;
   char buffer[BUFSIZE];
+  char auth_file[PATH_MAX];
   int pgu_ret, gpn_ret;
   int retval = PAM_ABORT;
   device_t *devices = NULL;
@@ -100,19 +313,32 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
   int should_free_appid = 0;
   int should_free_auth_file = 0;
   int should_free_authpending_file = 0;
+  int should_free_devices = 1;
+  int use_keyring = 0;
+  int from_keyring = 0;
+  struct state *state = NULL;
+  struct stat st;
+  char *migrated = NULL;
+  const char *legacy_line = NULL;
 
   retval = cfg_init(cfg, flags, argc, argv);
   if (retval != PAM_SUCCESS)
     goto done;
 
+  event_open(cfg);
+  event_emit(cfg, EVENT_AUTH_START, 0, NULL);
+
   PAM_MODUTIL_DEF_PRIVS(privs);
 
+  if (nodevice_bailout(cfg, &retval))
+    goto done;
+
   if (!cfg->origin) {
     if (!cfg->sshformat) {
       strcpy(buffer, DEFAULT_ORIGIN_PREFIX);
       if (gethostname(buffer + strlen(DEFAULT_ORIGIN_PREFIX),
                       BUFSIZE - strlen(DEFAULT_ORIGIN_PREFIX)) == -1) {
-        debug_dbg(cfg, "Unable to get host name");
+        debug_err(cfg, "Unable to get host name");
         retval = PAM_SYSTEM_ERR;
         goto done;
       }
@@ -122,7 +348,7 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
     debug_dbg(cfg, "Origin not specified, using \"%s\"", buffer);
     cfg->origin = strdup(buffer);
     if (!cfg->origin) {
-      debug_dbg(cfg, "Unable to allocate memory");
+      debug_err(cfg, "Unable to allocate memory");
       retval = PAM_BUF_ERR;
       goto done;
     } else {
@@ -135,7 +361,7 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
               cfg->origin);
     cfg->appid = strdup(cfg->origin);
     if (!cfg->appid) {
-      debug_dbg(cfg, "Unable to allocate memory");
+      debug_err(cfg, "Unable to allocate memory");
       retval = PAM_BUF_ERR;
       goto done;
     } else {
@@ -155,27 +381,37 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 
   devices = calloc(cfg->max_devs, sizeof(device_t));
   if (!devices) {
-    debug_dbg(cfg, "Unable to allocate memory");
+    debug_err(cfg, "Unable to allocate memory");
     retval = PAM_BUF_ERR;
     goto done;
   }
 
   pgu_ret = pam_get_user(pamh, &user, NULL);
   if (pgu_ret != PAM_SUCCESS || user == NULL) {
-    debug_dbg(cfg, "Unable to get username from PAM");
+    debug_err(cfg, "Unable to get username from PAM");
     retval = PAM_CONV_ERR;
     goto done;
   }
 
-  debug_dbg(cfg, "Requesting authentication for user %s", user);
+  debug_info(cfg, "Requesting authentication for user %s", user);
 
-  gpn_ret = getpwnam_r(user, &pw_s, buffer, sizeof(buffer), &pw);
-  if (gpn_ret != 0 || pw == NULL || pw->pw_dir == NULL ||
-      pw->pw_dir[0] != '/') {
-    debug_dbg(cfg, "Unable to retrieve credentials for user %s, (%s)", user,
-              strerror(errno));
-    retval = PAM_SYSTEM_ERR;
-    goto done;
+  if ((state = state_get(pamh, user)) != NULL) {
+    debug_dbg(cfg, "Reusing passwd entry from a previous attempt");
+    memset(&pw_s, 0, sizeof(pw_s));
+    pw_s.pw_name = state->user;
+    pw_s.pw_dir = state->home;
+    pw_s.pw_uid = state->uid;
+    pw_s.pw_gid = state->gid;
+    pw = &pw_s;
+  } else {
+    gpn_ret = getpwnam_r(user, &pw_s, buffer, sizeof(buffer), &pw);
+    if (gpn_ret != 0 || pw == NULL || pw->pw_dir == NULL ||
+        pw->pw_dir[0] != '/') {
+      debug_err(cfg, "Unable to retrieve credentials for user %s, (%s)", user,
+                strerror(errno));
+      retval = PAM_SYSTEM_ERR;
+      goto done;
+    }
   }
 
   debug_dbg(cfg, "Found user %s", user);
@@ -183,18 +419,25 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 
   // Perform variable expansion.
   if (cfg->expand && cfg->auth_file) {
-    if ((cfg->auth_file = expand_variables(cfg->auth_file, user)) == NULL) {
-      debug_dbg(cfg, "Failed to perform variable expansion");
+    const struct expand_user eu = {
+      .name = user,
+      .home = pw->pw_dir,
+      .uid = pw->pw_uid,
+      .has_uid = 1,
+    };
+    if (expand_render(&cfg->auth_file_tmpl, &eu, auth_file,
+                      sizeof(auth_file)) != 0) {
+      debug_err(cfg, "Failed to perform variable expansion");
       retval = PAM_BUF_ERR;
       goto done;
     }
-    should_free_auth_file = 1;
+    cfg->auth_file = auth_file;
   }
   // Resolve default or relative paths.
   if (!cfg->auth_file || cfg->auth_file[0] != '/') {
     char *tmp = resolve_authfile_path(cfg, pw, &openasuser);
     if (tmp == NULL) {
-      debug_dbg(cfg, "Could not resolve authfile path");
+      debug_err(cfg, "Could not resolve authfile path");
       retval = PAM_BUF_ERR;
       goto done;
     }
@@ -210,20 +453,59 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
   if (!openasuser) {
     openasuser = geteuid() == 0 && cfg->openasuser;
   }
+
+  /*
+   * The keyring is searched as root, its identity is checked as the user. It
+   * is not used while a migration sidecar is set, which needs the authfile
+   * line as read.
+   */
+  if (state == NULL && cfg->migrate_sidecar == NULL &&
+      (use_keyring = keyring_available(cfg)))
+    from_keyring = keyring_lookup(cfg, user, &st, devices, &n_devices);
+
   if (openasuser) {
     debug_dbg(cfg, "Dropping privileges");
     if (pam_modutil_drop_priv(pamh, &privs, pw)) {
-      debug_dbg(cfg, "Unable to switch user to uid %i", pw->pw_uid);
+      debug_err(cfg, "Unable to switch user to uid %i", pw->pw_uid);
       retval = PAM_SYSTEM_ERR;
       goto done;
     }
     debug_dbg(cfg, "Switched to uid %i", pw->pw_uid);
   }
-  retval = get_devices_from_authfile(cfg, user, devices, &n_devices);
+  if (state_matches(cfg, state)) {
+    debug_dbg(cfg, "Authentication file unchanged, reusing %u device(s)",
+              state->n_devices);
+    free(devices);
+    devices = state->devices;
+    n_devices = state->n_devices;
+    legacy_line = state->migrated;
+    should_free_devices = 0;
+    retval = PAM_SUCCESS;
+  } else {
+    if (from_keyring && authfile_unchanged(cfg, &st)) {
+      debug_dbg(cfg, "Authentication file unchanged, using the keyring");
+      retval = PAM_SUCCESS;
+    } else {
+      for (unsigned i = 0; i < n_devices; i++)
+        reset_device(&devices[i]);
+      from_keyring = 0;
+      retval = get_devices_from_authfile_st(
+        cfg, user, devices, &n_devices, &st,
+        cfg->migrate_sidecar != NULL ? &migrated : NULL);
+      legacy_line = migrated;
+    }
+    if (retval == PAM_SUCCESS) {
+      if (state_store(pamh, cfg, pw, &st, devices, n_devices, migrated))
+        should_free_devices = 0;
+    } else if (state != NULL) {
+      (void) pam_set_data(pamh, STATE_KEY, NULL, NULL);
+    }
+    state = NULL; /* replaced or dropped */
+  }
 
   if (openasuser) {
     if (pam_modutil_regain_priv(pamh, &privs)) {
-      debug_dbg(cfg, "could not restore privileges");
+      debug_err(cfg, "could not restore privileges");
       retval = PAM_SYSTEM_ERR;
       goto done;
     }
@@ -234,6 +516,9 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
     goto done;
   }
 
+  if (use_keyring && !from_keyring)
+    (void) keyring_store(cfg, user, &st, devices, n_devices);
+
   // Determine the full path for authpending_file in order to emit touch request
   // notifications
   if (!cfg->authpending_file) {
@@ -243,8 +528,8 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
       cfg->authpending_file = strdup(buffer);
     }
     if (!cfg->authpending_file) {
-      debug_dbg(cfg, "Unable to allocate memory for the authpending_file, "
-                     "touch request notifications will not be emitted");
+      debug_warn(cfg, "Unable to allocate memory for the authpending_file, "
+                      "touch request notifications will not be emitted");
     } else {
       should_free_authpending_file = 1;
     }
@@ -267,30 +552,42 @@ int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
       open(cfg->authpending_file,
            O_RDONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY, 0664);
     if (authpending_file_descriptor < 0) {
-      debug_dbg(cfg, "Unable to emit 'authentication started' notification: %s",
-                strerror(errno));
+      debug_warn(cfg,
+                 "Unable to emit 'authentication started' notification: %s",
+                 strerror(errno));
     }
   }
 
   if (cfg->manual == 0) {
-    if (cfg->interactive) {
-      interactive_prompt(pamh, cfg);
-    }
-    retval = do_authentication(cfg, devices, n_devices, pamh);
+    if (cfg->interactive)
+      retval = do_interactive_authentication(cfg, devices, n_devices, pamh);
+    else
+      retval = do_authentication(cfg, devices, n_devices, pamh);
+#ifndef NO_MANUAL
+  } else if (cfg->manual_select) {
+    retval = do_manual_select_authentication(cfg, devices, n_devices, pamh);
   } else {
     retval = do_manual_authentication(cfg, devices, n_devices, pamh);
+#endif
+  }
+
+  if (retval == PAM_SUCCESS && legacy_line != NULL) {
+    write_migration_sidecar(cfg, user, legacy_line);
   }
 
   // Close the authpending_file to indicate that we stop waiting for a touch
   if (authpending_file_descriptor >= 0) {
     if (close(authpending_file_descriptor) < 0) {
-      debug_dbg(cfg, "Unable to emit 'authentication stopped' notification: %s",
-                strerror(errno));
+      debug_warn(cfg,
+                 "Unable to emit 'authentication stopped' notification: %s",
+                 strerror(errno));
     }
   }
 
 done:
-  free_devices(devices, n_devices);
+  if (should_free_devices)
+    free_devices(devices, n_devices);
+  free(migrated);
 
   if (should_free_origin) {
     free_const(cfg->origin);
@@ -313,11 +610,15 @@ done:
   }
 
   if (cfg->alwaysok && retval != PAM_SUCCESS) {
-    debug_dbg(cfg, "alwaysok needed (otherwise return with %d)", retval);
+    debug_warn(cfg, "alwaysok needed (otherwise return with %d)", retval);
     retval = PAM_SUCCESS;
   }
-  debug_dbg(cfg, "done. [%s]", pam_strerror(pamh, retval));
+  debug_info(cfg, "done. [%s]", pam_strerror(pamh, retval));
 
+  event_emit(cfg,
+             retval == PAM_SUCCESS ? EVENT_AUTH_SUCCESS : EVENT_AUTH_FAILURE,
+             0, NULL);
+  event_close(cfg);
   cfg_free(cfg);
   return retval;
 }
@@ -43,6 +43,7 @@ struct args {
   int no_user_presence;
   int pin_verification;
   int user_verification;
+  int store_rp_id;
   int debug;
   int verbose;
   int nouser;
@@ -254,6 +255,8 @@ static int print_authfile_line(const struct args *const args,
   const char *user = NULL;
   char *b64_kh = NULL;
   char *b64_pk = NULL;
+  char *b64_rp = NULL;
+  const char *rp_id;
   size_t kh_len;
   size_t pk_len;
   int ok = -1;
@@ -288,6 +291,17 @@ static int print_authfile_line(const struct args *const args,
     goto err;
   }
 
+  if (args->store_rp_id) {
+    if ((rp_id = fido_cred_rp_id(cred)) == NULL) {
+      fprintf(stderr, "error: fido_cred_rp_id returned NULL\n");
+      goto err;
+    }
+    if (!b64_encode(rp_id, strlen(rp_id), &b64_rp)) {
+      fprintf(stderr, "error: failed to encode relying party ID\n");
+      goto err;
+    }
+  }
+
   if (!args->nouser) {
     if ((user = fido_cred_user_name(cred)) == NULL) {
       fprintf(stderr, "error: fido_cred_user_name returned NULL\n");
@@ -301,12 +315,15 @@ static int print_authfile_line(const struct args *const args,
          !args->no_user_presence ? "+presence" : "",
          args->user_verification ? "+verification" : "",
          args->pin_verification ? "+pin" : "");
+  if (b64_rp)
+    printf(",%s", b64_rp);
 
   ok = 0;
 
 err:
   free(b64_kh);
   free(b64_pk);
+  free(b64_rp);
 
   return ok;
 }
@@ -365,6 +382,7 @@ static void parse_args(int argc, char *argv[], struct args *args) {
     { "no-user-presence",  no_argument,       NULL, 'P'         },
     { "pin-verification",  no_argument,       NULL, 'N'         },
     { "user-verification", no_argument,       NULL, 'V'         },
+    { "rp-id",             no_argument,       NULL, 'R'         },
     { "debug",             no_argument,       NULL, 'd'         },
     { "verbose",           no_argument,       NULL, 'v'         },
     { "username",          required_argument, NULL, 'u'         },
@@ -389,6 +407,9 @@ static void parse_args(int argc, char *argv[], struct args *args) {
 "                             user's presence\n"
 "  -N, --pin-verification   Require PIN verification during authentication\n"
 "  -V, --user-verification  Require user verification during authentication\n"
+"  -R, --rp-id              Record the relying party ID in the credential, so\n"
+"                             that it is used regardless of the origin pam_u2f\n"
+"                             is configured with\n"
 "  -d, --debug              Print debug information\n"
 "  -v, --verbose            Print information about chosen origin and appid\n"
 "  -u, --username=STRING    The name of the user registering the device,\n"
@@ -399,7 +420,7 @@ static void parse_args(int argc, char *argv[], struct args *args) {
 "Report bugs at <" PACKAGE_BUGREPORT ">.\n";
   /* clang-format on */
 
-  while ((c = getopt_long(argc, argv, "ho:i:t:rPNVdvu:n", options, NULL)) !=
+  while ((c = getopt_long(argc, argv, "ho:i:t:rPNVRdvu:n", options, NULL)) !=
          -1) {
     switch (c) {
       case 'h':
@@ -429,6 +450,9 @@ static void parse_args(int argc, char *argv[], struct args *args) {
       case 'V':
         args->user_verification = 1;
         break;
+      case 'R':
+        args->store_rp_id = 1;
+        break;
       case 'd':
         args->debug = 1;
         break;
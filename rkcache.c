@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "rkcache.h"
+
+/*
+ * The resident credential cache remembers on which authenticator each
+ * resident credential was last used, so that it can be tried first. Each
+ * line holds a credential ID, tagged with the format version, followed by
+ * the authenticator identity:
+ *
+ *   v<version>:<credential id, hex> <vendor>:<product>:<path>
+ *
+ * The cache only influences the order in which authenticators are tried,
+ * so stale or corrupt entries are harmless. Lines of other versions are
+ * ignored, and dropped when the cache is next written.
+ */
+
+#define CRED_TAG "v" RKCACHE_VERSION ":"
+#define CRED_TAG_LEN (sizeof(CRED_TAG) - 1)
+#define CRED_KEY_LEN 16 /* leading bytes of the credential ID */
+#define CRED_FIELD_LEN (CRED_TAG_LEN + 2 * CRED_KEY_LEN)
+
+static int cred_hex(const device_t *device, char out[CRED_FIELD_LEN + 1]) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char id[CRED_ID_LEN];
+  size_t i;
+
+  if (!credential_id(device, id))
+    return 0;
+
+  memcpy(out, CRED_TAG, CRED_TAG_LEN);
+  for (i = 0; i < CRED_KEY_LEN; i++) {
+    out[CRED_TAG_LEN + 2 * i] = hex[id[i] >> 4];
+    out[CRED_TAG_LEN + 2 * i + 1] = hex[id[i] & 0xf];
+  }
+  out[CRED_FIELD_LEN] = '\0';
+
+  return 1;
+}
+
+int rkcache_ident(const fido_dev_info_t *di, char *buf, size_t size) {
+  const char *path = fido_dev_info_path(di);
+  int n;
+
+  if (path == NULL)
+    return 0;
+
+  n = snprintf(buf, size, "%04x:%04x:%s", (unsigned) fido_dev_info_vendor(di),
+               (unsigned) fido_dev_info_product(di), path);
+
+  return n > 0 && (size_t) n < size && strpbrk(buf, " \n") == NULL;
+}
+
+static FILE *open_cache(const cfg_t *cfg) {
+  FILE *fp;
+  int fd;
+
+  if (*cfg->rk_cache != '/') {
+    debug_warn(cfg, "Resident credential cache path must be absolute");
+    return NULL;
+  }
+
+  fd = open(cfg->rk_cache, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      debug_warn(cfg, "Unable to open %s: %s", cfg->rk_cache, strerror(errno));
+    return NULL;
+  }
+
+  if ((fp = fdopen(fd, "r")) == NULL)
+    close(fd);
+
+  return fp;
+}
+
+/*
+ * Split a cache line of the current version into credential ID and
+ * identity, in place.
+ */
+static int split_line(char *line, char **ident) {
+  size_t len = strlen(line);
+
+  if (len > 0 && line[len - 1] == '\n')
+    line[--len] = '\0';
+
+  if (len <= CRED_FIELD_LEN + 1 || line[CRED_FIELD_LEN] != ' ' ||
+      strncmp(line, CRED_TAG, CRED_TAG_LEN) != 0)
+    return 0;
+
+  line[CRED_FIELD_LEN] = '\0';
+  *ident = line + CRED_FIELD_LEN + 1;
+
+  return 1;
+}
+
+int rkcache_lookup(const cfg_t *cfg, const device_t *device, char *ident,
+                   size_t size) {
+  char key[CRED_FIELD_LEN + 1];
+  char *buf = NULL, *value;
+  size_t bufsiz = 0;
+  unsigned n = 0;
+  int found = 0;
+  FILE *fp;
+
+  if (!cred_hex(device, key) || (fp = open_cache(cfg)) == NULL)
+    return 0;
+
+  /* The last entry for a credential wins. */
+  while (n++ < RKCACHE_MAX_ENTRIES && getline(&buf, &bufsiz, fp) != -1) {
+    if (split_line(buf, &value) && strcmp(buf, key) == 0 &&
+        strlen(value) < size) {
+      memcpy(ident, value, strlen(value) + 1);
+      found = 1;
+    }
+  }
+
+  free(buf);
+  fclose(fp);
+
+  if (found)
+    debug_dbg(cfg, "Resident credential last seen on %s", ident);
+
+  return found;
+}
+
+int rkcache_store(const cfg_t *cfg, const device_t *device, const char *ident) {
+  char key[CRED_FIELD_LEN + 1];
+  char tmp[PATH_MAX];
+  char *buf = NULL, *value;
+  size_t bufsiz = 0;
+  unsigned n = 0, skip = 0;
+  FILE *in = NULL, *out = NULL;
+  int fd = -1;
+  int ok = 0;
+
+  if (!cred_hex(device, key))
+    return 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cfg->rk_cache) >=
+      (int) sizeof(tmp)) {
+    debug_dbg(cfg, "Resident credential cache path too long");
+    return 0;
+  }
+
+  if ((fd = mkstemp(tmp)) == -1 || (out = fdopen(fd, "w")) == NULL) {
+    debug_warn(cfg, "Unable to create %s: %s", tmp, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    return 0;
+  }
+
+  /* Keep the most recent entries for other credentials. */
+  if ((in = open_cache(cfg)) != NULL) {
+    while (getline(&buf, &bufsiz, in) != -1) {
+      if (split_line(buf, &value) && strcmp(buf, key) != 0)
+        n++;
+    }
+    if (n > RKCACHE_MAX_ENTRIES - 1)
+      skip = n - (RKCACHE_MAX_ENTRIES - 1);
+    rewind(in);
+    while (getline(&buf, &bufsiz, in) != -1) {
+      if (!split_line(buf, &value) || strcmp(buf, key) == 0)
+        continue;
+      if (skip > 0) {
+        skip--;
+        continue;
+      }
+      fprintf(out, "%s %s\n", buf, value);
+    }
+  }
+
+  fprintf(out, "%s %s\n", key, ident);
+
+  if (fflush(out) != 0 || fsync(fileno(out)) != 0 ||
+      rename(tmp, cfg->rk_cache) != 0) {
+    debug_warn(cfg, "Unable to update %s: %s", cfg->rk_cache, strerror(errno));
+    unlink(tmp);
+    goto out;
+  }
+
+  debug_dbg(cfg, "Resident credential cache updated");
+  ok = 1;
+
+out:
+  free(buf);
+  if (in)
+    fclose(in);
+  fclose(out);
+
+  return ok;
+}
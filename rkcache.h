@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#ifndef RKCACHE_H
+#define RKCACHE_H
+
+#include <stddef.h>
+
+#include <fido.h>
+
+#include "cfg.h"
+#include "util.h"
+
+#define RKCACHE_VERSION "2"
+#define RKCACHE_IDENT_LEN 256
+#define RKCACHE_MAX_ENTRIES 1024
+
+int rkcache_ident(const fido_dev_info_t *di, char *buf, size_t size);
+int rkcache_lookup(const cfg_t *cfg, const device_t *device, char *ident,
+                   size_t size);
+int rkcache_store(const cfg_t *cfg, const device_t *device, const char *ident);
+
+#endif /* RKCACHE_H */
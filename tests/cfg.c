@@ -14,6 +14,7 @@
 #include <security/pam_appl.h>
 
 #include "cfg.h"
+#include "debug.h"
 
 static char *generate_template(void) {
   // Generate a conf= argument
@@ -108,16 +109,26 @@ static void config_flip_all(const struct conf_file *cf, const cfg_t *cfg) {
   config_different_bool(conf_out, "debug", cfg->debug);
   config_different_bool(conf_out, "expand", cfg->expand);
   config_different_bool(conf_out, "interactive", cfg->interactive);
+#ifndef NO_MANUAL
   config_different_bool(conf_out, "manual", cfg->manual);
+  config_different_bool(conf_out, "manual_select", cfg->manual_select);
+#endif
   config_different_bool(conf_out, "nodetect", cfg->nodetect);
   config_different_bool(conf_out, "nouserok", cfg->nouserok);
   config_different_bool(conf_out, "openasuser", cfg->openasuser);
+#ifndef NO_SSHFORMAT
   config_different_bool(conf_out, "sshformat", cfg->sshformat);
+#endif
 
   config_different_str(conf_out, "appid", cfg->appid);
   config_different_str(conf_out, "authfile", cfg->auth_file);
   config_different_str(conf_out, "authpending_file", cfg->authpending_file);
   config_different_str(conf_out, "cue_prompt", cfg->cue_prompt);
+  config_different_str(conf_out, "migrate_sidecar", cfg->migrate_sidecar);
+  config_different_str(conf_out, "event_socket", cfg->event_socket);
+  config_different_str(conf_out, "sigcount_file", cfg->sigcount_file);
+  config_different_str(conf_out, "rk_cache", cfg->rk_cache);
+  config_different_str(conf_out, "usage_file", cfg->usage_file);
   config_different_str(conf_out, "origin", cfg->origin);
   config_different_str(conf_out, "prompt", cfg->prompt);
 
@@ -127,6 +138,9 @@ static void config_flip_all(const struct conf_file *cf, const cfg_t *cfg) {
                              cfg->userverification);
 
   fprintf(conf_out, "max_devices=%d\n", cfg->max_devs + 1);
+  fprintf(conf_out, "nodevice=%s\n", cfg->nodevice ? "" : "ignore");
+  fprintf(conf_out, "keyring_cache=%d\n", cfg->keyring_cache + 60);
+  fprintf(conf_out, "device_lock=%d\n", cfg->device_lock + 30);
 
   if (cfg->debug_file)
     fprintf(conf_out, "debug_file=syslog\n");
@@ -174,7 +188,10 @@ static void test_regular(void) {
 
   // 4. Assert that every field is different from the default.
   assert(cfg.max_devs != cfg_defaults.max_devs);
+#ifndef NO_MANUAL
   assert(cfg.manual != cfg_defaults.manual);
+  assert(cfg.manual_select != cfg_defaults.manual_select);
+#endif
   assert(cfg.debug != cfg_defaults.debug);
   assert(cfg.nouserok != cfg_defaults.nouserok);
   assert(cfg.openasuser != cfg_defaults.openasuser);
@@ -182,11 +199,16 @@ static void test_regular(void) {
   assert(cfg.interactive != cfg_defaults.interactive);
   assert(cfg.cue != cfg_defaults.cue);
   assert(cfg.nodetect != cfg_defaults.nodetect);
+  assert(cfg.nodevice != cfg_defaults.nodevice);
   assert(cfg.userpresence != cfg_defaults.userpresence);
   assert(cfg.userverification != cfg_defaults.userverification);
   assert(cfg.pinverification != cfg_defaults.pinverification);
+#ifndef NO_SSHFORMAT
   assert(cfg.sshformat != cfg_defaults.sshformat);
+#endif
   assert(cfg.expand != cfg_defaults.expand);
+  assert(cfg.keyring_cache != cfg_defaults.keyring_cache);
+  assert(cfg.device_lock != cfg_defaults.device_lock);
 
   assert(str_opt_cmp(cfg.auth_file, cfg_defaults.auth_file));
   assert(str_opt_cmp(cfg.authpending_file, cfg_defaults.authpending_file));
@@ -194,6 +216,11 @@ static void test_regular(void) {
   assert(str_opt_cmp(cfg.appid, cfg_defaults.appid));
   assert(str_opt_cmp(cfg.prompt, cfg_defaults.prompt));
   assert(str_opt_cmp(cfg.cue_prompt, cfg_defaults.cue_prompt));
+  assert(str_opt_cmp(cfg.migrate_sidecar, cfg_defaults.migrate_sidecar));
+  assert(str_opt_cmp(cfg.event_socket, cfg_defaults.event_socket));
+  assert(str_opt_cmp(cfg.sigcount_file, cfg_defaults.sigcount_file));
+  assert(str_opt_cmp(cfg.rk_cache, cfg_defaults.rk_cache));
+  assert(str_opt_cmp(cfg.usage_file, cfg_defaults.usage_file));
 
   assert(cfg.debug_file != cfg_defaults.debug_file);
 
@@ -301,7 +328,7 @@ static void test_file_corner_cases(void) {
 
   // 2. File size within limit -> Success
   memset(buffer, ' ', sizeof(buffer));
-  memcpy(buffer, "manual\n", strlen("manual\n"));
+  memcpy(buffer, "nodetect\n", strlen("nodetect\n"));
   r = fwrite(buffer, sizeof(buffer), 1, cf.out) != 1;
   assert(!r);
   r = fflush(cf.out);
@@ -311,7 +338,7 @@ static void test_file_corner_cases(void) {
   cfg_free(&cfg);
 
   // 3. File size beyond limit -> Failure
-  r = fwrite("manual\n", strlen("manual\n"), 1, cf.out) != 1;
+  r = fwrite("nodetect\n", strlen("nodetect\n"), 1, cf.out) != 1;
   assert(!r);
   r = fflush(cf.out);
   assert(r == 0);
@@ -386,6 +413,112 @@ static void test_file_parser(void) {
   conf_file_clear(&cf);
 }
 
+static void test_expand_template(void) {
+  // The authfile template is compiled when the configuration is loaded.
+
+  const char *argv[] = {"debug", "expand", NULL};
+  int r;
+  cfg_t cfg;
+
+  argv[2] = "authfile=/etc/u2f/%h2/%u";
+  r = cfg_init(&cfg, 0, sizeof(argv) / sizeof(*argv), argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.auth_file_tmpl.n_ops == 4);
+  cfg_free(&cfg);
+
+  argv[2] = "authfile=/etc/u2f/%q";
+  r = cfg_init(&cfg, 0, sizeof(argv) / sizeof(*argv), argv);
+  assert(r == PAM_SERVICE_ERR);
+}
+
+static void test_debug_level(void) {
+  const char *argv[] = {"debug_level=warn", NULL};
+  int r;
+  cfg_t cfg;
+
+  r = cfg_init(&cfg, 0, 1, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.debug == DEBUG_LVL_WARN);
+  cfg_free(&cfg);
+
+  // "debug" keeps enabling everything built in; the last option wins.
+  argv[1] = "debug";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.debug == DEBUG_LVL_TRACE);
+  cfg_free(&cfg);
+
+  argv[0] = "debug";
+  argv[1] = "debug_level=info";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.debug == DEBUG_LVL_INFO);
+  cfg_free(&cfg);
+
+  // Unknown levels are ignored.
+  argv[1] = "debug_level=verbose";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.debug == DEBUG_LVL_TRACE);
+  cfg_free(&cfg);
+
+  assert(debug_level("error") == DEBUG_LVL_ERROR);
+  assert(debug_level("warning") == DEBUG_LVL_WARN);
+  assert(debug_level("debug") == DEBUG_LVL_DEBUG);
+  assert(debug_level("") == -1);
+}
+
+static void test_nodevice(void) {
+  const char *argv[] = {"debug", NULL};
+  int r;
+  cfg_t cfg;
+
+  argv[1] = "nodevice=authinfo_unavail";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.nodevice == PAM_AUTHINFO_UNAVAIL);
+  cfg_free(&cfg);
+
+  argv[1] = "nodevice=auth_err";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.nodevice == PAM_AUTH_ERR);
+  cfg_free(&cfg);
+
+  // Unknown codes leave the check disabled.
+  argv[1] = "nodevice=success";
+  r = cfg_init(&cfg, 0, 2, argv);
+  assert(r == PAM_SUCCESS);
+  assert(cfg.nodevice == 0);
+  cfg_free(&cfg);
+}
+
+static void test_compiled_out(void) {
+  // Options for features left out of the build are refused, not ignored.
+
+  const char *argv[] = {"debug", NULL};
+  int r;
+  cfg_t cfg;
+
+  argv[1] = "sshformat";
+  r = cfg_init(&cfg, 0, sizeof(argv) / sizeof(*argv), argv);
+#ifdef NO_SSHFORMAT
+  assert(r == PAM_SERVICE_ERR);
+#else
+  assert(r == PAM_SUCCESS);
+  cfg_free(&cfg);
+#endif
+
+  argv[1] = "manual";
+  r = cfg_init(&cfg, 0, sizeof(argv) / sizeof(*argv), argv);
+#ifdef NO_MANUAL
+  assert(r == PAM_SERVICE_ERR);
+#else
+  assert(r == PAM_SUCCESS);
+  cfg_free(&cfg);
+#endif
+}
+
 int main(int argc, char **argv) {
   (void) argc, (void) argv;
 
@@ -394,4 +527,8 @@ int main(int argc, char **argv) {
   test_last_config_wins();
   test_file_corner_cases();
   test_file_parser();
+  test_expand_template();
+  test_debug_level();
+  test_nodevice();
+  test_compiled_out();
 }
@@ -0,0 +1,104 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "credtab.h"
+
+int main(void) {
+  char path[] = "/tmp/pam_u2f_credtab_XXXXXX";
+  char usage[] = "/tmp/pam_u2f_usage_XXXXXX";
+  char kh_a[] = "a2V5IGhhbmRsZSBh"; // "key handle a"
+  char kh_b[] = "a2V5IGhhbmRsZSBi"; // "key handle b"
+  device_t a = {.keyHandle = kh_a};
+  device_t b = {.keyHandle = kh_b};
+  struct { // a sigcount table with a single slot
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    unsigned char slot[24];
+  } one = {CREDTAB_MAGIC, CREDTAB_VERSION, 1, {0}};
+  struct credtab_use use;
+  cfg_t cfg;
+  FILE *fp;
+  int fd;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  cfg.sigcount_file = path;
+
+  // Authenticators without a counter always report zero.
+  assert(credtab_update(&cfg, &a, 0));
+  assert(credtab_update(&cfg, &a, 0));
+
+  // Counters must strictly increase.
+  assert(credtab_update(&cfg, &a, 1));
+  assert(credtab_update(&cfg, &a, 5));
+  assert(!credtab_update(&cfg, &a, 5));
+  assert(!credtab_update(&cfg, &a, 4));
+  assert(!credtab_update(&cfg, &a, 0));
+  assert(credtab_update(&cfg, &a, 6));
+
+  // Credentials are tracked independently.
+  assert(credtab_update(&cfg, &b, 3));
+  assert(credtab_update(&cfg, &a, 7));
+  assert(!credtab_update(&cfg, &b, 3));
+
+  // A full table leaves new credentials untracked rather than locked out.
+  fp = fopen(path, "w");
+  assert(fp != NULL);
+  assert(fwrite(&one, sizeof(one), 1, fp) == 1);
+  assert(fclose(fp) == 0);
+  assert(credtab_update(&cfg, &a, 1));
+  assert(!credtab_update(&cfg, &a, 1));
+  assert(credtab_update(&cfg, &b, 1));
+  assert(credtab_update(&cfg, &b, 1));
+
+  // Unexpected formats are rejected.
+  assert(truncate(path, 64) == 0);
+  assert(!credtab_update(&cfg, &a, 8));
+  unlink(path);
+
+  // Relative paths are rejected.
+  cfg.sigcount_file = "credtab";
+  assert(!credtab_update(&cfg, &a, 9));
+
+  // Usage records, created on first use.
+  fd = mkstemp(usage);
+  assert(fd != -1);
+  close(fd);
+  cfg.usage_file = usage;
+  assert(credtab_lookup_use(&cfg, &a, &use) == 0);
+  unlink(usage);
+  assert(credtab_lookup_use(&cfg, &a, &use) == -1);
+  assert(credtab_record_use(&cfg, &a, 1700000000));
+  assert(credtab_record_use(&cfg, &a, 1700000100));
+  assert(credtab_lookup_use(&cfg, &a, &use) == 1);
+  assert(use.last == 1700000100 && use.count == 2);
+  assert(credtab_lookup_use(&cfg, &b, &use) == 0);
+  assert(use.last == 0 && use.count == 0);
+
+  // The last use never goes back, e.g. with concurrent logins.
+  assert(credtab_record_use(&cfg, &a, 1700000050));
+  assert(credtab_lookup_use(&cfg, &a, &use) == 1);
+  assert(use.last == 1700000100 && use.count == 3);
+
+  // Tables are not mixed up.
+  cfg.sigcount_file = usage;
+  assert(!credtab_update(&cfg, &a, 10));
+  unlink(usage);
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "devlock.h"
+
+static double now(void) {
+  struct timespec ts;
+
+  assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void cleanup(const char *dir, const char *name) {
+  char path[256];
+
+  snprintf(path, sizeof(path), "%s/%s.lock", dir, name);
+  assert(unlink(path) == 0);
+  snprintf(path, sizeof(path), "%s/%s.queue", dir, name);
+  assert(unlink(path) == 0);
+}
+
+// Lock files are named after the SHA-256 digest of the device path.
+#define HIDRAW0                                                                \
+  "3b4d97441c2ac56935bd3d3fc4d0af369b622646389726f694372115c94869d9"
+#define HIDRAW1                                                                \
+  "1de7a0af7dbc722809b662c6e1becb6b2a8bbd8037fabfe669bb40be831cf4f6"
+#define A_DASH_B                                                               \
+  "519c4c3498dbcc5f972b947073aa6a77813ac928f805bf7ad847f86ae9d922c6"
+#define A_UNDERSCORE_B                                                         \
+  "811a18af032a3de538ac7e5196916b947298c605212502d88e7a94b24b684e95"
+
+int main(void) {
+  char dir[] = "/tmp/pam_u2f_devlock_XXXXXX";
+  struct devlock a, b, c;
+  double start;
+  cfg_t cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  assert(mkdtemp(dir) != NULL);
+
+  // Disabled by default.
+  assert(devlock_acquire(&cfg, dir, "/dev/hidraw0", &a));
+  assert(a.fd == -1);
+  devlock_release(&a);
+
+  cfg.device_lock = 1;
+  assert(devlock_acquire(&cfg, dir, "/dev/hidraw0", &a));
+  assert(a.fd != -1 && a.ticket == 0);
+
+  // Other authenticators are not affected.
+  assert(devlock_acquire(&cfg, dir, "/dev/hidraw1", &c));
+  assert(c.fd != -1);
+  devlock_release(&c);
+
+  // Paths differing only in punctuation get distinct locks.
+  assert(devlock_acquire(&cfg, dir, "/dev/a-b", &b));
+  assert(devlock_acquire(&cfg, dir, "/dev/a_b", &c));
+  assert(b.fd != -1 && c.fd != -1);
+  devlock_release(&c);
+  devlock_release(&b);
+
+  // Busy authenticator.
+  start = now();
+  assert(!devlock_acquire(&cfg, dir, "/dev/hidraw0", &b));
+  assert(now() - start >= 1);
+  assert(b.fd == -1);
+
+  // The turn given up above is skipped.
+  devlock_release(&a);
+  assert(devlock_acquire(&cfg, dir, "/dev/hidraw0", &c));
+  assert(c.fd != -1 && c.ticket == 2);
+  devlock_release(&c);
+  assert(devlock_acquire(&cfg, dir, "/dev/hidraw0", &a));
+  assert(a.fd != -1 && a.ticket == 3);
+  devlock_release(&a);
+
+  // Lock directory not writable.
+  assert(devlock_acquire(&cfg, "/nonexistent/pam_u2f", "/dev/hidraw0", &a));
+  assert(a.fd == -1);
+
+  cleanup(dir, HIDRAW0);
+  cleanup(dir, HIDRAW1);
+  cleanup(dir, A_DASH_B);
+  cleanup(dir, A_UNDERSCORE_B);
+  assert(rmdir(dir) == 0);
+}
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event.h"
+
+static void test_format(void) {
+  char buf[EVENT_MAX_LEN];
+  char expected[64];
+  int n;
+
+  n = event_format(buf, sizeof(buf), EVENT_TOUCH_REQUESTED, 2, NULL);
+  assert(n > 0 && (size_t) n == strlen(buf));
+  assert(strncmp(buf, "v=1 ev=touch ts=", strlen("v=1 ev=touch ts=")) == 0);
+  snprintf(expected, sizeof(expected), " pid=%ld cred=2", (long) getpid());
+  assert(strstr(buf, expected) != NULL);
+
+  n = event_format(buf, sizeof(buf), EVENT_DEVICE_PROBED, 0, "/dev/a b%\n");
+  assert(n > 0);
+  assert(strstr(buf, " cred=") == NULL);
+  assert(strcmp(strstr(buf, " dev="), " dev=/dev/a%20b%25%0a") == 0);
+
+  assert(event_format(buf, sizeof(buf), -1, 0, NULL) < 0);
+  assert(event_format(buf, 16, EVENT_AUTH_START, 0, NULL) < 0);
+  assert(event_format(buf, 48, EVENT_AUTH_START, 0, "/dev/hidraw0/dev/hidraw0") <
+         0);
+}
+
+static void test_emit(void) {
+  struct sockaddr_un sa;
+  char buf[EVENT_MAX_LEN];
+  char path[] = "/tmp/pam_u2f_event_XXXXXX";
+  cfg_t cfg;
+  ssize_t n;
+  int fd;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.event_fd = -1;
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  // No listener: events are dropped silently.
+  fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  unlink(path);
+  cfg.event_socket = path;
+  event_open(&cfg);
+  assert(cfg.event_fd == -1);
+  event_emit(&cfg, EVENT_AUTH_START, 0, NULL);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, path, sizeof(path));
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  assert(fd != -1);
+  assert(bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == 0);
+
+  event_open(&cfg);
+  assert(cfg.event_fd != -1);
+  event_emit(&cfg, EVENT_AUTH_START, 0, NULL);
+  event_emit(&cfg, EVENT_AUTH_SUCCESS, 0, NULL);
+  event_close(&cfg);
+  assert(cfg.event_fd == -1);
+
+  n = recv(fd, buf, sizeof(buf) - 1, 0);
+  assert(n > 0);
+  buf[n] = '\0';
+  assert(strncmp(buf, "v=1 ev=start ", strlen("v=1 ev=start ")) == 0);
+  n = recv(fd, buf, sizeof(buf) - 1, 0);
+  assert(n > 0);
+  buf[n] = '\0';
+  assert(strncmp(buf, "v=1 ev=success ", strlen("v=1 ev=success ")) == 0);
+
+  close(fd);
+  unlink(path);
+
+  // Relative paths are rejected.
+  cfg.event_socket = "event.sock";
+  event_open(&cfg);
+  assert(cfg.event_fd == -1);
+}
+
+int main(void) {
+  test_format();
+  test_emit();
+
+  return 0;
+}
@@ -4,21 +4,61 @@
 
 #undef NDEBUG
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include "util.h"
+#include "expand.h"
+
+static const char *expand(const char *str, const char *user) {
+  static char buf[PATH_MAX];
+  const struct expand_user eu = {
+    .name = user,
+    .home = "/home/alice",
+    .uid = 1000,
+    .has_uid = 1,
+  };
+  expand_tmpl_t tmpl;
+
+  if (expand_compile(&tmpl, str) != 0 ||
+      expand_render(&tmpl, &eu, buf, sizeof(buf)) != 0)
+    return NULL;
+
+  return buf;
+}
 
 #define ASSERT_STR_EQ(a, b) assert(!strcmp(a, b))
 #define ASSERT_EXPANDED_EQ(str, user, result)                                  \
   do {                                                                         \
-    char *tmp = expand_variables(str, user);                                   \
+    const char *tmp = expand(str, user);                                       \
     assert(tmp != NULL);                                                       \
     ASSERT_STR_EQ(tmp, result);                                                \
-    free(tmp);                                                                 \
   } while (0)
 
 #define ASSERT_NULL(x) assert((x) == NULL)
 
+static void test_render_limits(void) {
+  const struct expand_user eu = {.name = "user"};
+  expand_tmpl_t tmpl;
+  char buf[8];
+
+  assert(expand_compile(&tmpl, "/a/%u") == 0);
+  assert(expand_render(&tmpl, &eu, buf, sizeof(buf)) == 0);
+  ASSERT_STR_EQ(buf, "/a/user");
+  assert(expand_render(&tmpl, &eu, buf, 7) != 0); // No room for NUL.
+  assert(expand_render(&tmpl, &eu, buf, 4) != 0);
+
+  assert(expand_compile(&tmpl, "%U") == 0);
+  assert(expand_render(&tmpl, &eu, buf, sizeof(buf)) != 0); // No uid.
+  assert(expand_compile(&tmpl, "%H") == 0);
+  assert(expand_render(&tmpl, &eu, buf, sizeof(buf)) != 0); // No home.
+
+  // Too many operations.
+  assert(expand_compile(&tmpl, "%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u"
+                               "%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u") == 0);
+  assert(expand_compile(&tmpl, "%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u"
+                               "%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u") != 0);
+}
+
 int main(void) {
   ASSERT_EXPANDED_EQ("foobar", "user", "foobar");
   ASSERT_EXPANDED_EQ("", "user", "");
@@ -34,9 +74,26 @@ int main(void) {
   ASSERT_EXPANDED_EQ("%u%u", "user", "useruser");
   ASSERT_EXPANDED_EQ("%%%u%%", "user", "%user%");
 
-  ASSERT_NULL(expand_variables("%", "user"));  // Unexpected end of string.
-  ASSERT_NULL(expand_variables("%x", "user")); // Unknown variable.
-  ASSERT_NULL(expand_variables("%u", ""));     // Disallow empty username.
+  ASSERT_EXPANDED_EQ("/u2f/%1u/%2u/%u", "user", "/u2f/u/us/user");
+  ASSERT_EXPANDED_EQ("/u2f/%9u/%u", "user", "/u2f/user/user");
+  ASSERT_EXPANDED_EQ("/u2f/%h2/%u", "user", "/u2f/f2/user");
+  ASSERT_EXPANDED_EQ("%h8", "user", "60785ef2");
+  ASSERT_EXPANDED_EQ("%U:%H", "user", "1000:/home/alice");
+
+  ASSERT_NULL(expand("%", "user"));  // Unexpected end of string.
+  ASSERT_NULL(expand("%x", "user")); // Unknown variable.
+  ASSERT_NULL(expand("%u", ""));     // Disallow empty username.
+  ASSERT_NULL(expand("%1u", ""));
+  ASSERT_NULL(expand("%h2", ""));
+  ASSERT_NULL(expand("%h", "user"));
+  ASSERT_NULL(expand("%h9", "user"));
+  ASSERT_NULL(expand("%0u", "user"));
+  ASSERT_NULL(expand("/u2f/%1u/%u", ".user")); // Prefixes are not . or ..
+  ASSERT_NULL(expand("/u2f/%2u/%u", "..user"));
+  ASSERT_NULL(expand("/u2f/%3u/%u", "u/ser")); // nor contain '/'.
+  ASSERT_EXPANDED_EQ("/u2f/%3u/%u", "..user", "/u2f/..u/..user");
+
+  test_render_limits();
 
   return 0;
 }
@@ -11,6 +11,8 @@
 #include <unistd.h>
 
 #include <string.h>
+#include <fido.h>
+
 #include "../util.h"
 
 static void test_nouserok(const char *username) {
@@ -56,6 +58,10 @@ static void test_ssh_credential(const char *username) {
   assert(dev != NULL);
 
   rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+#ifdef NO_SSHFORMAT
+  assert(rc == PAM_AUTHINFO_UNAVAIL);
+  assert(ndevs == 0);
+#else
   assert(rc == PAM_SUCCESS);
   assert(ndevs == 1);
   assert(strcmp(dev[0].coseType, "es256") == 0);
@@ -67,10 +73,14 @@ static void test_ssh_credential(const char *username) {
                 "439pGle7126d1YORADduke347N2t2XyKzOSv8M4naCUjlFYDt"
                 "TVhP/MXO41wzHFUIzrrzfEzzCGWoOH5FU5Adw==") == 0);
   assert(dev[0].old_format == 0);
+#endif
   free_devices(dev, ndevs);
 }
 
 static void test_old_credential(const char *username) {
+#ifndef NO_OLD_FORMAT
+  unsigned char id[CRED_ID_LEN];
+#endif
   device_t *dev;
   unsigned ndevs;
   cfg_t cfg;
@@ -86,6 +96,10 @@ static void test_old_credential(const char *username) {
 
   dev = calloc(cfg.max_devs, sizeof(*dev));
   rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+#ifdef NO_OLD_FORMAT
+  assert(rc == PAM_AUTHINFO_UNAVAIL);
+  assert(ndevs == 0);
+#else
   assert(rc == PAM_SUCCESS);
   assert(ndevs == 1);
   assert(strcmp(dev[0].coseType, "es256") == 0);
@@ -99,9 +113,132 @@ static void test_old_credential(const char *username) {
            "425e79f8c41d8f049c8f7241a803563a43c139f923f0ab9007fbd0dcc722927") ==
     0);
   assert(dev[0].old_format == 1);
+
+  /* Credential IDs are shown to users and must remain stable. */
+  assert(credential_id(&dev[0], id));
+  assert(memcmp(id, "\xd5\x43\x3d\xf9", 4) == 0);
+#endif
+  free_devices(dev, ndevs);
+}
+
+#ifndef NO_OLD_FORMAT
+static void test_migrate_old_credential(const char *username) {
+  device_t *dev;
+  unsigned ndevs;
+  cfg_t cfg;
+  char *line;
+  int rc;
+
+  memset(&cfg, 0, sizeof(cfg_t));
+  cfg.auth_file = "credentials/old_credential.cred";
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+  cfg.max_devs = 1;
+
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_SUCCESS);
+  assert(ndevs == 1);
+
+  assert(format_native_credential(&dev[0], &line));
+  assert(strcmp(line, "mGvXxDqTMSVkSlDnDRNTVsP5Ij9cceCkdZkSJYeaJCHCOpBtM"
+                      "IFGQXKBBkvZpV5bWuEuJkoElIiMKirhCPAU8Q==,"
+                      "BaNWQab1tj4u9ESTk+fhyyuWcR55f8dNvWPpnb9BD/50JeefjEHY8"
+                      "EnI9yQagDVjpDwTn5I/CrkAf70NzHIpJw==,"
+                      "es256,+presence+appid") == 0);
+  free_devices(dev, ndevs);
+
+  /* The converted line parses as a native, non-legacy credential. */
+  dev = calloc(1, sizeof(*dev));
+  assert(parse_native_credential(&cfg, line, &dev[0]));
+  assert(dev[0].old_format == 0);
+  assert(strcmp(dev[0].coseType, "es256") == 0);
+  assert(strcmp(dev[0].attributes, "+presence+appid") == 0);
+  free_devices(dev, 1);
+  free(line);
+
+  /* The sidecar line holds every credential, including invalid ones. */
+  cfg.auth_file = "credentials/old_mixed.cred";
+  cfg.max_devs = 2;
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  rc = get_devices_from_authfile_st(&cfg, username, dev, &ndevs, NULL, &line);
+  assert(rc == PAM_SUCCESS);
+  assert(ndevs == 1);
+  assert(line != NULL);
+  assert(strncmp(line, username, strlen(username)) == 0);
+  assert(strstr(line, ",es256,+presence+appid:") != NULL);
+  assert(strstr(line, ",ed448,+presence") != NULL);
+  free_devices(dev, ndevs);
+  free(line);
+
+  /* Nothing to migrate without legacy credentials. */
+  cfg.auth_file = "credentials/new_invalid.cred";
+  cfg.max_devs = 24;
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  rc = get_devices_from_authfile_st(&cfg, username, dev, &ndevs, NULL, &line);
+  assert(rc == PAM_SUCCESS);
+  assert(line == NULL);
   free_devices(dev, ndevs);
 }
+#endif
+
+static void test_credential_id(const char *username) {
+  unsigned char id[CRED_ID_LEN];
+  unsigned char other[CRED_ID_LEN];
+  char kh[] = "a2V5IGhhbmRsZQ==";
+  char bad[] = "%%%";
+  device_t cred;
+  device_t *dev;
+  unsigned ndevs;
+  cfg_t cfg;
+  int rc;
 
+  memset(&cfg, 0, sizeof(cfg_t));
+  cfg.auth_file = "credentials/new_.cred";
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+  cfg.max_devs = 1;
+
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  assert(dev != NULL);
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_SUCCESS);
+  assert(ndevs == 1);
+  assert(dev[0].kh != NULL);
+  assert(credential_id(&dev[0], id));
+
+  /* Credentials parsed but not validated, as by the tools, get the same ID. */
+  memset(&cred, 0, sizeof(cred));
+  cred.keyHandle = dev[0].keyHandle;
+  cred.publicKey = dev[0].publicKey;
+  assert(credential_id(&cred, other));
+  assert(memcmp(id, other, sizeof(id)) == 0);
+
+  /* The ID follows the key handle, not the public key. */
+  cred.keyHandle = kh;
+  assert(credential_id(&cred, other));
+  assert(memcmp(id, other, sizeof(id)) != 0);
+  cred.keyHandle = bad;
+  assert(!credential_id(&cred, other));
+  free_devices(dev, ndevs);
+
+  /* Resident credentials are told apart by their public key. */
+  cfg.auth_file = "credentials/new_-r.cred";
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  assert(dev != NULL);
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_SUCCESS);
+  assert(ndevs == 1);
+  assert(credential_id(&dev[0], id));
+  memset(&cred, 0, sizeof(cred));
+  cred.keyHandle = dev[0].keyHandle;
+  cred.publicKey = kh;
+  assert(credential_id(&cred, other));
+  assert(memcmp(id, other, sizeof(id)) != 0);
+  free_devices(dev, ndevs);
+}
+
+#ifndef NO_EDDSA
 static void test_limited_count(const char *username) {
   cfg_t cfg;
   device_t *dev;
@@ -160,6 +297,119 @@ static void test_limited_count(const char *username) {
   assert(dev[1].old_format == 0);
   free_devices(dev, ndevs);
 }
+#endif
+
+static void test_invalid_credentials(const char *username) {
+  cfg_t cfg;
+  device_t *dev;
+  int rc;
+  unsigned ndevs;
+
+  memset(&cfg, 0, sizeof(cfg_t));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  /*
+   * authfile contains five credentials: bad key handle, es256, unknown COSE
+   * type, bad public key, eddsa
+   */
+  cfg.auth_file = "credentials/new_invalid.cred";
+  cfg.max_devs = 24;
+
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  assert(dev != NULL);
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_SUCCESS);
+  assert(strcmp(dev[0].coseType, "es256") == 0);
+  assert(strcmp(dev[0].attributes, "+presence+verification+pin") == 0);
+#ifdef NO_EDDSA
+  assert(ndevs == 1);
+#else
+  assert(ndevs == 2);
+  assert(strcmp(dev[1].coseType, "eddsa") == 0);
+  assert(strcmp(dev[1].publicKey,
+                "vGfFagg8uBgqRY2cZ0+S+B0n5p63IGNoKShReVhHYUw=") == 0);
+#endif
+  for (unsigned i = ndevs; i < cfg.max_devs; i++)
+    assert(dev[i].keyHandle == NULL && dev[i].publicKey == NULL);
+  free_devices(dev, ndevs);
+
+  /* only invalid credentials: fail, even with nouserok */
+  cfg.max_devs = 1;
+  cfg.nouserok = 1;
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  assert(dev != NULL);
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_AUTH_ERR);
+  assert(ndevs == 0);
+  free_devices(dev, ndevs);
+}
+
+static void test_rp_id_credentials(const char *username) {
+  device_t *dev;
+  unsigned ndevs;
+  cfg_t cfg;
+  char *line;
+  char bad[] = "a2g=,cGs=,es256,+presence,%%%";
+  int rc;
+
+  memset(&cfg, 0, sizeof(cfg_t));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  /*
+   * authfile contains three credentials: no attributes and pam://cluster,
+   * +presence+pin and pam://cluster, +presence and no relying party ID
+   */
+  cfg.auth_file = "credentials/new_rp_id.cred";
+  cfg.max_devs = 24;
+
+  dev = calloc(cfg.max_devs, sizeof(*dev));
+  assert(dev != NULL);
+  rc = get_devices_from_authfile(&cfg, username, dev, &ndevs);
+  assert(rc == PAM_SUCCESS);
+  assert(ndevs == 3);
+  assert(strcmp(dev[0].attributes, "") == 0);
+  assert(strcmp(dev[0].rpId, "pam://cluster") == 0);
+  assert(strcmp(dev[1].attributes, "+presence+pin") == 0);
+  assert(strcmp(dev[1].rpId, "pam://cluster") == 0);
+  assert(strcmp(dev[2].attributes, "+presence") == 0);
+  assert(dev[2].rpId == NULL);
+
+  assert(format_native_credential(&dev[1], &line));
+  assert(strcmp(line, "auU99KPIIvKGbRcVmsiEyGp/rPx1RNruXI2qS8+JgX1e7nWPczLvm"
+                      "lkx8/0Z8ZBNqy69aocwQgGHRWKEbDdwlw==,"
+                      "oG+oN40QezgwX3S6xFk2sR3jiQnobXxxFQy7Mo5vv9hryeIHX13zG"
+                      "0OZK0KJuhj4A71OAeNXd065P9tVHeQtOQ==,"
+                      "es256,+presence+pin,cGFtOi8vY2x1c3Rlcg==") == 0);
+  free(line);
+  free_devices(dev, ndevs);
+
+  /* A relying party ID that does not decode rejects the credential. */
+  dev = calloc(1, sizeof(*dev));
+  assert(dev != NULL);
+  assert(!parse_native_credential(&cfg, bad, &dev[0]));
+  assert(dev[0].keyHandle == NULL && dev[0].rpId == NULL);
+  free_devices(dev, 1);
+}
+
+static void test_cose_types(void) {
+  int type;
+
+  assert(cose_type("es256", &type) && type == COSE_ES256);
+  assert(cose_type("ES256", &type) && type == COSE_ES256);
+#ifdef NO_RS256
+  assert(!cose_type("rs256", &type) && type == 0);
+#else
+  assert(cose_type("rs256", &type) && type == COSE_RS256);
+#endif
+#ifdef NO_EDDSA
+  assert(!cose_type("eddsa", &type) && type == 0);
+#else
+  assert(cose_type("eddsa", &type) && type == COSE_EDDSA);
+#endif
+  assert(!cose_type("es384", &type) && type == 0);
+}
 
 static void test_new_credentials(const char *username) {
   cfg_t cfg;
@@ -756,7 +1006,16 @@ int main(void) {
   test_nouserok(username);
   test_ssh_credential(username);
   test_old_credential(username);
+#ifndef NO_OLD_FORMAT
+  test_migrate_old_credential(username);
+#endif
+#ifndef NO_EDDSA
   test_limited_count(username);
+#endif
+  test_credential_id(username);
+  test_invalid_credentials(username);
+  test_rp_id_credentials(username);
+  test_cose_types();
   test_new_credentials(username);
 
   free(username);
@@ -0,0 +1,135 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_KEYCTL_H
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "keyring.h"
+
+static void drop(const char *user, const char *auth_file) {
+#ifdef HAVE_LINUX_KEYCTL_H
+  char desc[256];
+  long key;
+
+  snprintf(desc, sizeof(desc), "pam_u2f:0:%s:%s", user, auth_file);
+  key = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, "user", desc,
+                0);
+  if (key != -1)
+    syscall(SYS_keyctl, KEYCTL_UNLINK, key, KEY_SPEC_USER_KEYRING);
+#else
+  (void) user;
+  (void) auth_file;
+#endif
+}
+
+int main(void) {
+  char auth_file[64];
+  // Credentials are decoded when read back, so they must be valid.
+  char pk_a[] = "CTTRrHrqQmqfyI7/bhtAknx9TGCqhd936JdcoekUxUa6PNA6uYzsvFN0qaE+"
+                "j2LchLPU4vajQPdAOcvvvNfWCA==";
+#ifndef NO_OLD_FORMAT
+  char pk_b[] = "0405a35641a6f5b63e2ef4449393e7e1cb2b96711e797fc74dbd63e99dbf"
+                "410ffe7425e79f8c41d8f049c8f7241a803563a43c139f923f0ab9007fbd"
+                "0dcc722927";
+#else
+  char *pk_b = pk_a;
+#endif
+  char kh_a[] = "*";
+  char kh_b[] = "a2V5IGhhbmRsZQ==";
+  char es256[] = "es256";
+  char attrs[] = "+presence";
+  char rp[] = "pam://cluster";
+  device_t in[2] = {
+    {.keyHandle = kh_a, .publicKey = pk_a, .coseType = es256,
+     .attributes = attrs, .rpId = rp},
+#ifndef NO_OLD_FORMAT
+    {.keyHandle = kh_b, .publicKey = pk_b, .coseType = es256,
+     .old_format = 1},
+#else
+    {.keyHandle = kh_b, .publicKey = pk_b, .coseType = es256},
+#endif
+  };
+  device_t out[2];
+  struct stat st, cached;
+  unsigned n, i;
+  cfg_t cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+  cfg.max_devs = 2;
+
+  // Disabled by default.
+  assert(!keyring_available(&cfg));
+
+  cfg.keyring_cache = 60;
+  if (!keyring_available(&cfg))
+    return 0; // not root, or not Linux
+
+  snprintf(auth_file, sizeof(auth_file), "/tmp/pam_u2f_keyring_%ld",
+           (long) getpid());
+  cfg.auth_file = auth_file;
+
+  memset(&st, 0, sizeof(st));
+  st.st_dev = 42;
+  st.st_ino = 4242;
+  st.st_size = 424;
+  st.st_mtim.tv_sec = 1700000000;
+  st.st_mtim.tv_nsec = 123456789;
+  st.st_ctim.tv_sec = 1700000001;
+  st.st_ctim.tv_nsec = 987654321;
+
+  memset(out, 0, sizeof(out));
+  assert(!keyring_lookup(&cfg, "alice", &cached, out, &n));
+  assert(n == 0);
+
+  if (!keyring_store(&cfg, "alice", &st, in, 2)) {
+    fprintf(stderr, "kernel keyring unavailable, skipping\n");
+    return 0;
+  }
+
+  assert(keyring_lookup(&cfg, "alice", &cached, out, &n));
+  assert(n == 2);
+  assert(cached.st_dev == st.st_dev && cached.st_ino == st.st_ino);
+  assert(cached.st_size == st.st_size);
+  assert(file_unchanged(&st, &cached));
+  assert(strcmp(out[0].coseType, "es256") == 0);
+  assert(strcmp(out[0].attributes, "+presence") == 0);
+  assert(strcmp(out[0].rpId, "pam://cluster") == 0);
+  assert(out[1].rpId == NULL);
+  assert(out[0].kh == NULL && out[0].pk.ptr != NULL);
+  assert(out[1].kh_len == strlen("key handle") && out[1].pk.ptr != NULL);
+  for (i = 0; i < n; i++) {
+    assert(strcmp(out[i].keyHandle, in[i].keyHandle) == 0);
+    assert(strcmp(out[i].publicKey, in[i].publicKey) == 0);
+    assert(out[i].old_format == in[i].old_format);
+    reset_device(&out[i]);
+  }
+
+  // Edits within the same second are told apart.
+  cached.st_mtim.tv_nsec++;
+  assert(!file_unchanged(&st, &cached));
+
+  // Keyed by user, format and authfile.
+  assert(!keyring_lookup(&cfg, "bob", &cached, out, &n));
+  cfg.sshformat = 1;
+  assert(!keyring_lookup(&cfg, "alice", &cached, out, &n));
+  cfg.sshformat = 0;
+
+  // More credentials than the module accepts.
+  cfg.max_devs = 1;
+  assert(!keyring_lookup(&cfg, "alice", &cached, out, &n));
+  assert(n == 0 && out[0].keyHandle == NULL);
+
+  drop("alice", auth_file);
+}
@@ -0,0 +1,206 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pamu2f.h"
+
+#define ORIGIN "pam://verifier"
+
+static void copy_file(const char *src, const char *dst) {
+  char tmp[64];
+  FILE *in, *out;
+  int c;
+
+  /* Replace the file, as an editor would, so that its identity changes. */
+  snprintf(tmp, sizeof(tmp), "%s.new", dst);
+  assert((in = fopen(src, "r")) != NULL);
+  assert((out = fopen(tmp, "w")) != NULL);
+  while ((c = fgetc(in)) != EOF)
+    assert(fputc(c, out) != EOF);
+  fclose(in);
+  assert(fclose(out) == 0);
+  assert(rename(tmp, dst) == 0);
+}
+
+static void test_load(const char *username) {
+  pamu2f_ctx_t *ctx;
+  const char *kh, *rp;
+  size_t n;
+
+  assert(pamu2f_new(NULL, ORIGIN, NULL) == NULL);
+  assert(pamu2f_new("credentials/new_rp_id.cred", NULL, NULL) == NULL);
+
+  ctx = pamu2f_new("credentials/new_rp_id.cred", ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_OK);
+  assert(n == 3);
+
+  assert(pamu2f_credential(ctx, username, 0, &kh, &rp) == PAMU2F_OK);
+  assert(strncmp(kh, "WWJqEWaCASU+", 12) == 0);
+  assert(strcmp(rp, "pam://cluster") == 0);
+  assert(pamu2f_credential(ctx, username, 2, &kh, &rp) == PAMU2F_OK);
+  assert(strncmp(kh, "vlcWFQFik8gJ", 12) == 0);
+  assert(strcmp(rp, ORIGIN) == 0);
+  assert(pamu2f_credential(ctx, username, 3, &kh, &rp) == PAMU2F_ERR_INVALID);
+  pamu2f_free(&ctx);
+  assert(ctx == NULL);
+
+  ctx = pamu2f_new("credentials/empty.cred", ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_ERR_NOUSER);
+  assert(n == 0);
+  pamu2f_free(&ctx);
+
+  ctx = pamu2f_new("credentials/this_file_does_not_exist.cred", ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_ERR_AUTHFILE);
+  pamu2f_free(&ctx);
+}
+
+static void test_reload(const char *username) {
+  char path[] = "/tmp/pam_u2f_authfile_XXXXXX";
+  pamu2f_ctx_t *ctx;
+  size_t n;
+  int fd;
+
+  assert((fd = mkstemp(path)) != -1);
+  close(fd);
+
+  copy_file("credentials/new_.cred", path);
+  ctx = pamu2f_new(path, ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_OK);
+  assert(n == 1);
+
+  /* cached: the user is still known after the file is gone */
+  assert(unlink(path) == 0);
+  assert(pamu2f_credential(ctx, username, 0, NULL, NULL) == PAMU2F_OK);
+
+  copy_file("credentials/new_double_-N.cred", path);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_OK);
+  assert(n == 2);
+
+  pamu2f_free(&ctx);
+  unlink(path);
+}
+
+static void test_evict(const char *username) {
+  pamu2f_ctx_t *ctx;
+  char other[32];
+  size_t n;
+
+  ctx = pamu2f_new("credentials/new_double_-N.cred", ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_OK);
+
+  /* unknown users evict each other and the known one, bounding the cache */
+  for (unsigned i = 0; i < 5000; i++) {
+    snprintf(other, sizeof(other), "nosuchuser%u", i);
+    assert(pamu2f_load(ctx, other, &n) == PAMU2F_ERR_NOUSER);
+  }
+
+  assert(pamu2f_load(ctx, username, &n) == PAMU2F_OK);
+  assert(n == 2);
+  assert(pamu2f_credential(ctx, username, 1, NULL, NULL) == PAMU2F_OK);
+
+  pamu2f_free(&ctx);
+}
+
+static void test_verify_batch(const char *username) {
+  /* signed beforehand for the second credential of new_verify.cred */
+  const unsigned char cdh[32] = {
+    0x12, 0x01, 0xa5, 0x57, 0xd0, 0x1d, 0x70, 0x4d, 0x6f, 0xad, 0x9d,
+    0x53, 0x19, 0x52, 0xaa, 0x19, 0x38, 0x68, 0xe4, 0x6d, 0x61, 0x5f,
+    0xc4, 0x49, 0x6b, 0x56, 0x7a, 0xb1, 0x7d, 0x08, 0xa8, 0x55,
+  };
+  const unsigned char authdata[39] = {
+    0x58, 0x25, 0x4f, 0x81, 0x31, 0x5c, 0xf5, 0x51, 0x58, 0xcf,
+    0x5a, 0xb8, 0x2f, 0x4a, 0xb6, 0x03, 0x65, 0xff, 0x9a, 0xcb,
+    0xc6, 0xe8, 0x86, 0xd8, 0x12, 0xab, 0x90, 0x7c, 0x62, 0xe5,
+    0x0e, 0x78, 0xbb, 0x3f, 0x01, 0x00, 0x00, 0x00, 0x2a,
+  };
+  const unsigned char sig[72] = {
+    0x30, 0x46, 0x02, 0x21, 0x00, 0x84, 0x77, 0x8e, 0x91, 0x16,
+    0x2c, 0x53, 0x3e, 0xec, 0xf3, 0x92, 0x03, 0x3a, 0x99, 0x06,
+    0x8c, 0xa0, 0x79, 0x02, 0x02, 0x62, 0xcb, 0xa6, 0x26, 0xf7,
+    0xb1, 0xe3, 0xa9, 0x3e, 0xfa, 0x78, 0x45, 0x02, 0x21, 0x00,
+    0xd3, 0x06, 0xae, 0xe6, 0xbf, 0x1a, 0x34, 0x85, 0x5c, 0xc0,
+    0x4e, 0xa6, 0xca, 0x19, 0xee, 0xbf, 0x63, 0xb5, 0x66, 0x72,
+    0x87, 0x94, 0xef, 0x0f, 0x41, 0xc2, 0x12, 0xe8, 0xeb, 0x8c,
+    0x16, 0x72,
+  };
+  unsigned char bad_sig[sizeof(sig)];
+  pamu2f_assertion_t batch[64];
+  pamu2f_ctx_t *ctx;
+  size_t i;
+
+  memcpy(bad_sig, sig, sizeof(sig));
+  bad_sig[sizeof(sig) - 1] ^= 0x01;
+
+  ctx = pamu2f_new("credentials/new_verify.cred", ORIGIN, NULL);
+  assert(ctx != NULL);
+  assert(pamu2f_set_workers(ctx, 1000) == PAMU2F_ERR_INVALID);
+  assert(pamu2f_verify_batch(ctx, NULL, 0) == PAMU2F_OK);
+  assert(pamu2f_verify_batch(ctx, NULL, 1) == PAMU2F_ERR_INVALID);
+
+  memset(batch, 0, sizeof(batch));
+  for (i = 0; i < 64; i++) {
+    batch[i].username = i % 4 == 1 ? "nosuchuser" : username;
+    batch[i].cdh = cdh;
+    batch[i].cdh_len = sizeof(cdh);
+    batch[i].authdata = i % 4 == 2 ? NULL : authdata;
+    batch[i].authdata_len = sizeof(authdata);
+    batch[i].sig = i % 4 == 3 ? bad_sig : sig;
+    batch[i].sig_len = sizeof(sig);
+    batch[i].result = 1;
+    batch[i].credential = (size_t) -1;
+  }
+
+  /* inline, then spread over workers, then inline again */
+  for (unsigned workers = 0; workers <= 8; workers += 4) {
+    assert(pamu2f_set_workers(ctx, workers % 8) == PAMU2F_OK);
+    assert(pamu2f_verify_batch(ctx, batch, 64) == PAMU2F_OK);
+    for (i = 0; i < 64; i++) {
+      if (i % 4 == 0) {
+        assert(batch[i].result == PAMU2F_OK);
+        assert(batch[i].credential == 1);
+      } else if (i % 4 == 1)
+        assert(batch[i].result == PAMU2F_ERR_NOUSER ||
+               batch[i].result == PAMU2F_ERR_AUTHFILE);
+      else if (i % 4 == 2)
+        assert(batch[i].result == PAMU2F_ERR_INVALID);
+      else
+        assert(batch[i].result == PAMU2F_ERR_VERIFY);
+    }
+  }
+
+  pamu2f_free(&ctx);
+  pamu2f_free(&ctx);
+}
+
+int main(void) {
+  const struct passwd *pwd;
+  char *username;
+
+  assert((pwd = getpwuid(geteuid())) != NULL);
+  assert((username = strdup(pwd->pw_name)) != NULL);
+
+  test_load(username);
+  test_reload(username);
+  test_evict(username);
+  test_verify_batch(username);
+
+  assert(strcmp(pamu2f_strerror(PAMU2F_ERR_VERIFY),
+                "assertion does not verify") == 0);
+  assert(strcmp(pamu2f_strerror(42), "unknown error") == 0);
+
+  free(username);
+}
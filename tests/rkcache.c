@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rkcache.h"
+
+static unsigned count_lines(const char *path) {
+  unsigned n = 0;
+  FILE *fp;
+  int c;
+
+  assert((fp = fopen(path, "r")) != NULL);
+  while ((c = fgetc(fp)) != EOF)
+    n += c == '\n';
+  fclose(fp);
+
+  return n;
+}
+
+int main(void) {
+  char path[] = "/tmp/pam_u2f_rkcache_XXXXXX";
+  char ident[RKCACHE_IDENT_LEN];
+  char pk_a[] = "cHVibGljIGtleSBh"; // "public key a"
+  char pk_b[] = "cHVibGljIGtleSBi"; // "public key b"
+  char kh[] = "*";
+  device_t a = {.keyHandle = kh, .publicKey = pk_a};
+  device_t b = {.keyHandle = kh, .publicKey = pk_b};
+  cfg_t cfg;
+  FILE *fp;
+  int fd;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.debug = 1;
+  cfg.debug_file = stderr;
+
+  fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  unlink(path);
+  cfg.rk_cache = path;
+
+  // Missing cache.
+  assert(!rkcache_lookup(&cfg, &a, ident, sizeof(ident)));
+
+  assert(rkcache_store(&cfg, &a, "1050:0407:/dev/hidraw1"));
+  assert(rkcache_store(&cfg, &b, "1050:0407:/dev/hidraw2"));
+  assert(rkcache_lookup(&cfg, &a, ident, sizeof(ident)));
+  assert(strcmp(ident, "1050:0407:/dev/hidraw1") == 0);
+  assert(rkcache_lookup(&cfg, &b, ident, sizeof(ident)));
+  assert(strcmp(ident, "1050:0407:/dev/hidraw2") == 0);
+
+  // Entries are replaced, not accumulated.
+  assert(rkcache_store(&cfg, &a, "1050:0407:/dev/hidraw3"));
+  assert(rkcache_lookup(&cfg, &a, ident, sizeof(ident)));
+  assert(strcmp(ident, "1050:0407:/dev/hidraw3") == 0);
+  assert(count_lines(path) == 2);
+
+  // Identities that do not fit are ignored.
+  assert(!rkcache_lookup(&cfg, &a, ident, 8));
+
+  // Lines of other versions are ignored, and dropped on the next update.
+  assert((fp = fopen(path, "a")) != NULL);
+  fprintf(fp, "00112233445566778899aabbccddeeff 1050:0407:/dev/hidraw4\n");
+  fclose(fp);
+  assert(count_lines(path) == 3);
+  assert(rkcache_store(&cfg, &b, "1050:0407:/dev/hidraw5"));
+  assert(count_lines(path) == 2);
+
+  unlink(path);
+
+  return 0;
+}
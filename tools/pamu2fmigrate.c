@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <err.h>
+
+#include "util.h"
+
+static int convert_line(const cfg_t *cfg, char *line, unsigned long lineno) {
+  device_t *devices = NULL;
+  const char *user;
+  char *cred;
+  char **converted = NULL;
+  char *saveptr = NULL;
+  unsigned n_devs = 0;
+  unsigned i;
+  unsigned n = 1;
+  int ok = 0;
+
+  for (cred = line; (cred = strchr(cred, ':')) != NULL; cred++)
+    n++;
+
+  if ((devices = calloc(n, sizeof(*devices))) == NULL) {
+    warnx("line %lu: unable to allocate memory", lineno);
+    return 0;
+  }
+
+  if ((user = strtok_r(line, ":", &saveptr)) == NULL) {
+    warnx("line %lu: missing username", lineno);
+    goto out;
+  }
+
+  while ((cred = strtok_r(NULL, ":", &saveptr)) != NULL) {
+    if (!parse_native_credential(cfg, cred, &devices[n_devs])) {
+      warnx("line %lu: unable to parse credential %u", lineno, n_devs + 1);
+      goto out;
+    }
+    n_devs++;
+  }
+
+  if ((converted = calloc(n, sizeof(*converted))) == NULL) {
+    warnx("line %lu: unable to allocate memory", lineno);
+    goto out;
+  }
+
+  for (i = 0; i < n_devs; i++) {
+    if (!format_native_credential(&devices[i], &converted[i])) {
+      warnx("line %lu: unable to convert credential %u", lineno, i + 1);
+      goto out;
+    }
+  }
+
+  printf("%s", user);
+  for (i = 0; i < n_devs; i++)
+    printf(":%s", converted[i]);
+  printf("\n");
+
+  ok = 1;
+
+out:
+  if (converted) {
+    for (i = 0; i < n_devs; i++)
+      free(converted[i]);
+    free(converted);
+  }
+  free_devices(devices, n);
+
+  return ok;
+}
+
+static void parse_args(int argc, char *argv[]) {
+  int c;
+  enum {
+    OPT_VERSION = 0x100,
+  };
+  /* clang-format off */
+  static const struct option options[] = {
+    { "help",    no_argument, NULL, 'h'         },
+    { "version", no_argument, NULL, OPT_VERSION },
+    { 0,         0,           0,    0           }
+  };
+  const char *usage =
+"Usage: pamu2fmigrate [OPTION]... [FILE]\n"
+"Convert the legacy U2F credentials in a pam_u2f authfile to the current\n"
+"format and print the result. Reads standard input when FILE is not given.\n"
+"\n"
+"  -h, --help               Print help and exit\n"
+"      --version            Print version and exit\n"
+"\n"
+"Converted credentials are marked with the +appid attribute so that pam_u2f\n"
+"keeps authenticating them against the configured appid.\n"
+"\n"
+"Report bugs at <" PACKAGE_BUGREPORT ">.\n";
+  /* clang-format on */
+
+  while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    switch (c) {
+      case 'h':
+        printf("%s", usage);
+        exit(EXIT_SUCCESS);
+      case OPT_VERSION:
+        printf("pamu2fmigrate " PACKAGE_VERSION "\n");
+        exit(EXIT_SUCCESS);
+      case '?':
+        exit(EXIT_FAILURE);
+      default:
+        errx(EXIT_FAILURE, "unknown option 0x%x", c);
+    }
+  }
+
+  if (argc - optind > 1)
+    errx(EXIT_FAILURE, "too many positional arguments");
+}
+
+int main(int argc, char *argv[]) {
+  int exit_code = EXIT_SUCCESS;
+  cfg_t cfg = {0};
+  FILE *in = stdin;
+  char *buf = NULL;
+  char *copy;
+  size_t bufsiz = 0;
+  ssize_t len;
+  unsigned long lineno = 0;
+
+  parse_args(argc, argv);
+
+  if (optind < argc && (in = fopen(argv[optind], "r")) == NULL)
+    err(EXIT_FAILURE, "%s", argv[optind]);
+
+  while ((len = getline(&buf, &bufsiz, in)) != -1) {
+    lineno++;
+    if (len > 0 && buf[len - 1] == '\n')
+      buf[len - 1] = '\0';
+
+    if (*buf == '\0') {
+      printf("\n");
+      continue;
+    }
+
+    /* Lines that cannot be converted are preserved verbatim. */
+    if ((copy = strdup(buf)) == NULL)
+      err(EXIT_FAILURE, "strdup");
+    if (!convert_line(&cfg, copy, lineno)) {
+      printf("%s\n", buf);
+      exit_code = EXIT_FAILURE;
+    }
+    free(copy);
+  }
+
+  if (ferror(in)) {
+    warn("read");
+    exit_code = EXIT_FAILURE;
+  }
+
+  free(buf);
+  if (in != stdin)
+    fclose(in);
+
+  return exit_code;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "debug.h"
+#include "util.h"
+
+struct args {
+  cfg_t cfg;
+  const char *user;
+  const char *pin;
+  unsigned long count;
+};
+
+static int conv_cb(int num_msg, const struct pam_message **msg,
+                   struct pam_response **resp_p, void *appdata_ptr) {
+  const char *pin = appdata_ptr;
+  struct pam_response *resp;
+
+  if (num_msg != 1 || (resp = calloc(1, sizeof(*resp))) == NULL)
+    return PAM_CONV_ERR;
+
+  if (msg[0]->msg_style == PAM_PROMPT_ECHO_OFF ||
+      msg[0]->msg_style == PAM_PROMPT_ECHO_ON) {
+    if ((resp->resp = strdup(pin ? pin : "")) == NULL) {
+      free(resp);
+      return PAM_CONV_ERR;
+    }
+  }
+
+  *resp_p = resp;
+
+  return PAM_SUCCESS;
+}
+
+static double elapsed_ms(const struct timespec *t0, const struct timespec *t1) {
+  return (double) (t1->tv_sec - t0->tv_sec) * 1000.0 +
+         (double) (t1->tv_nsec - t0->tv_nsec) / 1000000.0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void parse_args(int argc, char *argv[], struct args *args) {
+  char *ep;
+  int c;
+  enum {
+    OPT_VERSION = 0x100,
+  };
+  /* clang-format off */
+  static const struct option options[] = {
+    { "authfile", required_argument, NULL, 'a'         },
+    { "delay",    no_argument,       NULL, 'd'         },
+    { "help",     no_argument,       NULL, 'h'         },
+    { "appid",    required_argument, NULL, 'i'         },
+    { "count",    required_argument, NULL, 'n'         },
+    { "origin",   required_argument, NULL, 'o'         },
+    { "pin",      required_argument, NULL, 'P'         },
+    { "ssh",      no_argument,       NULL, 's'         },
+    { "user",     required_argument, NULL, 'u'         },
+    { "verbose",  no_argument,       NULL, 'v'         },
+    { "version",  no_argument,       NULL, OPT_VERSION },
+    { 0,          0,                 0,    0           }
+  };
+  const char *usage =
+"Usage: pamu2freplay [OPTION]... -a AUTHFILE -u USER TRACE\n"
+"Replay a CTAP trace recorded by pam_u2f with ctap_record=TRACE through the\n"
+"authentication loop and report how long each authentication took.\n"
+"\n"
+"  -a, --authfile=FILE      Authfile the trace was recorded against\n"
+"  -d, --delay              Reproduce the recorded authenticator delays\n"
+"  -h, --help               Print help and exit\n"
+"  -i, --appid=APPID        Application ID, defaults to the origin\n"
+"  -n, --count=N            Replay the trace N times (default: 1)\n"
+"  -o, --origin=ORIGIN      Origin, defaults to pam://$HOSTNAME\n"
+"  -P, --pin=PIN            PIN to answer PIN prompts with\n"
+"  -s, --ssh                The authfile is an SSH credential\n"
+"  -u, --user=USER          Owner of the credentials\n"
+"  -v, --verbose            Print debug information\n"
+"      --version            Print version and exit\n"
+"\n"
+"Report bugs at <" PACKAGE_BUGREPORT ">.\n";
+  /* clang-format on */
+
+  while ((c = getopt_long(argc, argv, "a:dhi:n:o:P:su:v", options, NULL)) !=
+         -1) {
+    switch (c) {
+      case 'a':
+        args->cfg.auth_file = optarg;
+        break;
+      case 'd':
+        args->cfg.ctap_replay_delay = 1;
+        break;
+      case 'h':
+        printf("%s", usage);
+        exit(EXIT_SUCCESS);
+      case 'i':
+        args->cfg.appid = optarg;
+        break;
+      case 'n':
+        args->count = strtoul(optarg, &ep, 10);
+        if (*optarg == '\0' || *ep != '\0' || args->count == 0)
+          errx(EXIT_FAILURE, "invalid count %s", optarg);
+        break;
+      case 'o':
+        args->cfg.origin = optarg;
+        break;
+      case 'P':
+        args->pin = optarg;
+        break;
+      case 's':
+        args->cfg.sshformat = 1;
+        break;
+      case 'u':
+        args->user = optarg;
+        break;
+      case 'v':
+        args->cfg.debug = DEBUG_LVL_TRACE;
+        args->cfg.debug_file = stderr;
+        break;
+      case OPT_VERSION:
+        printf("pamu2freplay " PACKAGE_VERSION "\n");
+        exit(EXIT_SUCCESS);
+      case '?':
+        exit(EXIT_FAILURE);
+      default:
+        errx(EXIT_FAILURE, "unknown option 0x%x", c);
+    }
+  }
+
+  if (argc - optind != 1)
+    errx(EXIT_FAILURE, "exactly one trace is required");
+  if (args->cfg.auth_file == NULL || args->user == NULL)
+    errx(EXIT_FAILURE, "an authfile and a user are required");
+
+  args->cfg.ctap_replay = argv[optind];
+}
+
+int main(int argc, char *argv[]) {
+  static char origin[BUFSIZE];
+  struct args args;
+  struct pam_conv conv;
+  struct timespec t0, t1;
+  pam_handle_t *pamh = NULL;
+  device_t *devices = NULL;
+  unsigned n_devs = 0;
+  double *ms = NULL;
+  unsigned long ok = 0;
+  int r;
+
+  memset(&args, 0, sizeof(args));
+  args.cfg.max_devs = MAX_DEVS;
+  args.cfg.event_fd = -1;
+  args.count = 1;
+
+  parse_args(argc, argv, &args);
+
+  if (args.cfg.origin == NULL) {
+    strcpy(origin, DEFAULT_ORIGIN_PREFIX);
+    if (gethostname(origin + strlen(DEFAULT_ORIGIN_PREFIX),
+                    sizeof(origin) - strlen(DEFAULT_ORIGIN_PREFIX)) == -1)
+      err(EXIT_FAILURE, "gethostname");
+    origin[sizeof(origin) - 1] = '\0';
+    args.cfg.origin = origin;
+  }
+  if (args.cfg.appid == NULL)
+    args.cfg.appid = args.cfg.origin;
+
+  if ((devices = calloc(MAX_DEVS, sizeof(*devices))) == NULL ||
+      (ms = calloc(args.count, sizeof(*ms))) == NULL)
+    err(EXIT_FAILURE, "calloc");
+
+  r = get_devices_from_authfile(&args.cfg, args.user, devices, &n_devs);
+  if (r != PAM_SUCCESS)
+    errx(EXIT_FAILURE, "%s: no usable credentials for %s", args.cfg.auth_file,
+         args.user);
+
+  conv.conv = conv_cb;
+  conv.appdata_ptr = (void *) (uintptr_t) args.pin;
+  if ((r = pam_start("pamu2freplay", args.user, &conv, &pamh)) != PAM_SUCCESS)
+    errx(EXIT_FAILURE, "pam_start: %s", pam_strerror(NULL, r));
+
+  for (unsigned long i = 0; i < args.count; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r = do_authentication(&args.cfg, devices, n_devs, pamh);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms[i] = elapsed_ms(&t0, &t1);
+    if (r == PAM_SUCCESS)
+      ok++;
+    printf("%lu: %s %.3f ms\n", i + 1, r == PAM_SUCCESS ? "success" : "failure",
+           ms[i]);
+  }
+
+  qsort(ms, args.count, sizeof(*ms), cmp_double);
+  printf("%lu/%lu succeeded, min %.3f ms, median %.3f ms, max %.3f ms\n", ok,
+         args.count, ms[0], ms[args.count / 2], ms[args.count - 1]);
+
+  pam_end(pamh, PAM_SUCCESS);
+  free_devices(devices, n_devs);
+  free(ms);
+
+  return ok == args.count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <err.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "expand.h"
+
+struct args {
+  const char *template;
+  const char *input;
+  int dry_run;
+};
+
+static int make_parents(char *path) {
+  char *p;
+
+  for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      warn("mkdir %s", path);
+      *p = '/';
+      return 0;
+    }
+    *p = '/';
+  }
+
+  return 1;
+}
+
+/*
+ * Replace the file at path with a single line. The line is written to a
+ * temporary file next to it, which is renamed into place, so that a login
+ * reading the file never sees it empty or half written.
+ */
+static int write_line(const char *path, const char *line) {
+  char tmp[PATH_MAX];
+  size_t len = strlen(line);
+  ssize_t w;
+  int fd;
+  int ok = 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp)) {
+    warnx("%s: path too long", path);
+    return 0;
+  }
+
+  if ((fd = mkstemp(tmp)) == -1) {
+    warn("mkstemp %s", tmp);
+    return 0;
+  }
+
+  if (fchmod(fd, 0644) != 0) {
+    warn("fchmod %s", tmp);
+    goto out;
+  }
+
+  if ((w = write(fd, line, len)) < 0 || (size_t) w != len ||
+      write(fd, "\n", 1) != 1) {
+    warn("write %s", tmp);
+    goto out;
+  }
+
+  if (fsync(fd) != 0) {
+    warn("fsync %s", tmp);
+    goto out;
+  }
+
+  ok = 1;
+
+out:
+  if (close(fd) != 0) {
+    warn("close %s", tmp);
+    ok = 0;
+  }
+
+  if (ok && rename(tmp, path) != 0) {
+    warn("rename %s", path);
+    ok = 0;
+  }
+
+  if (!ok)
+    unlink(tmp);
+
+  return ok;
+}
+
+static int shard_line(const struct args *args, const expand_tmpl_t *tmpl,
+                      const char *line, unsigned long lineno) {
+  struct expand_user eu = {0};
+  const struct passwd *pw;
+  char path[PATH_MAX];
+  char user[LOGIN_NAME_MAX + 1];
+  size_t len;
+
+  len = strcspn(line, ":");
+  if (len == 0 || line[len] != ':' || len >= sizeof(user)) {
+    warnx("line %lu: malformed entry", lineno);
+    return 0;
+  }
+  memcpy(user, line, len);
+  user[len] = '\0';
+
+  eu.name = user;
+  if ((pw = getpwnam(user)) != NULL) {
+    eu.home = pw->pw_dir;
+    eu.uid = pw->pw_uid;
+    eu.has_uid = 1;
+  }
+
+  if (expand_render(tmpl, &eu, path, sizeof(path)) != 0) {
+    warnx("line %lu: unable to expand template for %s", lineno, user);
+    return 0;
+  }
+
+  if (args->dry_run) {
+    printf("%s %s\n", user, path);
+    return 1;
+  }
+
+  return make_parents(path) && write_line(path, line);
+}
+
+static void parse_args(int argc, char *argv[], struct args *args) {
+  int c;
+  enum {
+    OPT_VERSION = 0x100,
+  };
+  /* clang-format off */
+  static const struct option options[] = {
+    { "help",     no_argument,       NULL, 'h'         },
+    { "version",  no_argument,       NULL, OPT_VERSION },
+    { "template", required_argument, NULL, 't'         },
+    { "dry-run",  no_argument,       NULL, 'n'         },
+    { 0,          0,                 0,    0           }
+  };
+  const char *usage =
+"Usage: pamu2fshard [OPTION]... -t TEMPLATE [FILE]\n"
+"Split a central pam_u2f authfile into one file per user, at the path given by\n"
+"expanding TEMPLATE for each user. Reads standard input when FILE is not given.\n"
+"\n"
+"  -h, --help               Print help and exit\n"
+"      --version            Print version and exit\n"
+"  -t, --template=STRING    Path template, as used with the authfile and expand\n"
+"                             module options, e.g. /etc/u2f/%h2/%u\n"
+"  -n, --dry-run            Print the destination of each user and exit\n"
+"\n"
+"Report bugs at <" PACKAGE_BUGREPORT ">.\n";
+  /* clang-format on */
+
+  while ((c = getopt_long(argc, argv, "ht:n", options, NULL)) != -1) {
+    switch (c) {
+      case 'h':
+        printf("%s", usage);
+        exit(EXIT_SUCCESS);
+      case 't':
+        args->template = optarg;
+        break;
+      case 'n':
+        args->dry_run = 1;
+        break;
+      case OPT_VERSION:
+        printf("pamu2fshard " PACKAGE_VERSION "\n");
+        exit(EXIT_SUCCESS);
+      case '?':
+        exit(EXIT_FAILURE);
+      default:
+        errx(EXIT_FAILURE, "unknown option 0x%x", c);
+    }
+  }
+
+  if (args->template == NULL)
+    errx(EXIT_FAILURE, "missing template");
+
+  if (argc - optind > 1)
+    errx(EXIT_FAILURE, "too many positional arguments");
+
+  if (optind < argc)
+    args->input = argv[optind];
+}
+
+int main(int argc, char *argv[]) {
+  int exit_code = EXIT_SUCCESS;
+  struct args args = {0};
+  expand_tmpl_t tmpl;
+  FILE *in = stdin;
+  char *buf = NULL;
+  size_t bufsiz = 0;
+  ssize_t len;
+  unsigned long lineno = 0;
+
+  parse_args(argc, argv, &args);
+
+  if (expand_compile(&tmpl, args.template) != 0)
+    errx(EXIT_FAILURE, "invalid template '%s'", args.template);
+
+  if (args.input && (in = fopen(args.input, "r")) == NULL)
+    err(EXIT_FAILURE, "%s", args.input);
+
+  while ((len = getline(&buf, &bufsiz, in)) != -1) {
+    lineno++;
+    if (len > 0 && buf[len - 1] == '\n')
+      buf[len - 1] = '\0';
+
+    if (*buf == '\0')
+      continue;
+
+    if (!shard_line(&args, &tmpl, buf, lineno))
+      exit_code = EXIT_FAILURE;
+  }
+
+  if (ferror(in)) {
+    warn("read");
+    exit_code = EXIT_FAILURE;
+  }
+
+  free(buf);
+  if (in != stdin)
+    fclose(in);
+
+  return exit_code;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2025 Yubico AB - See COPYING
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "credtab.h"
+#include "util.h"
+
+#define SECONDS_PER_DAY 86400
+
+static const char *usage_file;
+static long days = -1; /* list all credentials */
+
+static void format_day(uint64_t t, char *buf, size_t size) {
+  time_t tt = (time_t) t;
+  struct tm tm;
+
+  if (t == 0 || gmtime_r(&tt, &tm) == NULL ||
+      strftime(buf, size, "%Y-%m-%d", &tm) == 0)
+    snprintf(buf, size, "never");
+}
+
+/*
+ * Print the credentials of an authfile line with their usage, or only those
+ * unused since cutoff. Credentials are numbered as in the line.
+ */
+static int report_line(const cfg_t *cfg, char *line, unsigned long lineno,
+                       const char *name, uint64_t cutoff) {
+  struct credtab_use use;
+  device_t cred;
+  const char *user;
+  char *saveptr = NULL;
+  char *s;
+  char day[32];
+  unsigned n = 0;
+  int ok = 1;
+  int r;
+
+  if ((user = strtok_r(line, ":", &saveptr)) == NULL)
+    return 1;
+
+  while ((s = strtok_r(NULL, ":", &saveptr)) != NULL) {
+    n++;
+    memset(&cred, 0, sizeof(cred));
+    if (!parse_native_credential(cfg, s, &cred)) {
+      warnx("%s:%lu: unable to parse credential %u", name, lineno, n);
+      ok = 0;
+      continue;
+    }
+
+    if ((r = credtab_lookup_use(cfg, &cred, &use)) == -1) {
+      warnx("%s: unable to read the usage of credential %u of %s", usage_file,
+            n, user);
+      ok = 0;
+    } else if (days < 0 || use.last < cutoff) {
+      format_day(use.last, day, sizeof(day));
+      printf("%s\t%u\t%s\t%u\n", user, n, day, use.count);
+    }
+
+    reset_device(&cred);
+  }
+
+  return ok;
+}
+
+static int report(const cfg_t *cfg, FILE *in, const char *name,
+                  uint64_t cutoff) {
+  char *buf = NULL;
+  size_t bufsiz = 0;
+  ssize_t len;
+  unsigned long lineno = 0;
+  int ok = 1;
+
+  while ((len = getline(&buf, &bufsiz, in)) != -1) {
+    lineno++;
+    if (len > 0 && buf[len - 1] == '\n')
+      buf[len - 1] = '\0';
+    if (!report_line(cfg, buf, lineno, name, cutoff))
+      ok = 0;
+  }
+
+  if (ferror(in)) {
+    warn("%s", name);
+    ok = 0;
+  }
+
+  free(buf);
+
+  return ok;
+}
+
+static void parse_args(int argc, char *argv[]) {
+  char *ep;
+  int c;
+  enum {
+    OPT_VERSION = 0x100,
+  };
+  /* clang-format off */
+  static const struct option options[] = {
+    { "help",    no_argument,       NULL, 'h'         },
+    { "version", no_argument,       NULL, OPT_VERSION },
+    { "file",    required_argument, NULL, 'f'         },
+    { "days",    required_argument, NULL, 'd'         },
+    { 0,         0,                 0,    0           }
+  };
+  const char *usage =
+"Usage: pamu2fusage [OPTION]... -f USAGE_FILE [FILE]...\n"
+"List the credentials of pam_u2f authfiles with their last use and number of\n"
+"uses, as recorded by the usage_file module option. Reads standard input\n"
+"when no FILE is given.\n"
+"\n"
+"  -h, --help               Print help and exit\n"
+"      --version            Print version and exit\n"
+"  -f, --file=STRING        Usage file of the module\n"
+"  -d, --days=INT           Only list credentials unused for INT days\n"
+"\n"
+"Each line holds the user, the number of the credential in the user's line,\n"
+"the day of its last use in UTC, or \"never\", and its number of uses.\n"
+"\n"
+"Report bugs at <" PACKAGE_BUGREPORT ">.\n";
+  /* clang-format on */
+
+  while ((c = getopt_long(argc, argv, "hf:d:", options, NULL)) != -1) {
+    switch (c) {
+      case 'h':
+        printf("%s", usage);
+        exit(EXIT_SUCCESS);
+      case OPT_VERSION:
+        printf("pamu2fusage " PACKAGE_VERSION "\n");
+        exit(EXIT_SUCCESS);
+      case 'f':
+        usage_file = optarg;
+        break;
+      case 'd':
+        days = strtol(optarg, &ep, 10);
+        if (*optarg == '\0' || *ep != '\0' || days < 0 ||
+            days > INT32_MAX / SECONDS_PER_DAY)
+          errx(EXIT_FAILURE, "invalid number of days '%s'", optarg);
+        break;
+      case '?':
+        exit(EXIT_FAILURE);
+      default:
+        errx(EXIT_FAILURE, "unknown option 0x%x", c);
+    }
+  }
+
+  if (usage_file == NULL)
+    errx(EXIT_FAILURE, "missing usage file, see --help");
+}
+
+int main(int argc, char *argv[]) {
+  int exit_code = EXIT_SUCCESS;
+  cfg_t cfg = {0};
+  uint64_t cutoff = 0;
+  char *path;
+  FILE *in;
+  int fd;
+
+  parse_args(argc, argv);
+
+  /* report why the usage file cannot be used, the module stays quiet */
+  if ((fd = open(usage_file, O_RDONLY)) == -1)
+    err(EXIT_FAILURE, "%s", usage_file);
+  close(fd);
+  if ((path = realpath(usage_file, NULL)) == NULL)
+    err(EXIT_FAILURE, "%s", usage_file);
+  cfg.usage_file = path;
+
+  if (days >= 0)
+    cutoff = (uint64_t) time(NULL) - (uint64_t) days * SECONDS_PER_DAY;
+
+  if (optind == argc && !report(&cfg, stdin, "stdin", cutoff))
+    exit_code = EXIT_FAILURE;
+
+  for (int i = optind; i < argc; i++) {
+    if ((in = fopen(argv[i], "r")) == NULL) {
+      warn("%s", argv[i]);
+      exit_code = EXIT_FAILURE;
+      continue;
+    }
+    if (!report(&cfg, in, argv[i], cutoff))
+      exit_code = EXIT_FAILURE;
+    fclose(in);
+  }
+
+  free(path);
+
+  return exit_code;
+}
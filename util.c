@@ -10,20 +10,32 @@
 
 #include <openssl/ec.h>
 #include <openssl/obj_mac.h>
+#include <openssl/sha.h>
 
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "b64.h"
+#include "credtab.h"
+#ifdef WITH_CTAP_TRACE
+#include "ctaptrace.h"
+#endif
 #include "debug.h"
+#include "devlock.h"
+#include "event.h"
+#include "rkcache.h"
 #include "util.h"
 
 #define SSH_MAX_SIZE 8192
@@ -51,41 +63,50 @@ struct opts {
   fido_opt_t pin;
 };
 
-struct pk {
-  void *ptr;
-  int type;
+#define OLD_PK_LEN 65 /* uncompressed P-256 point */
+
+#if !defined(NO_OLD_FORMAT) || !defined(NO_MANUAL)
+/* clang-format off */
+static const unsigned char hex_table[256] = {
+  ['0'] = 0x01, ['1'] = 0x02, ['2'] = 0x03, ['3'] = 0x04, ['4'] = 0x05,
+  ['5'] = 0x06, ['6'] = 0x07, ['7'] = 0x08, ['8'] = 0x09, ['9'] = 0x0a,
+  ['a'] = 0x0b, ['b'] = 0x0c, ['c'] = 0x0d, ['d'] = 0x0e, ['e'] = 0x0f,
+  ['f'] = 0x10, ['A'] = 0x0b, ['B'] = 0x0c, ['C'] = 0x0d, ['D'] = 0x0e,
+  ['E'] = 0x0f, ['F'] = 0x10,
 };
+/* clang-format on */
+
+/*
+ * Decode ascii_hex into the caller-provided blob. The table holds the nibble
+ * value plus one, so that zero marks an invalid character.
+ */
+static int hex_decode(const char *ascii_hex, unsigned char *blob,
+                      size_t blob_size, size_t *blob_len) {
+  size_t n;
 
-static int hex_decode(const char *ascii_hex, unsigned char **blob,
-                      size_t *blob_len) {
-  *blob = NULL;
   *blob_len = 0;
 
-  if (ascii_hex == NULL || (strlen(ascii_hex) % 2) != 0)
+  if (ascii_hex == NULL || ((n = strlen(ascii_hex)) % 2) != 0 ||
+      n / 2 > blob_size)
     return (0);
 
-  *blob_len = strlen(ascii_hex) / 2;
-  *blob = calloc(1, *blob_len);
-  if (*blob == NULL)
-    return (0);
+  for (size_t i = 0; i < n / 2; i++) {
+    unsigned char hi = hex_table[(unsigned char) ascii_hex[2 * i]];
+    unsigned char lo = hex_table[(unsigned char) ascii_hex[2 * i + 1]];
 
-  for (size_t i = 0; i < *blob_len; i++) {
-    unsigned int c;
-    int n = -1;
-    int r = sscanf(ascii_hex, "%02x%n", &c, &n);
-    if (r != 1 || n != 2 || c > UCHAR_MAX) {
-      free(*blob);
-      *blob = NULL;
-      *blob_len = 0;
+    if (hi == 0 || lo == 0)
       return (0);
-    }
-    (*blob)[i] = (unsigned char) c;
-    ascii_hex += n;
+
+    blob[i] = (unsigned char) ((hi - 1) << 4 | (lo - 1));
   }
 
+  *blob_len = n / 2;
+
   return (1);
 }
+#endif
 
+#ifndef NO_OLD_FORMAT
 static char *normal_b64(const char *websafe_b64) {
   char *b64;
   char *p;
@@ -156,20 +177,73 @@ fail:
 
   return r;
 }
+#endif /* NO_OLD_FORMAT */
 
 static int is_resident(const char *kh) { return strcmp(kh, "*") == 0; }
 
-static void reset_device(device_t *device) {
+/* Legacy credentials, converted or not, are registered against the appid. */
+static int uses_appid(const device_t *device) {
+  return device->old_format || strstr(device->attributes, "+appid") != NULL;
+}
+
+/* The relying party a credential is asserted against. */
+const char *credential_rp(const cfg_t *cfg, const device_t *device) {
+  if (device->rpId != NULL)
+    return device->rpId;
+
+  return uses_appid(device) ? cfg->appid : cfg->origin;
+}
+
+void reset_device(device_t *device) {
   free(device->keyHandle);
   free(device->publicKey);
   free(device->coseType);
   free(device->attributes);
+  free(device->rpId);
+  free(device->kh);
+  reset_pk(&device->pk);
   memset(device, 0, sizeof(*device));
 }
 
-static int parse_native_credential(const cfg_t *cfg, char *s, device_t *cred) {
+/*
+ * The optional fifth field holds the relying party ID the credential was
+ * registered against, base64 encoded since RP IDs such as "pam://host" contain
+ * the ':' separating credentials.
+ */
+static char *decode_rp_id(const cfg_t *cfg, const char *b64) {
+  unsigned char *buf = NULL;
+  size_t len;
+  char *rp_id = NULL;
+
+  if (!b64_decode(b64, (void **) &buf, &len) || len == 0) {
+    debug_dbg(cfg, "Failed to decode relying party ID");
+    goto err;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    if (buf[i] < 0x20 || buf[i] > 0x7e) {
+      debug_dbg(cfg, "Invalid relying party ID");
+      goto err;
+    }
+  }
+
+  if ((rp_id = calloc(1, len + 1)) == NULL) {
+    debug_err(cfg, "Unable to allocate relying party ID");
+    goto err;
+  }
+  memcpy(rp_id, buf, len);
+
+err:
+  free(buf);
+
+  return rp_id;
+}
+
+int parse_native_credential(const cfg_t *cfg, char *s, device_t *cred) {
   const char *delim = ",";
   const char *kh, *pk, *type, *attr;
+  char *end = s + strlen(s);
+  char *rest, *rp = NULL;
   char *saveptr = NULL;
 
   memset(cred, 0, sizeof(*cred));
@@ -185,23 +259,43 @@ static int parse_native_credential(const cfg_t *cfg, char *s, device_t *cred) {
   }
 
   if ((type = strtok_r(NULL, delim, &saveptr)) == NULL) {
+#ifdef NO_OLD_FORMAT
+    debug_warn(cfg, "Old format credentials are not supported by this build");
+    goto fail;
+#else
     debug_dbg(cfg, "Old format, assume es256 and +presence");
     cred->old_format = 1;
     type = "es256";
     attr = "+presence";
-  } else if ((attr = strtok_r(NULL, delim, &saveptr)) == NULL) {
-    debug_dbg(cfg, "Empty attributes");
-    attr = "";
+#endif
+  } else {
+    /* The attributes may be empty, so split the rest without strtok_r. */
+    rest = s + (type - s) + strlen(type);
+    attr = rest < end ? rest + 1 : "";
+    if (rest < end && (rest = strchr(rest + 1, ',')) != NULL) {
+      *rest = '\0';
+      rp = rest + 1;
+    }
+    if (*attr == '\0')
+      debug_dbg(cfg, "Empty attributes");
   }
 
-  cred->keyHandle = cred->old_format ? normal_b64(kh) : strdup(kh);
+#ifndef NO_OLD_FORMAT
+  if (cred->old_format)
+    cred->keyHandle = normal_b64(kh);
+  else
+#endif
+    cred->keyHandle = strdup(kh);
   if (cred->keyHandle == NULL || (cred->publicKey = strdup(pk)) == NULL ||
       (cred->coseType = strdup(type)) == NULL ||
       (cred->attributes = strdup(attr)) == NULL) {
-    debug_dbg(cfg, "Unable to allocate memory for credential components");
+    debug_err(cfg, "Unable to allocate memory for credential components");
     goto fail;
   }
 
+  if (rp != NULL && (cred->rpId = decode_rp_id(cfg, rp)) == NULL)
+    goto fail;
+
   return 1;
 
 fail:
@@ -225,11 +319,11 @@ static int parse_native_format(const cfg_t *cfg, const char *username,
     if (len > 0 && buf[len - 1] == '\n')
       buf[len - 1] = '\0';
 
-    debug_dbg(cfg, "Read %zu bytes", len);
+    debug_trace(cfg, "Read %zu bytes", len);
 
     s_user = strtok_r(buf, ":", &saveptr);
     if (s_user && strcmp(username, s_user) == 0) {
-      debug_dbg(cfg, "Matched user: %s", s_user);
+      debug_trace(cfg, "Matched user: %s", s_user);
 
       // only keep last line for this user
       for (i = 0; i < *n_devs; i++) {
@@ -248,18 +342,21 @@ static int parse_native_format(const cfg_t *cfg, const char *username,
         }
 
         if (!parse_native_credential(cfg, s_credential, &devices[i])) {
-          debug_dbg(cfg, "Failed to parse credential");
+          debug_warn(cfg, "Failed to parse credential");
           goto fail;
         }
 
-        debug_dbg(cfg, "KeyHandle for device number %u: %s", i + 1,
-                  devices[i].keyHandle);
-        debug_dbg(cfg, "publicKey for device number %u: %s", i + 1,
-                  devices[i].publicKey);
-        debug_dbg(cfg, "COSE type for device number %u: %s", i + 1,
-                  devices[i].coseType);
-        debug_dbg(cfg, "Attributes for device number %u: %s", i + 1,
-                  devices[i].attributes);
+        debug_trace(cfg, "KeyHandle for device number %u: %s", i + 1,
+                    devices[i].keyHandle);
+        debug_trace(cfg, "publicKey for device number %u: %s", i + 1,
+                    devices[i].publicKey);
+        debug_trace(cfg, "COSE type for device number %u: %s", i + 1,
+                    devices[i].coseType);
+        debug_trace(cfg, "Attributes for device number %u: %s", i + 1,
+                    devices[i].attributes);
+        if (devices[i].rpId)
+          debug_trace(cfg, "RP ID for device number %u: %s", i + 1,
+                      devices[i].rpId);
         i++;
       }
     }
@@ -276,6 +373,7 @@ fail:
   return r;
 }
 
+#ifndef NO_SSHFORMAT
 static int load_ssh_key(const cfg_t *cfg, char **out, FILE *opwfile,
                         size_t opwfile_size) {
   size_t buf_size;
@@ -293,7 +391,7 @@ static int load_ssh_key(const cfg_t *cfg, char **out, FILE *opwfile,
 
   buf_size = opwfile_size > SSH_MAX_SIZE ? SSH_MAX_SIZE : opwfile_size;
   if ((cp = buf = calloc(1, buf_size)) == NULL) {
-    debug_dbg(cfg, "Failed to allocate buffer for SSH key");
+    debug_err(cfg, "Failed to allocate buffer for SSH key");
     goto fail;
   }
 
@@ -413,7 +511,7 @@ static int ssh_log_cstring(const cfg_t *cfg, const unsigned char **buf,
     debug_dbg(cfg, "Malformed SSH key (%s)", name);
     return 0;
   }
-  debug_dbg(cfg, "%s (%zu) \"%s\"", name, len, str);
+  debug_trace(cfg, "%s (%zu) \"%s\"", name, len, str);
 
   free(str);
   return 1;
@@ -430,7 +528,7 @@ static int ssh_get_attrs(const cfg_t *cfg, const unsigned char **buf,
     debug_dbg(cfg, "Malformed SSH key (flags)");
     return 0;
   }
-  debug_dbg(cfg, "flags: %02x", flags);
+  debug_trace(cfg, "flags: %02x", flags);
 
   r = snprintf(tmp, sizeof(tmp), "%s%s",
                flags & SSH_SK_USER_PRESENCE_REQD ? "+presence" : "",
@@ -441,7 +539,7 @@ static int ssh_get_attrs(const cfg_t *cfg, const unsigned char **buf,
   }
 
   if ((*attrs = strdup(tmp)) == NULL) {
-    debug_dbg(cfg, "Unable to allocate attributes");
+    debug_err(cfg, "Unable to allocate attributes");
     return 0;
   }
 
@@ -479,7 +577,7 @@ static int ssh_get_pubkey(const cfg_t *cfg, const unsigned char **buf,
     goto err;
   }
 
-  debug_dbg(cfg, "keytype (%zu) \"%s\"", len, ssh_type);
+  debug_trace(cfg, "keytype (%zu) \"%s\"", len, ssh_type);
 
   if (type == COSE_ES256) {
     // curve name
@@ -490,7 +588,7 @@ static int ssh_get_pubkey(const cfg_t *cfg, const unsigned char **buf,
 
     if (len == SSH_P256_NAME_LEN &&
         memcmp(ssh_curve, SSH_P256_NAME, SSH_P256_NAME_LEN) == 0) {
-      debug_dbg(cfg, "curvename (%zu) \"%s\"", len, ssh_curve);
+      debug_trace(cfg, "curvename (%zu) \"%s\"", len, ssh_curve);
     } else {
       debug_dbg(cfg, "Unknown curve %s", ssh_curve);
       goto err;
@@ -520,12 +618,12 @@ static int ssh_get_pubkey(const cfg_t *cfg, const unsigned char **buf,
   }
 
   if (!b64_encode(blob, len, pubkey_p)) {
-    debug_dbg(cfg, "Unable to allocate public key");
+    debug_err(cfg, "Unable to allocate public key");
     goto err;
   }
 
   if ((*type_p = strdup(cose_string(type))) == NULL) {
-    debug_dbg(cfg, "Unable to allocate COSE type");
+    debug_err(cfg, "Unable to allocate COSE type");
     goto err;
   }
 
@@ -587,7 +685,7 @@ static int parse_ssh_format(const cfg_t *cfg, FILE *opwfile,
     debug_dbg(cfg, "Malformed SSH key (nkeys)");
     goto out;
   }
-  debug_dbg(cfg, "nkeys: %" PRIu32, tmp);
+  debug_trace(cfg, "nkeys: %" PRIu32, tmp);
   if (tmp != 1) {
     debug_dbg(cfg, "Multiple keys not supported");
     goto out;
@@ -612,8 +710,8 @@ static int parse_ssh_format(const cfg_t *cfg, FILE *opwfile,
     goto out;
   }
 
-  debug_dbg(cfg, "check1: %" PRIu32, check1);
-  debug_dbg(cfg, "check2: %" PRIu32, check2);
+  debug_trace(cfg, "check1: %" PRIu32, check1);
+  debug_trace(cfg, "check2: %" PRIu32, check2);
 
   if (check1 != check2) {
     debug_dbg(cfg, "Mismatched check values");
@@ -633,10 +731,10 @@ static int parse_ssh_format(const cfg_t *cfg, FILE *opwfile,
     goto out;
   }
 
-  debug_dbg(cfg, "KeyHandle for device number 1: %s", devices[0].keyHandle);
-  debug_dbg(cfg, "publicKey for device number 1: %s", devices[0].publicKey);
-  debug_dbg(cfg, "COSE type for device number 1: %s", devices[0].coseType);
-  debug_dbg(cfg, "Attributes for device number 1: %s", devices[0].attributes);
+  debug_trace(cfg, "KeyHandle for device number 1: %s", devices[0].keyHandle);
+  debug_trace(cfg, "publicKey for device number 1: %s", devices[0].publicKey);
+  debug_trace(cfg, "COSE type for device number 1: %s", devices[0].coseType);
+  debug_trace(cfg, "Attributes for device number 1: %s", devices[0].attributes);
 
   // reserved (skip)
   if (!ssh_get_string_ref(&decoded, &decoded_len, NULL, NULL)) {
@@ -675,9 +773,95 @@ out:
 
   return r;
 }
+#endif /* NO_SSHFORMAT */
+
+/*
+ * Whether a file still has the identity it had when it was read. Timestamps
+ * are compared to the nanosecond: an in-place edit keeping the size, such as
+ * swapping two credentials of the same type, may land in the same second.
+ */
+int file_unchanged(const struct stat *prev, const struct stat *st) {
+#ifdef __APPLE__
+  const struct timespec *pm = &prev->st_mtimespec, *m = &st->st_mtimespec;
+  const struct timespec *pc = &prev->st_ctimespec, *c = &st->st_ctimespec;
+#else
+  const struct timespec *pm = &prev->st_mtim, *m = &st->st_mtim;
+  const struct timespec *pc = &prev->st_ctim, *c = &st->st_ctim;
+#endif
+
+  return st->st_dev == prev->st_dev && st->st_ino == prev->st_ino &&
+         st->st_size == prev->st_size && m->tv_sec == pm->tv_sec &&
+         m->tv_nsec == pm->tv_nsec && c->tv_sec == pc->tv_sec &&
+         c->tv_nsec == pc->tv_nsec;
+}
 
 int get_devices_from_authfile(const cfg_t *cfg, const char *username,
                               device_t *devices, unsigned *n_devs) {
+  return get_devices_from_authfile_st(cfg, username, devices, n_devs, NULL,
+                                      NULL);
+}
+
+/*
+ * Format the credentials of a user as an authfile line in the current format,
+ * without the trailing newline, if any of them uses the legacy format.
+ * Returns 1 with *line set to NULL otherwise.
+ */
+static int convert_legacy_line(const cfg_t *cfg, const char *username,
+                               const device_t *devices, unsigned n_devs,
+                               char **line) {
+  char *cred = NULL;
+  char *tmp;
+  unsigned i;
+  int legacy = 0;
+
+  *line = NULL;
+
+  for (i = 0; i < n_devs; i++)
+    legacy |= devices[i].old_format;
+
+  if (!legacy)
+    return 1;
+
+  if ((*line = strdup(username)) == NULL) {
+    debug_err(cfg, "Unable to allocate memory");
+    return 0;
+  }
+
+  for (i = 0; i < n_devs; i++) {
+    if (!format_native_credential(&devices[i], &cred)) {
+      debug_warn(cfg, "Unable to convert credential %u", i + 1);
+      goto err;
+    }
+    if (asprintf(&tmp, "%s:%s", *line, cred) == -1) {
+      debug_err(cfg, "Unable to allocate memory");
+      goto err;
+    }
+    free(*line);
+    free(cred);
+    *line = tmp;
+    cred = NULL;
+  }
+
+  return 1;
+
+err:
+  free(cred);
+  free(*line);
+  *line = NULL;
+
+  return 0;
+}
+
+/*
+ * As get_devices_from_authfile(), also returning the status of the file the
+ * credentials were read from, so that callers can tell whether it changed.
+ * If migrated is not NULL, it is set to the user's line converted to the
+ * current format when it holds legacy credentials, NULL otherwise. All the
+ * credentials read are converted, including the ones dropped as invalid.
+ */
+int get_devices_from_authfile_st(const cfg_t *cfg, const char *username,
+                                 device_t *devices, unsigned *n_devs,
+                                 struct stat *st_p, char **migrated) {
 
   int r = PAM_AUTHINFO_UNAVAIL;
   int fd = -1;
@@ -691,6 +875,8 @@ int get_devices_from_authfile(const cfg_t *cfg, const char *username,
 
   /* Ensure we never return uninitialized count. */
   *n_devs = 0;
+  if (migrated != NULL)
+    *migrated = NULL;
 
   fd = open(cfg->auth_file, O_RDONLY | O_CLOEXEC | O_NOCTTY);
   if (fd < 0) {
@@ -702,12 +888,12 @@ int get_devices_from_authfile(const cfg_t *cfg, const char *username,
   }
 
   if (fstat(fd, &st) < 0) {
-    debug_dbg(cfg, "Cannot stat authentication file: %s", strerror(errno));
+    debug_err(cfg, "Cannot stat authentication file: %s", strerror(errno));
     goto err;
   }
 
   if (!S_ISREG(st.st_mode)) {
-    debug_dbg(cfg, "Authentication file is not a regular file");
+    debug_warn(cfg, "Authentication file is not a regular file");
     goto err;
   }
 
@@ -739,7 +925,7 @@ int get_devices_from_authfile(const cfg_t *cfg, const char *username,
 
   gpu_ret = getpwuid_r(st.st_uid, &pw_s, buffer, sizeof(buffer), &pw);
   if (gpu_ret != 0 || pw == NULL) {
-    debug_dbg(cfg, "Unable to retrieve credentials for uid %u, (%s)", st.st_uid,
+    debug_err(cfg, "Unable to retrieve credentials for uid %u, (%s)", st.st_uid,
               strerror(errno));
     goto err;
   }
@@ -750,14 +936,14 @@ int get_devices_from_authfile(const cfg_t *cfg, const char *username,
                 "The owner of the authentication file is neither %s nor root",
                 username);
     } else {
-      debug_dbg(cfg, "The owner of the authentication file is not root");
+      debug_warn(cfg, "The owner of the authentication file is not root");
     }
     goto err;
   }
 
   opwfile = fdopen(fd, "r");
   if (opwfile == NULL) {
-    debug_dbg(cfg, "fdopen: %s", strerror(errno));
+    debug_err(cfg, "fdopen: %s", strerror(errno));
     goto err;
   } else {
     fd = -1; /* fd belongs to opwfile */
@@ -768,12 +954,30 @@ int get_devices_from_authfile(const cfg_t *cfg, const char *username,
       goto err;
     }
   } else {
+#ifdef NO_SSHFORMAT
+    (void) opwfile_size;
+    debug_warn(cfg, "SSH format is not supported by this build");
+    goto err;
+#else
     if (parse_ssh_format(cfg, opwfile, opwfile_size, devices, n_devs) != 1) {
       goto err;
     }
+#endif
+  }
+
+  if (migrated != NULL &&
+      !convert_legacy_line(cfg, username, devices, *n_devs, migrated))
+    debug_dbg(cfg, "Unable to convert the credentials of user %s", username);
+
+  if (*n_devs > 0 && (*n_devs = validate_devices(cfg, devices, *n_devs)) == 0) {
+    debug_warn(cfg, "No usable credentials for user %s", username);
+    r = PAM_AUTH_ERR;
+    goto err;
   }
 
-  debug_dbg(cfg, "Found %d device(s) for user %s", *n_devs, username);
+  debug_info(cfg, "Found %d device(s) for user %s", *n_devs, username);
+  if (st_p != NULL)
+    *st_p = st;
   r = PAM_SUCCESS;
 
 err:
@@ -782,6 +986,10 @@ err:
       reset_device(&devices[i]);
     }
     *n_devs = 0;
+    if (migrated != NULL) {
+      free(*migrated);
+      *migrated = NULL;
+    }
   } else if (*n_devs == 0) {
     r = cfg->nouserok ? PAM_IGNORE : PAM_USER_UNKNOWN;
   }
@@ -795,6 +1003,113 @@ err:
   return r;
 }
 
+/*
+ * Format a credential the way it appears on a native authfile line. Legacy
+ * credentials are converted to the current format, so that logins no longer
+ * need to decode the hex public key and convert the EC point. The "+appid"
+ * attribute retains their use of the appid as relying party ID.
+ */
+int format_native_credential(const device_t *device, char **out) {
+#ifndef NO_OLD_FORMAT
+  unsigned char point[OLD_PK_LEN];
+  unsigned char *kh = NULL;
+  size_t kh_len;
+  size_t point_len;
+  char *b64_kh = NULL;
+  char *b64_pk = NULL;
+  es256_pk_t *es256_pk = NULL;
+  int ok = 0;
+#endif
+
+  *out = NULL;
+
+  if (!device->old_format) {
+    char *b64_rp = NULL;
+    int n;
+
+    if (device->rpId != NULL &&
+        !b64_encode(device->rpId, strlen(device->rpId), &b64_rp))
+      return 0;
+    n = asprintf(out, "%s,%s,%s,%s%s%s", device->keyHandle, device->publicKey,
+                 device->coseType, device->attributes, b64_rp ? "," : "",
+                 b64_rp ? b64_rp : "");
+    free(b64_rp);
+    if (n == -1) {
+      *out = NULL;
+      return 0;
+    }
+    return 1;
+  }
+
+#ifdef NO_OLD_FORMAT
+  return 0;
+#else
+
+  /* Round-trip the key handle to obtain canonical padding. */
+  if (!b64_decode(device->keyHandle, (void **) &kh, &kh_len) ||
+      !b64_encode(kh, kh_len, &b64_kh))
+    goto err;
+
+  if (!hex_decode(device->publicKey, point, sizeof(point), &point_len) ||
+      point_len != OLD_PK_LEN || point[0] != POINT_CONVERSION_UNCOMPRESSED)
+    goto err;
+
+  /* Make sure the point is valid before dropping the EC conversion. */
+  if ((es256_pk = es256_pk_new()) == NULL ||
+      translate_old_format_pubkey(es256_pk, point, point_len) != FIDO_OK)
+    goto err;
+
+  /* Native es256 keys are stored as the raw x||y coordinates. */
+  if (!b64_encode(point + 1, point_len - 1, &b64_pk))
+    goto err;
+
+  if (asprintf(out, "%s,%s,es256,%s+appid", b64_kh, b64_pk,
+               device->attributes) == -1) {
+    *out = NULL;
+    goto err;
+  }
+
+  ok = 1;
+
+err:
+  es256_pk_free(&es256_pk);
+  free(kh);
+  free(b64_kh);
+  free(b64_pk);
+
+  return ok;
+#endif /* NO_OLD_FORMAT */
+}
+
+/*
+ * Stable identifier of a credential, the hash of its decoded key handle. The
+ * public key is hashed instead for resident credentials, whose key handles
+ * are not stored. Hashing the decoded bytes keeps the identifier independent
+ * of how the authfile spells them.
+ */
+int credential_id(const device_t *device, unsigned char id[CRED_ID_LEN]) {
+  unsigned char *buf = NULL;
+  size_t len;
+  int ok = 0;
+
+  if (is_resident(device->keyHandle)) {
+    if (device->old_format ||
+        !b64_decode(device->publicKey, (void **) &buf, &len))
+      goto err;
+  } else if (device->kh != NULL) {
+    return SHA256(device->kh, device->kh_len, id) != NULL;
+  } else if (!b64_decode(device->keyHandle, (void **) &buf, &len)) {
+    goto err;
+  }
+
+  ok = len > 0 && SHA256(buf, len, id) != NULL;
+
+err:
+  free(buf);
+
+  return ok;
+}
+
 void free_devices(device_t *devices, const unsigned n_devs) {
   unsigned i;
 
@@ -808,11 +1123,24 @@ void free_devices(device_t *devices, const unsigned n_devs) {
   free(devices);
 }
 
+static int dev_info_manifest(fido_dev_info_t *devlist, size_t ilen,
+                             size_t *olen) {
+#ifdef WITH_CTAP_TRACE
+  if (ctaptrace_replaying())
+    return ctaptrace_manifest(devlist, ilen, olen);
+#endif
+  return fido_dev_info_manifest(devlist, ilen, olen);
+}
+
 static int get_authenticators(const cfg_t *cfg, const fido_dev_info_t *devlist,
                               size_t devlist_len, fido_assert_t *assert,
-                              const int rk, fido_dev_t **authlist) {
+                              const int rk, const char *preferred,
+                              fido_dev_t **authlist, struct devlock *authlock,
+                              size_t *authidx) {
+  char ident[RKCACHE_IDENT_LEN];
   const fido_dev_info_t *di = NULL;
   fido_dev_t *dev = NULL;
+  struct devlock lock;
   int r;
   size_t i;
   size_t j;
@@ -828,30 +1156,61 @@ static int get_authenticators(const cfg_t *cfg, const fido_dev_info_t *devlist,
       continue;
     }
 
-    debug_dbg(cfg, "Authenticator path: %s", fido_dev_info_path(di));
+    debug_trace(cfg, "Authenticator path: %s", fido_dev_info_path(di));
 
     dev = fido_dev_new();
     if (!dev) {
-      debug_dbg(cfg, "Unable to allocate device type");
+      debug_err(cfg, "Unable to allocate device type");
+      continue;
+    }
+
+#ifdef WITH_CTAP_TRACE
+    if (!ctaptrace_attach(dev)) {
+      debug_dbg(cfg, "Unable to trace authenticator");
+      fido_dev_free(&dev);
+      continue;
+    }
+#endif
+
+    if (!devlock_acquire(cfg, DEVLOCK_DIR, fido_dev_info_path(di), &lock)) {
+      fido_dev_free(&dev);
       continue;
     }
 
     r = fido_dev_open(dev, fido_dev_info_path(di));
     if (r != FIDO_OK) {
-      debug_dbg(cfg, "Failed to open authenticator: %s (%d)", fido_strerr(r),
-                r);
+      debug_warn(cfg, "Failed to open authenticator: %s (%d)", fido_strerr(r),
+                 r);
       fido_dev_free(&dev);
+      devlock_release(&lock);
       continue;
     }
+    event_emit(cfg, EVENT_DEVICE_PROBED, 0, fido_dev_info_path(di));
 
     if (rk || cfg->nodetect) {
       /* resident credential or nodetect: try all authenticators */
-      authlist[j++] = dev;
+      authlist[j] = dev;
+      authlock[j] = lock;
+      authidx[j] = i;
+      /* the authenticator that last held the credential goes first */
+      if (preferred && j > 0 && rkcache_ident(di, ident, sizeof(ident)) &&
+          strcmp(ident, preferred) == 0) {
+        debug_dbg(cfg, "Trying authenticator %zu first", i);
+        authlist[j] = authlist[0];
+        authlock[j] = authlock[0];
+        authidx[j] = authidx[0];
+        authlist[0] = dev;
+        authlock[0] = lock;
+        authidx[0] = i;
+      }
+      j++;
     } else {
       r = fido_dev_get_assert(dev, assert, NULL);
       if ((!fido_dev_is_fido2(dev) && r == FIDO_ERR_USER_PRESENCE_REQUIRED) ||
           (fido_dev_is_fido2(dev) && r == FIDO_OK)) {
-        authlist[j++] = dev;
+        authlist[j] = dev;
+        authlock[j] = lock;
+        authidx[j++] = i;
         debug_dbg(cfg, "Found key in authenticator %zu", i);
         return (1);
       }
@@ -859,13 +1218,14 @@ static int get_authenticators(const cfg_t *cfg, const fido_dev_info_t *devlist,
 
       fido_dev_close(dev);
       fido_dev_free(&dev);
+      devlock_release(&lock);
     }
   }
 
   if (j != 0)
     return (1);
   else {
-    debug_dbg(cfg, "Key not found");
+    debug_warn(cfg, "Key not found");
     return (0);
   }
 }
@@ -973,10 +1333,17 @@ static int set_cdh(const cfg_t *cfg, fido_assert_t *assert) {
   int r;
 
   if (!random_bytes(cdh, sizeof(cdh))) {
-    debug_dbg(cfg, "Failed to generate challenge");
+    debug_err(cfg, "Failed to generate challenge");
     return 0;
   }
 
+#ifdef WITH_CTAP_TRACE
+  if (!ctaptrace_cdh(cdh, sizeof(cdh))) {
+    debug_dbg(cfg, "Failed to trace challenge");
+    return 0;
+  }
+#endif
+
   r = fido_assert_set_clientdata_hash(assert, cdh, sizeof(cdh));
   if (r != FIDO_OK) {
     debug_dbg(cfg, "Unable to set challenge: %s (%d)", fido_strerr(r), r);
@@ -986,39 +1353,32 @@ static int set_cdh(const cfg_t *cfg, fido_assert_t *assert) {
   return 1;
 }
 
-static fido_assert_t *prepare_assert(const cfg_t *cfg, const device_t *device,
-                                     const struct opts *opts) {
-  fido_assert_t *assert = NULL;
-  unsigned char *buf = NULL;
-  size_t buf_len;
+/*
+ * Point an assertion at a credential. The relying party is only set when it
+ * changes, so an assertion can serve as a template across credentials: only
+ * the allow list and the client data hash are refreshed. The key handle was
+ * decoded when the credential was validated.
+ */
+static int target_assert(const cfg_t *cfg, fido_assert_t *assert,
+                         const device_t *device, const struct opts *opts) {
+  const char *rp = credential_rp(cfg, device);
+  const char *cur = fido_assert_rp_id(assert);
   int ok = 0;
   int r;
 
-  if ((assert = fido_assert_new()) == NULL) {
-    debug_dbg(cfg, "Unable to allocate assertion");
-    goto err;
-  }
-
-  if (device->old_format)
-    r = fido_assert_set_rp(assert, cfg->appid);
-  else
-    r = fido_assert_set_rp(assert, cfg->origin);
-
-  if (r != FIDO_OK) {
-    debug_dbg(cfg, "Unable to set origin: %s (%d)", fido_strerr(r), r);
-    goto err;
+  if (cur == NULL || strcmp(cur, rp) != 0) {
+    r = fido_assert_set_rp(assert, rp);
+    if (r != FIDO_OK) {
+      debug_dbg(cfg, "Unable to set origin: %s (%d)", fido_strerr(r), r);
+      goto err;
+    }
   }
 
   if (is_resident(device->keyHandle)) {
     debug_dbg(cfg, "Credential is resident");
   } else {
-    debug_dbg(cfg, "Key handle: %s", device->keyHandle);
-    if (!b64_decode(device->keyHandle, (void **) &buf, &buf_len)) {
-      debug_dbg(cfg, "Failed to decode key handle");
-      goto err;
-    }
-
-    r = fido_assert_allow_cred(assert, buf, buf_len);
+    debug_trace(cfg, "Key handle: %s", device->keyHandle);
+    r = fido_assert_allow_cred(assert, device->kh, device->kh_len);
     if (r != FIDO_OK) {
       debug_dbg(cfg, "Unable to set keyHandle: %s (%d)", fido_strerr(r), r);
       goto err;
@@ -1038,32 +1398,71 @@ static fido_assert_t *prepare_assert(const cfg_t *cfg, const device_t *device,
   ok = 1;
 
 err:
-  if (!ok)
-    fido_assert_free(&assert);
+  return ok;
+}
 
-  free(buf);
+static fido_assert_t *prepare_assert(const cfg_t *cfg, const device_t *device,
+                                     const struct opts *opts) {
+  fido_assert_t *assert = NULL;
+
+  if ((assert = fido_assert_new()) == NULL) {
+    debug_err(cfg, "Unable to allocate assertion");
+    return NULL;
+  }
+
+  if (!target_assert(cfg, assert, device, opts))
+    fido_assert_free(&assert);
 
   return assert;
 }
 
-static void reset_pk(struct pk *pk) {
+/*
+ * Retarget an assertion used for a previous credential, falling back to a
+ * fresh one when libfido2 cannot clear the allow list.
+ */
+static fido_assert_t *reuse_assert(const cfg_t *cfg, fido_assert_t *assert,
+                                   const device_t *device,
+                                   const struct opts *opts) {
+#ifdef HAVE_FIDO_ASSERT_EMPTY_ALLOW_LIST
+  if (assert != NULL && fido_assert_empty_allow_list(assert) == FIDO_OK) {
+    if (target_assert(cfg, assert, device, opts))
+      return assert;
+    debug_dbg(cfg, "Unable to reuse assertion");
+  }
+#endif
+
+  fido_assert_free(&assert);
+
+  return prepare_assert(cfg, device, opts);
+}
+
+void reset_pk(struct pk *pk) {
   if (pk->type == COSE_ES256) {
     es256_pk_free((es256_pk_t **) &pk->ptr);
+#ifndef NO_RS256
   } else if (pk->type == COSE_RS256) {
     rs256_pk_free((rs256_pk_t **) &pk->ptr);
+#endif
+#ifndef NO_EDDSA
   } else if (pk->type == COSE_EDDSA) {
     eddsa_pk_free((eddsa_pk_t **) &pk->ptr);
+#endif
   }
   memset(pk, 0, sizeof(*pk));
 }
 
+/* Types compiled out are unknown, so that their credentials are rejected. */
 int cose_type(const char *str, int *type) {
   if (strcasecmp(str, "es256") == 0) {
     *type = COSE_ES256;
+#ifndef NO_RS256
   } else if (strcasecmp(str, "rs256") == 0) {
     *type = COSE_RS256;
+#endif
+#ifndef NO_EDDSA
   } else if (strcasecmp(str, "eddsa") == 0) {
     *type = COSE_EDDSA;
+#endif
   } else {
     *type = 0;
     return 0;
@@ -1087,6 +1486,9 @@ const char *cose_string(int type) {
 
 static int parse_pk(const cfg_t *cfg, int old, const char *type, const char *pk,
                     struct pk *out) {
+#ifndef NO_OLD_FORMAT
+  unsigned char point[OLD_PK_LEN];
+#endif
   unsigned char *buf = NULL;
   size_t buf_len;
   int ok = 0;
@@ -1095,12 +1497,17 @@ static int parse_pk(const cfg_t *cfg, int old, const char *type, const char *pk,
   reset_pk(out);
 
   if (old) {
-    if (!hex_decode(pk, &buf, &buf_len)) {
+#ifdef NO_OLD_FORMAT
+    debug_warn(cfg, "Old format credentials are not supported by this build");
+    goto err;
+#else
+    if (!hex_decode(pk, point, sizeof(point), &buf_len)) {
       debug_dbg(cfg, "Failed to decode public key");
       goto err;
     }
+#endif
   } else {
-    if (!b64_decode(pk, (void **) &buf, &buf_len)) {
+    if (!b64_decode(pk, (void **) &buf, &buf_len) || buf_len == 0) {
       debug_dbg(cfg, "Failed to decode public key");
       goto err;
     }
@@ -1111,39 +1518,47 @@ static int parse_pk(const cfg_t *cfg, int old, const char *type, const char *pk,
     goto err;
   }
 
-  // For backwards compatibility, failure to pack the public key is not
-  // returned as an error.  Instead, it is handled by fido_verify_assert().
   if (out->type == COSE_ES256) {
     if ((out->ptr = es256_pk_new()) == NULL) {
-      debug_dbg(cfg, "Failed to allocate ES256 public key");
+      debug_err(cfg, "Failed to allocate ES256 public key");
       goto err;
     }
+#ifndef NO_OLD_FORMAT
     if (old) {
-      r = translate_old_format_pubkey(out->ptr, buf, buf_len);
-    } else {
+      r = translate_old_format_pubkey(out->ptr, point, buf_len);
+    } else
+#endif
+    {
       r = es256_pk_from_ptr(out->ptr, buf, buf_len);
     }
     if (r != FIDO_OK) {
       debug_dbg(cfg, "Failed to convert ES256 public key");
+      goto err;
     }
+#ifndef NO_RS256
   } else if (out->type == COSE_RS256) {
     if ((out->ptr = rs256_pk_new()) == NULL) {
-      debug_dbg(cfg, "Failed to allocate RS256 public key");
+      debug_err(cfg, "Failed to allocate RS256 public key");
       goto err;
     }
     r = rs256_pk_from_ptr(out->ptr, buf, buf_len);
     if (r != FIDO_OK) {
       debug_dbg(cfg, "Failed to convert RS256 public key");
+      goto err;
     }
+#endif
+#ifndef NO_EDDSA
   } else if (out->type == COSE_EDDSA) {
     if ((out->ptr = eddsa_pk_new()) == NULL) {
-      debug_dbg(cfg, "Failed to allocate EDDSA public key");
+      debug_err(cfg, "Failed to allocate EDDSA public key");
       goto err;
     }
     r = eddsa_pk_from_ptr(out->ptr, buf, buf_len);
     if (r != FIDO_OK) {
       debug_dbg(cfg, "Failed to convert EDDSA public key");
+      goto err;
     }
+#endif
   } else {
     debug_dbg(cfg, "COSE type '%s' not handled", type);
     goto err;
@@ -1156,74 +1571,545 @@ err:
   return ok;
 }
 
-int do_authentication(const cfg_t *cfg, const device_t *devices,
-                      const unsigned n_devs, pam_handle_t *pamh) {
+/*
+ * Verify an assertion produced elsewhere, as pasted in manual mode, against a
+ * validated credential. The authenticator data is CBOR encoded, as printed by
+ * fido2-assert.
+ */
+int verify_assertion(const cfg_t *cfg, const device_t *device,
+                     const unsigned char *cdh, size_t cdh_len,
+                     const unsigned char *authdata, size_t authdata_len,
+                     const unsigned char *sig, size_t sig_len) {
   fido_assert_t *assert = NULL;
-  fido_dev_info_t *devlist = NULL;
-  fido_dev_t **authlist = NULL;
-  int cued = 0;
-  int r;
-  int retval = PAM_AUTH_ERR;
-  size_t ndevs = 0;
-  size_t ndevs_prev = 0;
-  unsigned i = 0;
   struct opts opts;
-  struct pk pk;
-  char *pin = NULL;
+  int ok = 0;
+  int r;
 
   init_opts(&opts);
-#ifndef WITH_FUZZING
-  fido_init(cfg->debug ? FIDO_DEBUG : 0);
-#else
-  fido_init(0);
-#endif
-  memset(&pk, 0, sizeof(pk));
+  parse_opts(cfg, device->attributes, &opts);
 
-  devlist = fido_dev_info_new(DEVLIST_LEN);
-  if (!devlist) {
-    debug_dbg(cfg, "Unable to allocate devlist");
-    goto out;
+  if ((assert = fido_assert_new()) == NULL) {
+    debug_err(cfg, "Unable to allocate assertion");
+    goto err;
+  }
+
+  if ((r = fido_assert_set_rp(assert, credential_rp(cfg, device))) !=
+        FIDO_OK ||
+      (r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len)) != FIDO_OK ||
+      (r = fido_assert_set_count(assert, 1)) != FIDO_OK ||
+      (r = fido_assert_set_authdata(assert, 0, authdata, authdata_len)) !=
+        FIDO_OK ||
+      (r = fido_assert_set_sig(assert, 0, sig, sig_len)) != FIDO_OK) {
+    debug_dbg(cfg, "Unable to set up assertion: %s (%d)", fido_strerr(r), r);
+    goto err;
   }
 
-  r = fido_dev_info_manifest(devlist, DEVLIST_LEN, &ndevs);
+  if (!set_opts(cfg, &opts, assert))
+    goto err;
+
+  r = fido_assert_verify(assert, 0, device->pk.type, device->pk.ptr);
   if (r != FIDO_OK) {
-    debug_dbg(cfg, "Unable to discover device(s), %s (%d)", fido_strerr(r), r);
-    goto out;
+    debug_dbg(cfg, "Assertion does not verify: %s (%d)", fido_strerr(r), r);
+    goto err;
   }
 
-  ndevs_prev = ndevs;
+  ok = 1;
+err:
+  fido_assert_free(&assert);
 
-  debug_dbg(cfg, "Device max index is %zu", ndevs);
+  return ok;
+}
 
-  authlist = calloc(DEVLIST_LEN + 1, sizeof(fido_dev_t *));
-  if (!authlist) {
-    debug_dbg(cfg, "Unable to allocate authenticator list");
-    goto out;
+/* Decode the key handle and public key of a credential, once. */
+static int validate_device(const cfg_t *cfg, device_t *device) {
+  if (!is_resident(device->keyHandle) &&
+      (!b64_decode(device->keyHandle, (void **) &device->kh,
+                   &device->kh_len) ||
+       device->kh_len == 0)) {
+    debug_dbg(cfg, "Failed to decode key handle");
+    return 0;
   }
 
-  if (cfg->nodetect)
-    debug_dbg(cfg, "nodetect option specified, suitable key detection will be "
+  return parse_pk(cfg, device->old_format, device->coseType, device->publicKey,
+                  &device->pk);
+}
+
+/*
+ * Decode every credential before any device I/O, so that a broken key handle
+ * or public key does not cost an enumeration cycle during authentication, and
+ * keep the result for the authentication paths. Invalid credentials are
+ * dropped; the remaining ones keep their order.
+ */
+unsigned validate_devices(const cfg_t *cfg, device_t *devices,
+                          unsigned n_devs) {
+  unsigned n = 0;
+
+  for (unsigned i = 0; i < n_devs; i++) {
+    if (!validate_device(cfg, &devices[i])) {
+      debug_warn(cfg, "Skipping invalid credential for device number %u",
+                 i + 1);
+      reset_device(&devices[i]);
+      continue;
+    }
+    if (n != i) {
+      devices[n] = devices[i];
+      memset(&devices[i], 0, sizeof(devices[i]));
+    }
+    n++;
+  }
+
+  return n;
+}
+
+/* Reject replayed or cloned assertions, if a counter store is configured. */
+static int check_sigcount(const cfg_t *cfg, const device_t *device,
+                          const fido_assert_t *assert) {
+  if (cfg->sigcount_file == NULL)
+    return 1;
+
+  if (!credtab_update(cfg, device, fido_assert_sigcount(assert, 0))) {
+    debug_warn(cfg, "Signature counter check failed");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Account for a successful authentication, if a usage table is configured. */
+static void record_use(const cfg_t *cfg, const device_t *device) {
+  if (cfg->usage_file != NULL &&
+      !credtab_record_use(cfg, device, (uint64_t) time(NULL)))
+    debug_dbg(cfg, "Unable to record the use of the credential");
+}
+
+/* Record which authenticator holds a resident credential, if it changed. */
+static void remember_authenticator(const cfg_t *cfg, const device_t *device,
+                                   const fido_dev_info_t *devlist, size_t idx,
+                                   const char *previous) {
+  const fido_dev_info_t *di;
+  char ident[RKCACHE_IDENT_LEN];
+
+  if ((di = fido_dev_info_ptr(devlist, idx)) == NULL ||
+      !rkcache_ident(di, ident, sizeof(ident)))
+    return;
+
+  if (previous == NULL || strcmp(ident, previous) != 0)
+    rkcache_store(cfg, device, ident);
+}
+
+/*
+ * The outcome of enumerating authenticators and probing them for a credential:
+ * the authenticators that may hold credential number cred + 1, and the
+ * assertion targeting it.
+ */
+struct discovery {
+  fido_dev_info_t *devlist;
+  size_t ndevs;
+  fido_dev_t **authlist;
+  struct devlock authlock[DEVLIST_LEN + 1];
+  size_t authidx[DEVLIST_LEN + 1];
+  fido_assert_t *assert;
+  unsigned cred;
+};
+
+static void free_authlist(fido_dev_t **authlist, struct devlock *authlock) {
+  if (authlist == NULL)
+    return;
+
+  for (size_t j = 0; authlist[j] != NULL; j++) {
+    fido_dev_close(authlist[j]);
+    fido_dev_free(&authlist[j]);
+    devlock_release(&authlock[j]);
+  }
+}
+
+/*
+ * Release the locks taken while probing, leaving the authenticators open, so
+ * that other logins may use them while the user is being prompted.
+ */
+static void unlock_discovery(struct discovery *disc) {
+  for (size_t j = 0; disc->authlist[j] != NULL; j++)
+    devlock_release(&disc->authlock[j]);
+}
+
+/*
+ * Lock the authenticators of a discovery again before using them, dropping
+ * those that stay busy. Returns whether any is left.
+ */
+static int relock_discovery(const cfg_t *cfg, struct discovery *disc) {
+  const fido_dev_info_t *di;
+  size_t j, k, n;
+
+  for (j = 0, k = 0; disc->authlist[j] != NULL; j++) {
+    di = fido_dev_info_ptr(disc->devlist, disc->authidx[j]);
+    if (!devlock_acquire(cfg, DEVLOCK_DIR, di ? fido_dev_info_path(di) : NULL,
+                         &disc->authlock[j])) {
+      fido_dev_close(disc->authlist[j]);
+      fido_dev_free(&disc->authlist[j]);
+      continue;
+    }
+    disc->authlist[k] = disc->authlist[j];
+    disc->authlock[k] = disc->authlock[j];
+    disc->authidx[k++] = disc->authidx[j];
+  }
+  /* busy slots were freed to NULL, so clear up to the original count */
+  for (n = j, j = k; j < n; j++)
+    disc->authlist[j] = NULL;
+
+  return k != 0;
+}
+
+static void reset_discovery(struct discovery *disc) {
+  fido_assert_free(&disc->assert);
+  fido_dev_info_free(&disc->devlist, disc->ndevs);
+  free_authlist(disc->authlist, disc->authlock);
+  free(disc->authlist);
+  memset(disc, 0, sizeof(*disc));
+}
+
+/*
+ * An aborted login cancels the assertion in flight. Otherwise the
+ * authenticator keeps waiting for a touch until it times out, busy for the
+ * next login. A watcher thread polls for the parent going away and for a
+ * hangup of the terminal the conversation runs on. sshd instead terminates
+ * the process running PAM with SIGTERM when the client disconnects or
+ * LoginGraceTime expires, so SIGTERM and SIGHUP are caught while a request
+ * is in flight, unless ignored, and passed on to the watcher through its
+ * pipe. The application's dispositions are restored as soon as the request
+ * returns, and a caught signal is raised again once the authenticators are
+ * closed.
+ */
+#define WATCH_POLL_MS 100
+
+static const int abort_signals[] = {SIGTERM, SIGHUP};
+#define N_ABORT_SIGNALS (sizeof(abort_signals) / sizeof(abort_signals[0]))
+
+/* write end of the pipe of the watcher with a request in flight */
+static volatile sig_atomic_t abort_fd = -1;
+
+struct watcher {
+  const cfg_t *cfg;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+  int stop;
+  int aborted;
+  int sig; /* caught, to be raised again */
+  pid_t ppid;
+  int tty;         /* terminal of the conversation, or -1 */
+  int wake[2];     /* signals caught, 0 when stopping */
+  fido_dev_t *dev; /* in flight */
+  int catching;
+  int caught[N_ABORT_SIGNALS];
+  struct sigaction old[N_ABORT_SIGNALS];
+};
+
+static void abort_handler(int sig) {
+  unsigned char c = (unsigned char) sig;
+  int saved = errno;
+  int fd = abort_fd;
+
+  if (fd != -1)
+    (void) !write(fd, &c, 1);
+  errno = saved;
+}
+
+static void catch_abort_signals(struct watcher *w) {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = abort_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  abort_fd = w->wake[1];
+  for (size_t k = 0; k < N_ABORT_SIGNALS; k++)
+    w->caught[k] = sigaction(abort_signals[k], NULL, &w->old[k]) == 0 &&
+                   w->old[k].sa_handler != SIG_IGN &&
+                   sigaction(abort_signals[k], &sa, NULL) == 0;
+  w->catching = 1;
+}
+
+static void release_abort_signals(struct watcher *w) {
+  if (!w->catching)
+    return;
+
+  for (size_t k = 0; k < N_ABORT_SIGNALS; k++)
+    if (w->caught[k])
+      (void) sigaction(abort_signals[k], &w->old[k], NULL);
+  abort_fd = -1;
+  w->catching = 0;
+}
+
+/* Collect the signals caught so far, with the watcher locked or stopped. */
+static void drain_wake_pipe(struct watcher *w) {
+  unsigned char c;
+
+  while (read(w->wake[0], &c, 1) == 1)
+    if (c != 0)
+      w->sig = c;
+}
+
+static int login_gone(const struct watcher *w) {
+  struct pollfd pfd;
+
+  if (getppid() != w->ppid)
+    return 1;
+  if (w->tty == -1)
+    return 0;
+
+  pfd.fd = w->tty;
+  pfd.events = 0; /* errors only, input is left to the conversation */
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, 0) == 1 &&
+         (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+static void *watcher_run(void *arg) {
+  struct watcher *w = arg;
+  struct pollfd pfd;
+
+  pfd.fd = w->wake[0];
+  pfd.events = POLLIN;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->stop) {
+    drain_wake_pipe(w);
+    if (!w->aborted && (w->sig != 0 || login_gone(w))) {
+      w->aborted = 1;
+      debug_info(w->cfg, "Login aborted, cancelling");
+      if (w->dev != NULL)
+        fido_dev_cancel(w->dev);
+    }
+    pthread_mutex_unlock(&w->lock);
+    (void) poll(&pfd, 1, WATCH_POLL_MS);
+    pthread_mutex_lock(&w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+static int open_wake_pipe(struct watcher *w) {
+  if (pipe(w->wake) == -1) {
+    w->wake[0] = w->wake[1] = -1;
+    return 0;
+  }
+
+  for (int k = 0; k < 2; k++) {
+    if (fcntl(w->wake[k], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(w->wake[k], F_SETFL, O_NONBLOCK) == -1) {
+      close(w->wake[0]);
+      close(w->wake[1]);
+      w->wake[0] = w->wake[1] = -1;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void watcher_start(struct watcher *w, const cfg_t *cfg) {
+  int r;
+
+  memset(w, 0, sizeof(*w));
+  w->cfg = cfg;
+  w->ppid = getppid();
+  w->tty = isatty(STDIN_FILENO) ? STDIN_FILENO : -1;
+  w->wake[0] = w->wake[1] = -1;
+
+#ifndef WITH_FUZZING
+  if (!open_wake_pipe(w)) {
+    debug_dbg(cfg, "Unable to watch for aborted logins: %s", strerror(errno));
+    return;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  if ((r = pthread_create(&w->thread, NULL, watcher_run, w)) != 0) {
+    debug_dbg(cfg, "Unable to watch for aborted logins: %s", strerror(r));
+    pthread_mutex_destroy(&w->lock);
+    close(w->wake[0]);
+    close(w->wake[1]);
+    w->wake[0] = w->wake[1] = -1;
+    return;
+  }
+  w->running = 1;
+#else
+  (void) r;
+#endif
+}
+
+static void watcher_stop(struct watcher *w) {
+  unsigned char c = 0;
+
+  release_abort_signals(w);
+
+  if (w->running) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_mutex_unlock(&w->lock);
+    (void) !write(w->wake[1], &c, 1);
+    pthread_join(w->thread, NULL);
+    drain_wake_pipe(w);
+    pthread_mutex_destroy(&w->lock);
+    w->running = 0;
+  }
+
+  if (w->wake[0] != -1) {
+    close(w->wake[0]);
+    close(w->wake[1]);
+    w->wake[0] = w->wake[1] = -1;
+  }
+
+  if (w->sig != 0) {
+    /* the application's disposition is back in place */
+    debug_dbg(w->cfg, "Raising signal %d again", w->sig);
+    raise(w->sig);
+  }
+}
+
+/*
+ * Mark an authenticator as in flight, catching the abort signals, or none
+ * when dev is NULL. Returns 1 if the login was aborted.
+ */
+static int watch_device(struct watcher *w, fido_dev_t *dev) {
+  int aborted;
+
+  if (!w->running)
+    return 0;
+
+  if (dev == NULL)
+    release_abort_signals(w);
+
+  pthread_mutex_lock(&w->lock);
+  aborted = w->aborted;
+  w->dev = aborted ? NULL : dev;
+  pthread_mutex_unlock(&w->lock);
+
+  if (dev != NULL && !aborted)
+    catch_abort_signals(w);
+
+  return aborted;
+}
+
+static void init_fido(const cfg_t *cfg) {
+#ifndef WITH_FUZZING
+  fido_init(cfg->debug >= DEBUG_LVL_TRACE ? FIDO_DEBUG : 0);
+#else
+  (void) cfg;
+  fido_init(0);
+#endif
+}
+
+/*
+ * Authenticate against the credentials in order, starting from a previous
+ * discovery if one is given, which is consumed.
+ */
+static int authenticate(const cfg_t *cfg, const device_t *devices,
+                        const unsigned n_devs, pam_handle_t *pamh,
+                        struct discovery *disc) {
+  fido_assert_t *assert = NULL;
+  fido_dev_info_t *devlist = NULL;
+  fido_dev_t **authlist = NULL;
+  struct devlock authlock[DEVLIST_LEN + 1];
+  size_t authidx[DEVLIST_LEN + 1];
+  char preferred[RKCACHE_IDENT_LEN];
+  int have_preferred;
+  int discovered = 0;
+  int cued = 0;
+  int rk;
+  int r;
+  int retval = PAM_AUTH_ERR;
+  size_t ndevs = 0;
+  size_t ndevs_prev = 0;
+  unsigned i = 0;
+  struct opts opts;
+  struct watcher watch;
+  const fido_dev_info_t *di;
+  const char *path;
+  char *pin = NULL;
+
+  init_opts(&opts);
+  init_fido(cfg);
+  memset(&watch, 0, sizeof(watch));
+
+  if (disc != NULL && !relock_discovery(cfg, disc))
+    debug_dbg(cfg, "Authenticator(s) discovered in the background are busy");
+
+  if (disc != NULL && disc->authlist[0] != NULL) {
+    /* take over the authenticators found while waiting for the user */
+    devlist = disc->devlist;
+    ndevs = disc->ndevs;
+    authlist = disc->authlist;
+    memcpy(authlock, disc->authlock, sizeof(authlock));
+    memcpy(authidx, disc->authidx, sizeof(authidx));
+    assert = disc->assert;
+    i = disc->cred;
+    memset(disc, 0, sizeof(*disc));
+    discovered = 1;
+    debug_dbg(cfg, "Using authenticator(s) discovered in the background");
+  } else {
+#ifdef WITH_CTAP_TRACE
+    if (!ctaptrace_begin(cfg))
+      goto out;
+#endif
+
+    devlist = fido_dev_info_new(DEVLIST_LEN);
+    if (!devlist) {
+      debug_err(cfg, "Unable to allocate devlist");
+      goto out;
+    }
+
+    r = dev_info_manifest(devlist, DEVLIST_LEN, &ndevs);
+    if (r != FIDO_OK) {
+      debug_err(cfg, "Unable to discover device(s), %s (%d)", fido_strerr(r),
+                r);
+      goto out;
+    }
+
+    authlist = calloc(DEVLIST_LEN + 1, sizeof(fido_dev_t *));
+    if (!authlist) {
+      debug_err(cfg, "Unable to allocate authenticator list");
+      goto out;
+    }
+  }
+
+  ndevs_prev = ndevs;
+
+  debug_trace(cfg, "Device max index is %zu", ndevs);
+
+  if (cfg->nodetect)
+    debug_dbg(cfg, "nodetect option specified, suitable key detection will be "
                    "skipped");
 
-  i = 0;
+  watcher_start(&watch, cfg);
+
   while (i < n_devs) {
     debug_dbg(cfg, "Attempting authentication with device number %d", i + 1);
 
-    init_opts(&opts); /* used during authenticator discovery */
-    assert = prepare_assert(cfg, &devices[i], &opts);
-    if (assert == NULL) {
-      debug_dbg(cfg, "Failed to prepare assert");
+    if (watch_device(&watch, NULL))
       goto out;
-    }
 
-    if (!parse_pk(cfg, devices[i].old_format, devices[i].coseType,
-                  devices[i].publicKey, &pk)) {
-      debug_dbg(cfg, "Failed to parse public key");
-      goto out;
+    if (!discovered) {
+      init_opts(&opts); /* used during authenticator discovery */
+      assert = reuse_assert(cfg, assert, &devices[i], &opts);
+      if (assert == NULL) {
+        debug_dbg(cfg, "Failed to prepare assert");
+        goto out;
+      }
     }
 
-    if (get_authenticators(cfg, devlist, ndevs, assert,
-                           is_resident(devices[i].keyHandle), authlist)) {
+    rk = is_resident(devices[i].keyHandle);
+    have_preferred = rk && cfg->rk_cache &&
+                     rkcache_lookup(cfg, &devices[i], preferred,
+                                    sizeof(preferred));
+
+    if (discovered ||
+        get_authenticators(cfg, devlist, ndevs, assert, rk,
+                           have_preferred ? preferred : NULL, authlist,
+                           authlock, authidx)) {
+      discovered = 0;
       for (size_t j = 0; authlist[j] != NULL; j++) {
         /* options used during authentication */
         parse_opts(cfg, devices[i].attributes, &opts);
@@ -1246,7 +2132,10 @@ int do_authentication(const cfg_t *cfg, const device_t *devices,
           goto out;
         }
 
+        di = fido_dev_info_ptr(devlist, authidx[j]);
+        path = di != NULL ? fido_dev_info_path(di) : NULL;
         if (opts.pin == FIDO_OPT_TRUE) {
+          event_emit(cfg, EVENT_PIN_REQUESTED, i + 1, path);
           pin = converse(pamh, PAM_PROMPT_ECHO_OFF, "Please enter the PIN: ");
           if (pin == NULL) {
             debug_dbg(cfg, "converse() returned NULL");
@@ -1254,18 +2143,25 @@ int do_authentication(const cfg_t *cfg, const device_t *devices,
           }
         }
         if (opts.up == FIDO_OPT_TRUE || opts.uv == FIDO_OPT_TRUE) {
+          event_emit(cfg, EVENT_TOUCH_REQUESTED, i + 1, path);
           if (cfg->manual == 0 && cfg->cue && !cued) {
             cued = 1;
             converse(pamh, PAM_TEXT_INFO,
                      cfg->cue_prompt != NULL ? cfg->cue_prompt : DEFAULT_CUE);
           }
         }
+        if (watch_device(&watch, authlist[j]))
+          goto out;
         r = fido_dev_get_assert(authlist[j], assert, pin);
         if (pin) {
           explicit_bzero(pin, strlen(pin));
           free(pin);
           pin = NULL;
         }
+        if (watch_device(&watch, NULL)) {
+          debug_info(cfg, "Authentication cancelled");
+          goto out;
+        }
         if (r == FIDO_OK) {
           if (opts.pin == FIDO_OPT_TRUE || opts.uv == FIDO_OPT_TRUE) {
             r = fido_assert_set_uv(assert, FIDO_OPT_TRUE);
@@ -1274,15 +2170,23 @@ int do_authentication(const cfg_t *cfg, const device_t *devices,
               goto out;
             }
           }
-          r = fido_assert_verify(assert, 0, pk.type, pk.ptr);
+          r = fido_assert_verify(assert, 0, devices[i].pk.type,
+                                 devices[i].pk.ptr);
           if (r == FIDO_OK) {
-            retval = PAM_SUCCESS;
+            if (check_sigcount(cfg, &devices[i], assert)) {
+              debug_info(cfg, "Authenticated with device number %u", i + 1);
+              retval = PAM_SUCCESS;
+              record_use(cfg, &devices[i]);
+              if (rk && cfg->rk_cache)
+                remember_authenticator(cfg, &devices[i], devlist, authidx[j],
+                                       have_preferred ? preferred : NULL);
+            }
             goto out;
           }
         }
       }
     } else {
-      debug_dbg(cfg, "Device for this keyhandle is not present");
+      debug_warn(cfg, "Device for this keyhandle is not present");
     }
 
     i++;
@@ -1291,13 +2195,13 @@ int do_authentication(const cfg_t *cfg, const device_t *devices,
 
     devlist = fido_dev_info_new(DEVLIST_LEN);
     if (!devlist) {
-      debug_dbg(cfg, "Unable to allocate devlist");
+      debug_err(cfg, "Unable to allocate devlist");
       goto out;
     }
 
-    r = fido_dev_info_manifest(devlist, DEVLIST_LEN, &ndevs);
+    r = dev_info_manifest(devlist, DEVLIST_LEN, &ndevs);
     if (r != FIDO_OK) {
-      debug_dbg(cfg, "Unable to discover device(s), %s (%d)", fido_strerr(r),
+      debug_err(cfg, "Unable to discover device(s), %s (%d)", fido_strerr(r),
                 r);
       goto out;
     }
@@ -1310,38 +2214,230 @@ int do_authentication(const cfg_t *cfg, const device_t *devices,
       i = 0;
     }
 
-    for (size_t j = 0; authlist[j] != NULL; j++) {
-      fido_dev_close(authlist[j]);
-      fido_dev_free(&authlist[j]);
-    }
-
-    fido_assert_free(&assert);
+    free_authlist(authlist, authlock);
   }
 
 out:
-  reset_pk(&pk);
+  if (pin) {
+    explicit_bzero(pin, strlen(pin));
+    free(pin);
+  }
   fido_assert_free(&assert);
   fido_dev_info_free(&devlist, ndevs);
+  free_authlist(authlist, authlock);
+  free(authlist);
+
+#ifdef WITH_CTAP_TRACE
+  ctaptrace_end();
+#endif
+
+  watcher_stop(&watch);
+
+  return retval;
+}
+
+int do_authentication(const cfg_t *cfg, const device_t *devices,
+                      const unsigned n_devs, pam_handle_t *pamh) {
+  return authenticate(cfg, devices, n_devs, pamh, NULL);
+}
+
+/*
+ * Count the attached authenticators without opening any of them. Returns 1
+ * on success.
+ */
+int count_authenticators(const cfg_t *cfg, size_t *n) {
+  fido_dev_info_t *devlist = NULL;
+  int r;
+
+  *n = 0;
+  init_fido(cfg);
+
+  if ((devlist = fido_dev_info_new(DEVLIST_LEN)) == NULL) {
+    debug_err(cfg, "Unable to allocate devlist");
+    return 0;
+  }
+
+  r = dev_info_manifest(devlist, DEVLIST_LEN, n);
+  if (r != FIDO_OK)
+    debug_err(cfg, "Unable to discover device(s), %s (%d)", fido_strerr(r), r);
 
-  if (authlist) {
-    for (size_t j = 0; authlist[j] != NULL; j++) {
-      fido_dev_close(authlist[j]);
-      fido_dev_free(&authlist[j]);
+  fido_dev_info_free(&devlist, DEVLIST_LEN);
+
+  return r == FIDO_OK;
+}
+
+#define DISCOVERY_POLL_MS 250
+
+/*
+ * Background discovery while the interactive prompt waits for the user. The
+ * worker owns disc until it is joined.
+ */
+struct discoverer {
+  const cfg_t *cfg;
+  const device_t *devices;
+  unsigned n_devs;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int found;
+  struct discovery disc;
+};
+
+/* Wait up to ms milliseconds for the prompt to return. */
+static int discoverer_stopped(struct discoverer *d, long ms) {
+  struct timespec ts;
+  int stop;
+
+  pthread_mutex_lock(&d->lock);
+  if (!d->stop && ms > 0 && clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
     }
-    free(authlist);
+    while (!d->stop && pthread_cond_timedwait(&d->cond, &d->lock, &ts) == 0)
+      ;
   }
+  stop = d->stop;
+  pthread_mutex_unlock(&d->lock);
 
-  return retval;
+  return stop;
 }
 
+/* Probe the enumerated authenticators for the credentials, in order. */
+static int discover(struct discoverer *d) {
+  const cfg_t *cfg = d->cfg;
+  struct discovery *disc = &d->disc;
+  char preferred[RKCACHE_IDENT_LEN];
+  struct opts opts;
+  int have_preferred;
+  int rk;
+
+  for (unsigned i = 0; i < d->n_devs && !discoverer_stopped(d, 0); i++) {
+    init_opts(&opts);
+    disc->assert =
+      reuse_assert(cfg, disc->assert, &d->devices[i], &opts);
+    if (disc->assert == NULL)
+      return -1;
+
+    rk = is_resident(d->devices[i].keyHandle);
+    have_preferred = rk && cfg->rk_cache &&
+                     rkcache_lookup(cfg, &d->devices[i], preferred,
+                                    sizeof(preferred));
+
+    if (get_authenticators(cfg, disc->devlist, disc->ndevs, disc->assert, rk,
+                           have_preferred ? preferred : NULL, disc->authlist,
+                           disc->authlock, disc->authidx)) {
+      disc->cred = i;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Enumerate authenticators until the prompt returns, probing them again
+ * whenever their number changes, e.g. once the user inserted one.
+ */
+static void *discoverer_run(void *arg) {
+  struct discoverer *d = arg;
+  struct discovery *disc = &d->disc;
+  size_t ndevs_prev = SIZE_MAX;
+  int r;
+
+  if ((disc->authlist = calloc(DEVLIST_LEN + 1, sizeof(fido_dev_t *))) ==
+      NULL)
+    return NULL;
+
+  do {
+    fido_dev_info_free(&disc->devlist, disc->ndevs);
+    disc->ndevs = 0;
+    if ((disc->devlist = fido_dev_info_new(DEVLIST_LEN)) == NULL ||
+        dev_info_manifest(disc->devlist, DEVLIST_LEN, &disc->ndevs) != FIDO_OK)
+      break;
+    if (disc->ndevs != ndevs_prev) {
+      ndevs_prev = disc->ndevs;
+      if ((r = discover(d)) != 0) {
+        if ((d->found = r > 0))
+          unlock_discovery(disc);
+        break;
+      }
+    }
+  } while (!discoverer_stopped(d, DISCOVERY_POLL_MS));
+
+  return NULL;
+}
+
+static void interactive_prompt(pam_handle_t *pamh, const cfg_t *cfg) {
+  char *tmp = NULL;
+
+  tmp = converse(pamh, PAM_PROMPT_ECHO_ON,
+                 cfg->prompt != NULL ? cfg->prompt : DEFAULT_PROMPT);
+
+  free(tmp);
+}
+
+/*
+ * Prompt the user before authenticating, discovering authenticators in the
+ * meantime so that the touch request goes out as soon as the user confirms.
+ */
+int do_interactive_authentication(const cfg_t *cfg, const device_t *devices,
+                                  const unsigned n_devs, pam_handle_t *pamh) {
+  struct discoverer d;
+  int background = 1;
+  int r;
+
+#if defined(WITH_FUZZING)
+  background = 0;
+#elif defined(WITH_CTAP_TRACE)
+  /* traces must replay in the order they were recorded */
+  background = cfg->ctap_record == NULL && cfg->ctap_replay == NULL;
+#endif
+
+  memset(&d, 0, sizeof(d));
+  d.cfg = cfg;
+  d.devices = devices;
+  d.n_devs = n_devs;
+
+  if (background) {
+    init_fido(cfg);
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    if ((r = pthread_create(&d.thread, NULL, discoverer_run, &d)) != 0) {
+      debug_warn(cfg, "Unable to start discovery: %s", strerror(r));
+      pthread_cond_destroy(&d.cond);
+      pthread_mutex_destroy(&d.lock);
+      background = 0;
+    }
+  }
+
+  interactive_prompt(pamh, cfg);
+
+  if (background) {
+    pthread_mutex_lock(&d.lock);
+    d.stop = 1;
+    pthread_cond_signal(&d.cond);
+    pthread_mutex_unlock(&d.lock);
+    pthread_join(d.thread, NULL);
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.lock);
+  }
+
+  r = authenticate(cfg, devices, n_devs, pamh, d.found ? &d.disc : NULL);
+  reset_discovery(&d.disc);
+
+  return r;
+}
+
+#ifndef NO_MANUAL
 #define MAX_PROMPT_LEN (1024)
 
-static int manual_get_assert(const cfg_t *cfg, const char *prompt,
-                             pam_handle_t *pamh, fido_assert_t *assert) {
-  char *b64_cdh = NULL;
-  char *b64_rpid = NULL;
-  char *b64_authdata = NULL;
-  char *b64_sig = NULL;
+/* Fill an assertion with the authenticator data and signature of a response. */
+static int manual_set_response(const cfg_t *cfg, fido_assert_t *assert,
+                               const char *b64_authdata, const char *b64_sig) {
   unsigned char *authdata = NULL;
   unsigned char *sig = NULL;
   size_t authdata_len;
@@ -1349,11 +2445,6 @@ static int manual_get_assert(const cfg_t *cfg, const char *prompt,
   int r;
   int ok = 0;
 
-  b64_cdh = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
-  b64_rpid = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
-  b64_authdata = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
-  b64_sig = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
-
   if (!b64_decode(b64_authdata, (void **) &authdata, &authdata_len)) {
     debug_dbg(cfg, "Failed to decode authenticator data");
     goto err;
@@ -1384,23 +2475,74 @@ static int manual_get_assert(const cfg_t *cfg, const char *prompt,
 
   ok = 1;
 err:
+  free(authdata);
+  free(sig);
+
+  return ok;
+}
+
+static int manual_get_assert(const cfg_t *cfg, const char *prompt,
+                             pam_handle_t *pamh, fido_assert_t *assert) {
+  char *b64_cdh = NULL;
+  char *b64_rpid = NULL;
+  char *b64_authdata = NULL;
+  char *b64_sig = NULL;
+  int ok;
+
+  b64_cdh = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
+  b64_rpid = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
+  b64_authdata = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
+  b64_sig = converse(pamh, PAM_PROMPT_ECHO_ON, prompt);
+
+  ok = manual_set_response(cfg, assert, b64_authdata, b64_sig);
+
   free(b64_cdh);
   free(b64_rpid);
   free(b64_authdata);
   free(b64_sig);
-  free(authdata);
-  free(sig);
+
+  return ok;
+}
+
+static int manual_print_challenge(const cfg_t *cfg, pam_handle_t *pamh,
+                                  const device_t *device,
+                                  const fido_assert_t *assert,
+                                  const char *label) {
+  char *b64_challenge = NULL;
+  char buf[MAX_PROMPT_LEN];
+  int n;
+  int ok = 0;
+
+  if (!b64_encode(fido_assert_clientdata_hash_ptr(assert),
+                  fido_assert_clientdata_hash_len(assert), &b64_challenge)) {
+    debug_dbg(cfg, "Failed to encode challenge");
+    goto err;
+  }
+
+  debug_trace(cfg, "Challenge: %s", b64_challenge);
+
+  converse(pamh, PAM_TEXT_INFO, label);
+
+  n = snprintf(buf, sizeof(buf), "%s\n%s\n%s", b64_challenge,
+               credential_rp(cfg, device), device->keyHandle);
+  if (n <= 0 || (size_t) n >= sizeof(buf)) {
+    debug_dbg(cfg, "Failed to print fido2-assert input string");
+    goto err;
+  }
+
+  converse(pamh, PAM_TEXT_INFO, buf);
+
+  ok = 1;
+err:
+  free(b64_challenge);
 
   return ok;
 }
 
 int do_manual_authentication(const cfg_t *cfg, const device_t *devices,
                              const unsigned n_devs, pam_handle_t *pamh) {
-  fido_assert_t *assert[n_devs];
-  struct pk pk[n_devs];
-  char *b64_challenge = NULL;
+  fido_assert_t **assert = NULL;
   char prompt[MAX_PROMPT_LEN];
-  char buf[MAX_PROMPT_LEN];
   int retval = PAM_AUTH_ERR;
   int n;
   int r;
@@ -1408,11 +2550,14 @@ int do_manual_authentication(const cfg_t *cfg, const device_t *devices,
   struct opts opts;
 
   init_opts(&opts);
-  memset(assert, 0, sizeof(assert));
-  memset(pk, 0, sizeof(pk));
+
+  if (n_devs == 0 || (assert = calloc(n_devs, sizeof(*assert))) == NULL) {
+    debug_err(cfg, "Unable to allocate memory");
+    goto out;
+  }
 
 #ifndef WITH_FUZZING
-  fido_init(cfg->debug ? FIDO_DEBUG : 0);
+  fido_init(cfg->debug >= DEBUG_LVL_TRACE ? FIDO_DEBUG : 0);
 #else
   fido_init(0);
 #endif
@@ -1428,40 +2573,14 @@ int do_manual_authentication(const cfg_t *cfg, const device_t *devices,
 
     debug_dbg(cfg, "Attempting authentication with device number %d", i + 1);
 
-    if (!parse_pk(cfg, devices[i].old_format, devices[i].coseType,
-                  devices[i].publicKey, &pk[i])) {
-      debug_dbg(cfg, "Unable to parse public key %u", i);
-      goto out;
-    }
-
-    if (!b64_encode(fido_assert_clientdata_hash_ptr(assert[i]),
-                    fido_assert_clientdata_hash_len(assert[i]),
-                    &b64_challenge)) {
-      debug_dbg(cfg, "Failed to encode challenge");
-      goto out;
-    }
-
-    debug_dbg(cfg, "Challenge: %s", b64_challenge);
-
     n = snprintf(prompt, sizeof(prompt), "Challenge #%u:", i + 1);
     if (n <= 0 || (size_t) n >= sizeof(prompt)) {
       debug_dbg(cfg, "Failed to print challenge prompt");
       goto out;
     }
 
-    converse(pamh, PAM_TEXT_INFO, prompt);
-
-    n = snprintf(buf, sizeof(buf), "%s\n%s\n%s", b64_challenge, cfg->origin,
-                 devices[i].keyHandle);
-    if (n <= 0 || (size_t) n >= sizeof(buf)) {
-      debug_dbg(cfg, "Failed to print fido2-assert input string");
+    if (!manual_print_challenge(cfg, pamh, &devices[i], assert[i], prompt))
       goto out;
-    }
-
-    converse(pamh, PAM_TEXT_INFO, buf);
-
-    free(b64_challenge);
-    b64_challenge = NULL;
   }
 
   converse(pamh, PAM_TEXT_INFO,
@@ -1480,23 +2599,217 @@ int do_manual_authentication(const cfg_t *cfg, const device_t *devices,
       goto out;
     }
 
-    r = fido_assert_verify(assert[i], 0, pk[i].type, pk[i].ptr);
+    r = fido_assert_verify(assert[i], 0, devices[i].pk.type,
+                           devices[i].pk.ptr);
     if (r == FIDO_OK) {
-      retval = PAM_SUCCESS;
+      if (check_sigcount(cfg, &devices[i], assert[i])) {
+        retval = PAM_SUCCESS;
+        record_use(cfg, &devices[i]);
+      }
       break;
     }
   }
 
 out:
+  if (assert) {
+    for (i = 0; i < n_devs; i++)
+      fido_assert_free(&assert[i]);
+    free(assert);
+  }
+
+  return retval;
+}
+
+struct cred_index {
+  uint32_t id;
+  unsigned idx;
+};
+
+static int cmp_cred_index(const void *a, const void *b) {
+  const struct cred_index *x = a;
+  const struct cred_index *y = b;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int parse_short_id(const char *s, uint32_t *id) {
+  unsigned char bytes[CRED_SHORT_ID_LEN / 2];
+  size_t len;
+
+  if (strlen(s) != CRED_SHORT_ID_LEN ||
+      !hex_decode(s, bytes, sizeof(bytes), &len) || len != sizeof(bytes))
+    return 0;
+
+  *id = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 |
+        (uint32_t) bytes[2] << 8 | (uint32_t) bytes[3];
+
+  return 1;
+}
+
+/*
+ * List the credentials by short ID along with a challenge shared by all of
+ * them. The user either picks a credential, which has the challenge printed
+ * in full for it, or answers with a response tagged with the ID of the
+ * credential it was produced with: the ID, the authenticator data and the
+ * signature, separated by spaces. Only the selected credential is prepared
+ * and verified.
+ */
+int do_manual_select_authentication(const cfg_t *cfg, const device_t *devices,
+                                    const unsigned n_devs,
+                                    pam_handle_t *pamh) {
+  unsigned char cdh[32];
+  unsigned char id[CRED_ID_LEN];
+  struct cred_index *index = NULL;
+  const struct cred_index *found;
+  struct cred_index key;
+  fido_assert_t *assert = NULL;
+  char prompt[MAX_PROMPT_LEN];
+  char *b64_cdh = NULL;
+  char *choice = NULL;
+  char *saveptr = NULL;
+  char *tag;
+  char *b64_authdata;
+  char *b64_sig;
+  int retval = PAM_AUTH_ERR;
+  int n;
+  int r;
+  unsigned i;
+  struct opts opts;
+
+  init_opts(&opts);
+
+  if (n_devs == 0 || (index = calloc(n_devs, sizeof(*index))) == NULL) {
+    debug_err(cfg, "Unable to allocate memory");
+    goto out;
+  }
+
   for (i = 0; i < n_devs; i++) {
-    fido_assert_free(&assert[i]);
-    reset_pk(&pk[i]);
+    if (!credential_id(&devices[i], id)) {
+      debug_dbg(cfg, "Unable to compute ID of credential %u", i + 1);
+      goto out;
+    }
+    index[i].id = (uint32_t) id[0] << 24 | (uint32_t) id[1] << 16 |
+                  (uint32_t) id[2] << 8 | (uint32_t) id[3];
+    index[i].idx = i;
   }
 
-  free(b64_challenge);
+  /* An ID shared by two credentials could not tell them apart. */
+  qsort(index, n_devs, sizeof(*index), cmp_cred_index);
+  for (i = 1; i < n_devs; i++) {
+    if (index[i].id == index[i - 1].id) {
+      debug_warn(cfg, "Credentials %u and %u share ID %08" PRIx32,
+                 index[i - 1].idx + 1, index[i].idx + 1, index[i].id);
+      goto out;
+    }
+  }
+
+  if (!random_bytes(cdh, sizeof(cdh)) ||
+      !b64_encode(cdh, sizeof(cdh), &b64_cdh)) {
+    debug_err(cfg, "Failed to generate challenge");
+    goto out;
+  }
+
+  n = snprintf(prompt, sizeof(prompt), "Challenge: %s", b64_cdh);
+  if (n <= 0 || (size_t) n >= sizeof(prompt)) {
+    debug_dbg(cfg, "Failed to print challenge");
+    goto out;
+  }
+  converse(pamh, PAM_TEXT_INFO, prompt);
+
+  for (i = 0; i < n_devs; i++) {
+    n = snprintf(prompt, sizeof(prompt), "Credential %08" PRIx32 " (%s)",
+                 index[i].id, devices[index[i].idx].coseType);
+    if (n <= 0 || (size_t) n >= sizeof(prompt)) {
+      debug_dbg(cfg, "Failed to print credential list");
+      goto out;
+    }
+    converse(pamh, PAM_TEXT_INFO, prompt);
+  }
+
+  choice = converse(pamh, PAM_PROMPT_ECHO_ON, "Credential ID: ");
+  if (choice == NULL || (tag = strtok_r(choice, " \t", &saveptr)) == NULL ||
+      !parse_short_id(tag, &key.id)) {
+    debug_dbg(cfg, "Invalid credential ID");
+    goto out;
+  }
+
+  b64_authdata = strtok_r(NULL, " \t", &saveptr);
+  b64_sig = strtok_r(NULL, " \t", &saveptr);
+  if (b64_authdata != NULL &&
+      (b64_sig == NULL || strtok_r(NULL, " \t", &saveptr) != NULL)) {
+    debug_dbg(cfg, "Invalid tagged response");
+    goto out;
+  }
+
+  found = bsearch(&key, index, n_devs, sizeof(*index), cmp_cred_index);
+  if (found == NULL) {
+    debug_dbg(cfg, "Unknown credential ID %08" PRIx32, key.id);
+    goto out;
+  }
+  i = found->idx;
+
+  debug_dbg(cfg, "Attempting authentication with device number %d", i + 1);
+
+#ifndef WITH_FUZZING
+  fido_init(cfg->debug >= DEBUG_LVL_TRACE ? FIDO_DEBUG : 0);
+#else
+  fido_init(0);
+#endif
+
+  /* options used during authentication */
+  parse_opts(cfg, devices[i].attributes, &opts);
+  if ((assert = prepare_assert(cfg, &devices[i], &opts)) == NULL) {
+    debug_dbg(cfg, "Failed to prepare assert");
+    goto out;
+  }
+
+  r = fido_assert_set_clientdata_hash(assert, cdh, sizeof(cdh));
+  if (r != FIDO_OK) {
+    debug_dbg(cfg, "Unable to set challenge: %s (%d)", fido_strerr(r), r);
+    goto out;
+  }
+
+  if (b64_authdata != NULL) {
+    if (!manual_set_response(cfg, assert, b64_authdata, b64_sig)) {
+      debug_dbg(cfg, "Failed to get tagged response %u", i);
+      goto out;
+    }
+  } else {
+    n = snprintf(prompt, sizeof(prompt), "Challenge %08" PRIx32 ":",
+                 found->id);
+    if (n <= 0 || (size_t) n >= sizeof(prompt)) {
+      debug_dbg(cfg, "Failed to print challenge prompt");
+      goto out;
+    }
+
+    if (!manual_print_challenge(cfg, pamh, &devices[i], assert, prompt))
+      goto out;
+
+    converse(pamh, PAM_TEXT_INFO,
+             "Please pass the challenge above to fido2-assert, and "
+             "paste the result in the prompt below.");
+
+    if (!manual_get_assert(cfg, "Response: ", pamh, assert)) {
+      debug_dbg(cfg, "Failed to get assert %u", i);
+      goto out;
+    }
+  }
+
+  r = fido_assert_verify(assert, 0, devices[i].pk.type, devices[i].pk.ptr);
+  if (r == FIDO_OK && check_sigcount(cfg, &devices[i], assert)) {
+    retval = PAM_SUCCESS;
+    record_use(cfg, &devices[i]);
+  }
+
+out:
+  fido_assert_free(&assert);
+  free(b64_cdh);
+  free(choice);
+  free(index);
 
   return retval;
 }
+#endif /* NO_MANUAL */
 
 static int _converse(pam_handle_t *pamh, int nargs,
                      const struct pam_message **message,
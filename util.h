@@ -5,6 +5,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <security/pam_appl.h>
 
@@ -24,28 +25,62 @@
 #define SSH_ORIGIN "ssh:"
 
 #define DEVLIST_LEN 64
+#define CRED_ID_LEN 32      /* SHA-256 */
+#define CRED_SHORT_ID_LEN 8 /* hex digits shown to the user */
+
+/* A parsed credential public key, as consumed by fido_assert_verify(). */
+struct pk {
+  void *ptr;
+  int type;
+};
 
 typedef struct {
   char *publicKey;
   char *keyHandle;
   char *coseType;
   char *attributes;
+  char *rpId;
   int old_format;
+  /* decoded when the credential is validated on load */
+  unsigned char *kh; /* NULL for resident credentials */
+  size_t kh_len;
+  struct pk pk;
 } device_t;
 
 int get_devices_from_authfile(const cfg_t *cfg, const char *username,
                               device_t *devices, unsigned *n_devs);
+int get_devices_from_authfile_st(const cfg_t *cfg, const char *username,
+                                 device_t *devices, unsigned *n_devs,
+                                 struct stat *st_p, char **migrated);
+int file_unchanged(const struct stat *prev, const struct stat *st);
+void reset_device(device_t *device);
 void free_devices(device_t *devices, const unsigned n_devs);
+int parse_native_credential(const cfg_t *cfg, char *s, device_t *cred);
+int format_native_credential(const device_t *device, char **out);
+int credential_id(const device_t *device, unsigned char id[CRED_ID_LEN]);
+const char *credential_rp(const cfg_t *cfg, const device_t *device);
+unsigned validate_devices(const cfg_t *cfg, device_t *devices, unsigned n_devs);
+void reset_pk(struct pk *pk);
+int verify_assertion(const cfg_t *cfg, const device_t *device,
+                     const unsigned char *cdh, size_t cdh_len,
+                     const unsigned char *authdata, size_t authdata_len,
+                     const unsigned char *sig, size_t sig_len);
 
+int count_authenticators(const cfg_t *cfg, size_t *n);
 int do_authentication(const cfg_t *cfg, const device_t *devices,
                       const unsigned n_devs, pam_handle_t *pamh);
+int do_interactive_authentication(const cfg_t *cfg, const device_t *devices,
+                                  const unsigned n_devs, pam_handle_t *pamh);
+#ifndef NO_MANUAL
 int do_manual_authentication(const cfg_t *cfg, const device_t *devices,
                              const unsigned n_devs, pam_handle_t *pamh);
+int do_manual_select_authentication(const cfg_t *cfg, const device_t *devices,
+                                    const unsigned n_devs, pam_handle_t *pamh);
+#endif
 char *converse(pam_handle_t *pamh, int echocode, const char *prompt);
 int random_bytes(void *, size_t);
 int cose_type(const char *, int *);
 const char *cose_string(int);
-char *expand_variables(const char *, const char *);
 
 #if !defined(HAVE_EXPLICIT_BZERO)
 void explicit_bzero(void *, size_t);